@@ -0,0 +1,2 @@
+benchmarks/fib/fib.fn = 0x2000
+benchmarks/fib/main.fn = 0xF000
@@ -0,0 +1,4 @@
+# 20x20 byte matrices, row major
+benchmarks/matmul/a.dat = 0x4000
+benchmarks/matmul/b.dat = 0x4200
+benchmarks/matmul/main.fn = 0xF000
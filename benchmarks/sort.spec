@@ -0,0 +1,2 @@
+benchmarks/sort/data.dat = 0x4000
+benchmarks/sort/main.fn = 0xF000
@@ -0,0 +1,4 @@
+# the pattern sits at address 0 so pattern index and address coincide
+benchmarks/strsearch/pattern.str = 0x0000
+benchmarks/strsearch/text.str = 0x4000
+benchmarks/strsearch/main.fn = 0xF000
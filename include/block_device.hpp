@@ -0,0 +1,86 @@
+#ifndef BLOCK_DEVICE_HPP
+#define BLOCK_DEVICE_HPP
+
+#include <any>
+#include <array>
+#include <span>
+#include <string>
+
+#include "bytedefs.hpp"
+#include "cpu.hpp"
+
+namespace emulator {
+
+// Disk backed by a host file mapped with mmap, for guests whose data does
+// not fit in ram.
+//
+// The guest fills in the sector, buffer and count registers and stores a
+// command; whole sectors are then copied straight between the mapping and
+// the ram pages. Registers are big endian like words in guest memory:
+//
+//   0x00 sector      first sector of the transfer
+//   0x04 buffer      ram address of the transfer
+//   0x08 count       number of sectors
+//   0x0C command     store read_command or write_command to start
+//   0x0D status      0 after a good transfer, 1 after a bad one
+//   0x10 sectors     size of the disk in sectors; read only
+//
+// A file that cannot be opened for writing is attached read only and write
+// commands fail.
+struct block_device : cpu::ram_type::device_type {
+  static constexpr u32 sector_size = 512;
+  static constexpr u32 register_count = 0x14;
+  static constexpr u8 read_command = 1;
+  static constexpr u8 write_command = 2;
+  static constexpr u8 status_ok = 0;
+  static constexpr u8 status_error = 1;
+
+  // owner must outlive the disk
+  block_device(std::string const& path, cpu& owner);
+  ~block_device() override;
+
+  block_device(block_device const&) = delete;
+  block_device&
+  operator=(block_device const&) = delete;
+
+  [[nodiscard]] u64
+  sector_count() const noexcept;
+
+  // The whole disk, for transfers made by a dma_controller
+  [[nodiscard]] std::span<u8>
+  contents() const noexcept;
+
+  [[nodiscard]] bool
+  is_writable() const noexcept;
+
+  u8
+  read(u32 offset) override;
+
+  void
+  write(u32 offset, u8 value) override;
+
+  // Only the registers: the disk itself is not part of snapshots
+  std::any
+  save_state() override;
+
+  void
+  restore_state(std::any const& saved) override;
+
+ private:
+  [[nodiscard]] u32
+  word_at(u32 offset) const noexcept;
+
+  bool
+  transfer(u8 command);
+
+  cpu& owner;
+  cpu::ram_type& ram;
+  u8* data = nullptr;
+  u64 size = 0;
+  bool writable = true;
+  std::array<u8, register_count> registers{};
+};
+
+}  // namespace emulator
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef CLUSTER_HPP
+#define CLUSTER_HPP
+
+#include <atomic>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+// Link between emulator processes on one host that form a cluster.
+//
+// Every ordered pair of nodes has a single producer, single consumer ring
+// of 32 bit messages in its own POSIX shared memory segment, named
+// /<cluster name>-<from>-<to>. Each node only ever pushes to the rings it
+// sends on and pops from the rings it receives on, so no locks are needed.
+// Nodes keep their ram private and talk only through these rings.
+//
+// A node empties the rings it sends on when it starts, dropping messages an
+// earlier run of it left undelivered, and removes the rings it receives on
+// when it is destroyed.
+struct cluster {
+  static constexpr u32 ring_capacity = 4096;
+
+  // Open (creating if needed) the rings to and from every other node
+  cluster(std::string name, u32 node_id, u32 node_count);
+  ~cluster();
+
+  cluster(cluster const&) = delete;
+  cluster&
+  operator=(cluster const&) = delete;
+
+  [[nodiscard]] u32
+  node_id() const noexcept;
+
+  [[nodiscard]] u32
+  node_count() const noexcept;
+
+  // False if the destination does not exist or its ring is full
+  bool
+  send(u32 to, u32 message);
+
+  // The oldest message from the given node, if there is one
+  std::optional<u32>
+  receive(u32 from);
+
+  // Remove every segment of a cluster, e.g. after a crashed run
+  static void
+  unlink(std::string const& name, u32 node_count);
+
+ private:
+  struct ring {
+    alignas(64) std::atomic<u64> head;
+    alignas(64) std::atomic<u64> tail;
+    alignas(64) u32 slots[ring_capacity];
+  };
+  static_assert(std::atomic<u64>::is_always_lock_free,
+                "rings in shared memory need lock free atomics");
+
+  // this process' view of one ring, with a cached copy of the index the
+  // other end owns so most pushes and pops touch only their own line
+  struct endpoint {
+    ring* shared = nullptr;
+    u64 cached_other = 0;
+  };
+
+  static std::string
+  segment_name(std::string const& name, u32 from, u32 to);
+
+  static ring*
+  map_ring(std::string const& segment);
+
+  std::string name;
+  u32 id;
+  u32 count;
+  std::vector<endpoint> outgoing;
+  std::vector<endpoint> incoming;
+};
+
+}  // namespace emulator
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef CONSOLE_HPP
+#define CONSOLE_HPP
+
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <span>
+#include <string>
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+// The character device behind PUTC_R, PRINT_I_R and GETC_R. Every cpu talks
+// to its own console so several cpus can run side by side without sharing
+// the process' standard streams.
+struct console {
+  virtual ~console() = default;
+
+  virtual void
+  put_char(char c) = 0;
+
+  virtual void
+  put_int(u32 value) = 0;
+
+  // Next input byte, or EOF when there is no more input
+  virtual int
+  get_char() = 0;
+
+  // Write a run of bytes. Consoles that can take them in one go override
+  // this; by default they are written one at a time.
+  virtual void
+  write(std::span<char const> bytes);
+
+  // Read up to bytes.size() bytes, stopping after a newline, at EOF or once
+  // the input available so far is used up. Waits for at least one byte;
+  // returns how many were read, 0 only at EOF.
+  virtual std::size_t
+  read(std::span<char> bytes);
+
+  // False if get_char would have to wait for input. Consoles that cannot
+  // tell say true.
+  virtual bool
+  input_ready() {
+    return true;
+  }
+
+  // Push out any buffered output; called when the cpu halts
+  virtual void
+  flush() {}
+};
+
+// Decimal digits of value, as PRINT_I_R shows them. Returns the number of
+// characters written to out, which must have room for 10.
+std::size_t
+format_decimal(char* out, u32 value) noexcept;
+
+// Console over a pair of iostreams, std::cout and std::cin by default.
+//
+// Output is collected in a buffer and handed to the stream as one
+// unformatted write when the buffer fills, when input is read or on flush,
+// so guests do not pay for a stream insertion per character and never pick
+// up formatting flags left on the stream. The cores of a machine share the
+// standard console, so the buffer is locked. Input has a lock of its own, so
+// a core waiting for input does not hold up the others' output.
+struct stream_console : console {
+  static constexpr std::size_t buffer_size = 4096;
+
+  explicit stream_console(std::ostream& out = std::cout,
+                          std::istream& in = std::cin);
+  ~stream_console() override;
+
+  stream_console(stream_console const&) = delete;
+  stream_console&
+  operator=(stream_console const&) = delete;
+
+  void
+  put_char(char c) override;
+
+  void
+  put_int(u32 value) override;
+
+  int
+  get_char() override;
+
+  void
+  write(std::span<char const> bytes) override;
+
+  std::size_t
+  read(std::span<char> bytes) override;
+
+  void
+  flush() override;
+
+ private:
+  // flush with the lock held
+  void
+  drain();
+
+  std::mutex lock;
+  std::mutex input_lock;
+  std::ostream* out;
+  std::istream* in;
+  std::array<char, buffer_size> buffer;
+  std::size_t used = 0;
+};
+
+// Console that reads from a fixed input string and collects its output in
+// memory
+struct buffer_console : console {
+  explicit buffer_console(std::string input = "");
+
+  void
+  put_char(char c) override;
+
+  void
+  put_int(u32 value) override;
+
+  int
+  get_char() override;
+
+  void
+  write(std::span<char const> bytes) override;
+
+  std::size_t
+  read(std::span<char> bytes) override;
+
+  [[nodiscard]] std::string const&
+  output() const noexcept;
+
+ private:
+  std::string input;
+  std::size_t read_position = 0;
+  std::string written;
+};
+
+// Console whose input is fed by the host while the guest runs, possibly
+// from another thread. get_char waits for input until the console is
+// closed, and input_ready lets a scheduler park the guest instead.
+struct queue_console : console {
+  void
+  feed(std::string const& text);
+
+  // No more input will be fed; reads past the end return EOF
+  void
+  close();
+
+  void
+  put_char(char c) override;
+
+  void
+  put_int(u32 value) override;
+
+  int
+  get_char() override;
+
+  void
+  write(std::span<char const> bytes) override;
+
+  std::size_t
+  read(std::span<char> bytes) override;
+
+  bool
+  input_ready() override;
+
+  [[nodiscard]] std::string
+  output();
+
+ private:
+  std::mutex lock;
+  std::condition_variable fed;
+  std::deque<char> input;
+  bool closed = false;
+  std::string written;
+};
+
+// Console that passes everything through to another one and counts the
+// bytes that go each way, for the stats segment
+struct counting_console : console {
+  explicit counting_console(console& inner);
+
+  void
+  put_char(char c) override;
+
+  void
+  put_int(u32 value) override;
+
+  int
+  get_char() override;
+
+  void
+  write(std::span<char const> bytes) override;
+
+  std::size_t
+  read(std::span<char> bytes) override;
+
+  bool
+  input_ready() override;
+
+  void
+  flush() override;
+
+  [[nodiscard]] u64
+  bytes_in() const noexcept;
+
+  [[nodiscard]] u64
+  bytes_out() const noexcept;
+
+ private:
+  console& inner;
+  u64 in = 0;
+  u64 out = 0;
+};
+
+// The console cpus use until another one is attached
+console&
+standard_console();
+
+}  // namespace emulator
+
+#endif
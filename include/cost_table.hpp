@@ -0,0 +1,31 @@
+#ifndef COST_TABLE_HPP
+#define COST_TABLE_HPP
+
+#include <array>
+#include <string>
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+// Clock cycles charged for each instruction, indexed by opcode. Extended
+// instructions are charged their own entry on top of the EXT_INSTR prefix.
+struct cost_table {
+  std::array<u32, 256> base;
+  std::array<u32, 256> extended;
+
+  // One cycle for simple instructions, more for memory, multiplication,
+  // square roots, floating point, console and atomic instructions
+  static cost_table
+  defaults();
+
+  // Override entries from a file in the .spec format, one "0xNN = cycles"
+  // or "ext:0xNN = cycles" line per opcode. Like addresses in a .spec file
+  // the cycle counts are hexadecimal.
+  void
+  load(std::string const& filename);
+};
+
+}  // namespace emulator
+
+#endif
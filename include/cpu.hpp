@@ -1,5 +1,7 @@
 #ifndef CPU_H
 #define CPU_H
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cinttypes>
 #include <cmath>
@@ -8,7 +10,9 @@
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <optional>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <tuple>
@@ -17,9 +21,20 @@
 
 #include "byte_get.hpp"
 #include "bytedefs.hpp"
+#include "cluster.hpp"
+#include "console.hpp"
+#include "cost_table.hpp"
+#include "event_queue.hpp"
 #include "exceptions.hpp"
+#include "flight_recorder.hpp"
+#include "guest_position.hpp"
+#include "guest_task.hpp"
+#include "input_log.hpp"
 #include "memory.hpp"
+#include "memory_profile.hpp"
 #include "printer.hpp"
+#include "rng.hpp"
+#include "trace.hpp"
 
 namespace emulator {
 
@@ -40,10 +55,13 @@ struct fetch_result {
       : opcode(opcode), instruction(instruction) {}
 };
 
+struct time_machine;
+
 struct cpu {
   friend struct cpu_breaker;
+  friend struct time_machine;
 
-  static bool debugging;
+  using ram_type = memory<u8, 128, 512, u32>;
 
   struct opcodes {
     /* 0x01 */ static constexpr u8 MOVE = 0x01;
@@ -109,6 +127,22 @@ struct cpu {
     /* 0x92 */ static constexpr u8 FSUB_DSI = 0x92;
     /* 0x94 */ static constexpr u8 FMULT_DSI = 0x94;
     /* 0xA2 */ static constexpr u8 FSQRT_R_I = 0xA2;
+    /* 0xB1 */ static constexpr u8 RDCYCLE = 0xB1;
+    /* 0xB2 */ static constexpr u8 RDINSTRET = 0xB2;
+    /* 0xB3 */ static constexpr u8 RDTIME = 0xB3;
+    /* 0xB4 */ static constexpr u8 RDBRANCH = 0xB4;
+    /* 0xB5 */ static constexpr u8 RDMEMOPS = 0xB5;
+    /* 0xC1 */ static constexpr u8 ATOMIC_CAS = 0xC1;
+    /* 0xC2 */ static constexpr u8 ATOMIC_FETCH_ADD = 0xC2;
+    /* 0xCF */ static constexpr u8 FENCE = 0xCF;
+    /* 0xD1 */ static constexpr u8 SEND = 0xD1;
+    /* 0xD2 */ static constexpr u8 RECV = 0xD2;
+    /* 0xD3 */ static constexpr u8 NODE_ID = 0xD3;
+    /* 0xE1 */ static constexpr u8 PUTS = 0xE1;
+    /* 0xE2 */ static constexpr u8 WRITE_BYTES = 0xE2;
+    /* 0xE3 */ static constexpr u8 READ_BYTES = 0xE3;
+    /* 0xF1 */ static constexpr u8 RETI = 0xF1;
+    /* 0xF2 */ static constexpr u8 INT_MASK = 0xF2;
   };
 
   struct ctrl_bits {
@@ -116,22 +150,94 @@ struct cpu {
     static constexpr u32 CTRL_CARRY_BIT = 0x00000001 << 1;
     static constexpr u32 CTRL_NEG_BIT = 0x00000001 << 2;
     static constexpr u32 CTRL_TEST_TRUE = 0x00000001 << 3;
+    static constexpr u32 CTRL_INT_ENABLE = 0x00000001 << 4;
+    static constexpr u32 CTRL_INT_MASK = 0x000000ff << 8;
     static constexpr u32 CTRL_EXT_FNC = 0x80000000;
   };
 
+  // Why the guest faulted, as it reads it from the fault register
+  struct fault_codes {
+    static constexpr u32 NONE = 0;
+    static constexpr u32 BAD_OPCODE = 1;
+    static constexpr u32 BAD_REGISTER = 2;
+    static constexpr u32 BAD_ADDRESS = 3;
+    static constexpr u32 UNINITIALIZED_FETCH = 4;
+    static constexpr u32 MISALIGNED = 5;
+  };
+
   cpu();
 
+  // A core of a multi-core machine, sharing ram with the other cores
+  cpu(std::shared_ptr<ram_type> shared_ram, u32 core_id, u32 stack_base);
+
+  cpu(cpu const&) = delete;
+  cpu&
+  operator=(cpu const&) = delete;
+  ~cpu();
+
+  // Memory mapped console registers. Loading from console_data reads a byte
+  // of input (0xFF at the end of input) and storing to it writes a byte of
+  // output. Bit 0 of console_status is set while input is ready. Cores
+  // sharing ram share the registers, which act on the console of the core
+  // that accesses them.
+  static constexpr u32 console_data = 0xFE00;
+  static constexpr u32 console_status = 0xFE01;
+
+  // Interrupt line n jumps to the big endian address stored at
+  // interrupt_vectors + 4 * n
+  static constexpr u32 interrupt_lines = 8;
+  static constexpr u32 interrupt_vectors = 0xFD00;
+
+  // A fault jumps to the big endian address stored here, or stops the cpu
+  // if it is 0
+  static constexpr u32 trap_vector = interrupt_vectors + 4 * interrupt_lines;
+
   void
   reset();
 
-  int
+  // Fetch-decode-execute cycles so far; the clock the input log, the time
+  // machine and run_for count in
+  u64
   cycles() const noexcept;
 
+  // Cycles of the emulated clock so far, each instruction weighted by its
+  // entry in the cost table. Devices and pacing count in these.
+  u64
+  clock_cycles() const noexcept;
+
+  // Instructions executed so far, counting an extended instruction and its
+  // EXT_INSTR prefix once
+  [[nodiscard]] u64
+  instructions() const noexcept;
+
+  // Faults raised so far, whether or not the guest handled them
+  [[nodiscard]] u64
+  faults() const noexcept;
+
+  void
+  set_costs(cost_table const& table) noexcept;
+
+  // Slow the guest down so its clock runs at the given frequency in MHz of
+  // wall time, sleeping about once per emulated millisecond. 0 runs as fast
+  // as possible, which is the default.
+  void
+  set_frequency(double mhz);
+
   bool
   is_halted() const noexcept;
 
+  // The cause of the last fault, one of fault_codes
+  [[nodiscard]] u32
+  fault_cause() const noexcept;
+
+  [[nodiscard]] std::string
+  fault_description() const;
+
+  void
+  dump_registers() const;
+
   void
-  dump_registers(printer out = metaout) const;
+  dump_registers(printer out) const;
 
   void
   run();
@@ -139,12 +245,112 @@ struct cpu {
   auto
   tick() -> std::optional<long long>;
 
+  enum class stop_reason { halted, cycle_budget, time_budget, fault };
+
+  // Run until HALT, a fault the guest does not handle or until either budget
+  // is used up. The time budget is checked every time_check_interval cycles.
+  stop_reason
+  run_for(u64 max_cycles,
+          std::chrono::microseconds max_time =
+              std::chrono::microseconds::max());
+
+  static constexpr u64 time_check_interval = 1024;
+
+  // Run as a coroutine that yields every quantum cycles, and early when
+  // GETC_R finds no console input ready instead of blocking. See scheduler.
+  guest_task
+  run_task(u64 quantum);
+
+  [[nodiscard]] bool
+  input_ready() const;
+
   void
   debug_tick(std::string&, long long&);
 
   void
   set_memory(byte const* bytes, u64 count, u64 addr_start);
 
+  // Route GETC_R and READ_BYTES through a record or replay log. The log must
+  // outlive the cpu or be detached by passing nullptr.
+  void
+  attach_input_log(input_log* log) noexcept;
+
+  // Take periodic snapshots so the debugger can step backwards. The time
+  // machine must outlive the cpu or be detached by passing nullptr.
+  void
+  attach_time_machine(time_machine* machine) noexcept;
+
+  // Stream every instruction executed to a trace. The trace must outlive the
+  // cpu or be detached by passing nullptr.
+  void
+  attach_trace(trace_writer* writer) noexcept;
+
+  // Count every instruction's fetch and data access per block of ram. The
+  // profile must outlive the cpu or be detached by passing nullptr.
+  void
+  attach_memory_profile(memory_profile* profile) noexcept;
+
+  // Send console instructions to device instead of the standard streams.
+  // The device must outlive the cpu.
+  void
+  attach_console(console& device) noexcept;
+
+  // Join a cluster of emulator processes for SEND and RECV. The cluster must
+  // outlive the cpu.
+  void
+  attach_cluster(cluster& link) noexcept;
+
+  // Map a device over [base, base + length) of ram. The cpu keeps the
+  // device until it is destroyed.
+  void
+  add_device(std::unique_ptr<ram_type::device_type> device,
+             u32 base,
+             u32 length);
+
+  [[nodiscard]] ram_type&
+  get_ram() noexcept;
+
+  // Request an interrupt on a line. Safe to call from any thread, e.g. a
+  // device's worker; the cpu takes it before its next instruction once the
+  // guest has unmasked the line.
+  void
+  raise_interrupt(u32 line);
+
+  // Run what on this cpu's thread once the cycle count reaches cycle. Only
+  // for use from the cpu's own thread, e.g. by a device it is accessing.
+  void
+  schedule(u64 cycle, event_queue::action what);
+
+  // Tell the cpu a device wrote [addr, addr + length) of ram, so the
+  // debugger's search for the last write to an address finds it. Only for
+  // use from the cpu's own thread.
+  void
+  device_wrote(u32 addr, u32 length) noexcept;
+
+  // The pc and shadow call stack, for sampling from another thread
+  [[nodiscard]] guest_position const&
+  position() const noexcept;
+
+  // The last instructions this cpu executed
+  [[nodiscard]] flight_recorder&
+  recorder() noexcept;
+
+  // Dump the flight recorder to flight_output before the next instruction.
+  // Only stores to lock-free atomics, so a signal handler may call it.
+  void
+  request_flight_dump() noexcept;
+
+  // Where the flight recorder is dumped on request and when a fault stops
+  // the guest; nullptr for nowhere
+  std::ostream* flight_output = &std::cerr;
+
+  // Diagnostics for this cpu, off until given a stream so that cpus running
+  // in parallel do not share one
+  mutable printer metaout = printer::nullprinter;
+
+  bool debugging = false;
+  std::set<u32> breakpoints;
+
   template <typename InputIterator>
   void
   set_memory(InputIterator start, InputIterator end, u64 addr_start) {
@@ -153,8 +359,8 @@ struct cpu {
   }
 
  private:
-  [[noreturn]] static void
-  invalid_registers();
+  [[noreturn]] void
+  throw_fault() const;
 
   bool halted = false;
 
@@ -169,20 +375,188 @@ struct cpu {
   // permanently zero register good for TEST instructions
   u32 const z = 0;
 
+  // index of this core in its machine; read only
+  u32 cid;
+  u32 stack_base;
+
   // special
   u32 sp, ra, pc;
 
   // ctrl - for flag bits
   u32 ctrl;
 
-  // ram
-  memory<u8, 128, 512, u32> ram;
+  // the last fault; cause and address are guest registers 7 and 8
+  struct fault_state {
+    u32 cause = fault_codes::NONE;
+    u32 address = 0;
+    u32 pc = 0;
+    // raised by the current instruction and not yet taken
+    bool pending = false;
+    // taken with no handler installed
+    bool stopped = false;
+  };
+  fault_state fault;
+
+  // what the performance counter instructions and the stats segment read
+  // besides m_cycles; instructions retired are m_cycles less the EXT_INSTR
+  // prefixes
+  struct perf_counters {
+    u64 prefixes = 0;
+    u64 branches = 0;
+    u64 memory = 0;
+    u64 faults = 0;
+  };
+  perf_counters counted;
+
+  // where the instruction being executed starts, EXT_INSTR prefix included
+  u32 instruction_pc = 0;
+
+  // the last result written to a GP register by the current instruction
+  u32 written = 0;
+  flight_recorder flight;
+  guest_position published;
+  std::atomic<bool> flight_dump_requested = false;
+
+  // what an invalid register index decodes to
+  u32 scratch = 0;
+  f64 fscratch = 0;
+
+  // ram, possibly shared with other cores
+  std::shared_ptr<ram_type> shared_ram;
+  ram_type& ram;
 
   // convenience access for decoding instructions
-  std::vector<u32*> const regs = {{(u32*)&z, &a, &b, &x, &sp, &ra}};
+  std::vector<u32*> const regs = {
+      {(u32*)&z, &a, &b, &x, &sp, &ra, &cid, &fault.cause, &fault.address}};
   std::vector<f64*> const fregs = {{(f64*)&z, &fa, &fb, &fx}};
 
-  int m_cycles = 0;
+  u64 m_cycles = 0;
+  u64 m_clock_cycles = 0;
+  cost_table costs = cost_table::defaults();
+
+  double frequency = 0;
+  u64 pace_generation = 0;
+  u64 pace_start_cycles = 0;
+  std::chrono::steady_clock::time_point pace_start;
+
+  input_log* inputs = nullptr;
+  time_machine* travel = nullptr;
+  trace_writer* trace = nullptr;
+  memory_profile* heat = nullptr;
+  // the last data address the current instruction accessed and whether it
+  // wrote to ram
+  u32 accessed = trace_record::no_address;
+  bool stored = false;
+
+  // address whose writes are being searched for by the time machine
+  static constexpr u32 no_watch = ~0u;
+  u32 watch_address = no_watch;
+  u64 watch_hit = 0;
+
+  console* io = &standard_console();
+
+  // the console as seen through the memory mapped registers, mapped by the
+  // first core of a machine and used by all of them
+  struct console_port : ram_type::device_type {
+    explicit console_port(cpu& owner) : owner(owner) {}
+
+    u8
+    read(u32 offset) override;
+
+    void
+    write(u32 offset, u8 value) override;
+
+    cpu& owner;
+  };
+  console_port port{*this};
+  event_queue events;
+  // cycle at which step() next looks at events and interrupts; lowered by
+  // anything that might need attention sooner
+  std::atomic<u64> next_event = event_queue::never;
+  std::atomic<u32> pending_interrupts = 0;
+  std::vector<std::unique_ptr<ram_type::device_type>> devices;
+
+  rng random;
+  cluster* node = nullptr;
+
+  // set while running as a guest_task; GETC_R then waits by yielding
+  bool cooperative = false;
+  bool waiting_for_input = false;
+
+  [[nodiscard]] u32
+  console_input();
+
+  // The host's monotonic clock in nanoseconds, recorded and replayed like
+  // console input
+  [[nodiscard]] u64
+  host_time();
+
+  // SEND and RECV on the cluster. Other nodes decide whether they succeed,
+  // so the results are recorded and replayed like console input, and
+  // nothing is sent while re-executing or replaying.
+  [[nodiscard]] bool
+  cluster_send(u32 to, u32 message);
+
+  [[nodiscard]] std::optional<u32>
+  cluster_receive(u32 from);
+
+  // Write a 64-bit counter to the register pair of a RD* instruction
+  void
+  write_counter(u32 instruction, u64 value);
+
+  // Bulk console transfers for PUTS, WRITE_BYTES and READ_BYTES. Each
+  // returns the number of bytes moved.
+  u32
+  console_puts(u32 addr);
+
+  void
+  console_write(u32 addr, u32 length);
+
+  u32
+  console_read(u32 addr, u32 length);
+
+  [[nodiscard]] bool
+  in_ram(u32 addr, u32 length) const noexcept;
+
+  // Like in_ram but raises BAD_ADDRESS for a range outside ram
+  [[nodiscard]] bool
+  check_range(u32 addr, u32 length) noexcept;
+
+  // check_range for a word, which must also be aligned for the atomic
+  // instructions
+  [[nodiscard]] bool
+  check_aligned(u32 addr) noexcept;
+
+  // Record a fault to be taken before the next instruction. Only the first
+  // fault of an instruction counts.
+  void
+  raise_fault(u32 cause, u32 address) noexcept;
+
+  // jump to the trap handler, or stop if there is none
+  void
+  take_fault();
+
+  // push the return address and ctrl for RETI and jump to handler
+  void
+  enter_handler(u32 return_pc, u32 handler);
+
+  // one fetch-decode-execute cycle without the timing done by tick()
+  void
+  step();
+
+  // run due events and take a pending interrupt if the guest allows it
+  void
+  service_events();
+
+  // sleep off any lead the guest clock has over wall time
+  void
+  pace();
+
+  [[nodiscard]] bool
+  reexecuting() const noexcept;
+
+  void
+  note_write(u32 addr, u32 width) noexcept;
 
   void
   zero_check() const noexcept;
@@ -200,7 +574,10 @@ struct cpu {
   reg_store(u32 reg, u32 start_addr);
 
   [[nodiscard]] u32
-  fetch(u32 const& r) const;
+  reg_load(u32 start_addr);
+
+  [[nodiscard]] u32
+  fetch(u32 const& r);
 
   [[nodiscard]] fetch_result
   get_next_instruction();
@@ -216,7 +593,7 @@ struct cpu {
 
   template <typename RegType>
   [[nodiscard]] std::tuple<RegType*, RegType*, RegType*>
-  register_decode_dss(u32 instruction) const {
+  register_decode_dss(u32 instruction) {
     u32 ssb = byte_of<0>(instruction);
     u32 srb = byte_of<1>(instruction);
     u32 sdb = byte_of<2>(instruction);
@@ -228,7 +605,7 @@ struct cpu {
 
   template <typename RegType>
   [[nodiscard]] std::pair<RegType*, RegType*>
-  register_decode_dsi(u32 instruction) const {
+  register_decode_dsi(u32 instruction) {
     u32 srb = byte_of<1>(instruction);
     u32 sdb = byte_of<2>(instruction);
 
@@ -239,7 +616,7 @@ struct cpu {
 
   template <typename RegType>
   [[nodiscard]] std::pair<RegType*, RegType*>
-  register_decode_both(u32 instruction) const {
+  register_decode_both(u32 instruction) {
     u32 reg1 = byte_of<0>(instruction);
     u32 reg2 = byte_of<1>(instruction);
     metaout << "reg1 " << reg1 << "reg2 " << reg2 << " and " << std::hex
@@ -251,25 +628,41 @@ struct cpu {
 
   template <typename RegType>
   [[nodiscard]] RegType*
-  register_decode_first(u32 instruction) const {
+  register_decode_first(u32 instruction) {
     u32 reg1 = byte_of<0>(instruction);
     return reg_get_by_index<RegType>(reg1);
   }
 
   template <typename RegType>
   [[nodiscard]] RegType*
-  reg_get_by_index(u32 reg_index) const {
+  reg_get_by_index(u32 reg_index) {
     if constexpr (std::is_floating_point_v<RegType>) {
-      if (reg_index > fregs.size())
-        invalid_registers();
+      if (reg_index >= fregs.size()) [[unlikely]] {
+        raise_fault(fault_codes::BAD_REGISTER, reg_index);
+        return &fscratch;
+      }
       return fregs[reg_index];
     } else {
-      if (reg_index > regs.size())
-        invalid_registers();
+      if (reg_index >= regs.size()) [[unlikely]] {
+        raise_fault(fault_codes::BAD_REGISTER, reg_index);
+        return &scratch;
+      }
       return regs[reg_index];
     }
   }
 
+  // Where an instruction writes a register it decoded. cid, fault and faddr
+  // are read-only, so writing one raises BAD_REGISTER and writes scratch.
+  [[nodiscard]] u32*
+  writable(u32* reg) noexcept {
+    if (reg != &cid && reg != &fault.cause && reg != &fault.address)
+        [[likely]]
+      return reg;
+    auto index = std::find(regs.begin(), regs.end(), reg) - regs.begin();
+    raise_fault(fault_codes::BAD_REGISTER, static_cast<u32>(index));
+    return &scratch;
+  }
+
   template <u64 N, typename Return = u32>
     requires((sizeof(Return) * 8) >= N)
   [[nodiscard]] Return
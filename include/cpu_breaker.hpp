@@ -17,6 +17,9 @@ struct cpu_breaker {
   fetch_result
   get_next_instruction();
 
+  void
+  set_needed_ctrl(u32* regptr);
+
   u32&
   ref_a();
   u32&
@@ -104,6 +107,12 @@ struct cpu_breaker {
   reg_get_by_index(u32 reg_index) const {
     return breakee.reg_get_by_index<RegType>(reg_index);
   }
+
+  template <u64 N, typename Return = u32>
+  [[nodiscard]] Return
+  literal_decode(u32 instruction) const {
+    return breakee.literal_decode<N, Return>(instruction);
+  }
 };
 }  // namespace emulator
 #endif
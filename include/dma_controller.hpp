@@ -0,0 +1,111 @@
+#ifndef DMA_CONTROLLER_HPP
+#define DMA_CONTROLLER_HPP
+
+#include <any>
+#include <array>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "block_device.hpp"
+#include "bytedefs.hpp"
+#include "cpu.hpp"
+
+namespace emulator {
+
+// Copies between ram and ram, or between a block device and ram, on a host
+// worker thread while the guest keeps running.
+//
+// Registers, big endian like words in guest memory:
+//
+//   0x00 source        ram address, or first sector for disk_to_ram
+//   0x04 destination   ram address, or first sector for ram_to_disk
+//   0x08 length        bytes to copy
+//   0x0C command       store a command to start a transfer
+//   0x0D status        status_idle, status_busy, status_done or
+//                      status_error
+//
+// The ram pages a transfer reads or writes are fenced until it finishes,
+// so guest loads and stores to them wait for the copy instead of seeing it
+// half done. Commands stored while a transfer is running are ignored. The
+// guest sees a transfer finish a number of cycles set by its length after
+// the command, however long the worker takes: an event in the cpu's queue
+// then turns the status to done and raises the controller's interrupt line.
+// That keeps runs repeatable for recording, replay and reverse execution.
+struct dma_controller : cpu::ram_type::device_type {
+  static constexpr u32 register_count = 0x0E;
+  static constexpr u8 ram_to_ram = 1;
+  static constexpr u8 disk_to_ram = 2;
+  static constexpr u8 ram_to_disk = 3;
+  static constexpr u8 status_idle = 0;
+  static constexpr u8 status_busy = 1;
+  static constexpr u8 status_done = 2;
+  static constexpr u8 status_error = 3;
+  static constexpr u32 default_line = 1;
+  // a transfer takes one cycle plus one for every bytes_per_cycle bytes
+  static constexpr u32 bytes_per_cycle = 8;
+
+  // owner and disk, if given, must outlive the controller
+  explicit dma_controller(cpu& owner,
+                          block_device* disk = nullptr,
+                          u32 line = default_line);
+  ~dma_controller() override;
+
+  dma_controller(dma_controller const&) = delete;
+  dma_controller&
+  operator=(dma_controller const&) = delete;
+
+  u8
+  read(u32 offset) override;
+
+  void
+  write(u32 offset, u8 value) override;
+
+  // Both wait for the worker first, so a snapshot never holds ram it is
+  // still writing and a restore does not race it
+  std::any
+  save_state() override;
+
+  void
+  restore_state(std::any const& saved) override;
+
+  // Block until the worker has finished the transfer in flight, if any
+  void
+  wait();
+
+ private:
+  struct transfer {
+    u8 command;
+    u32 source, destination, length;
+  };
+
+  [[nodiscard]] u32
+  word_at(u32 offset) const noexcept;
+
+  bool
+  start(u8 command);
+
+  void
+  copy(transfer const& t);
+
+  void
+  work();
+
+  cpu& owner;
+  cpu::ram_type& ram;
+  block_device* disk;
+  u32 line;
+  std::array<u8, register_count> registers{};
+
+  std::mutex lock;
+  std::condition_variable changed;
+  std::optional<transfer> pending;
+  bool copying = false;
+  bool stopping = false;
+  std::thread worker;
+};
+
+}  // namespace emulator
+
+#endif
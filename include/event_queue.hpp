@@ -0,0 +1,53 @@
+#ifndef EVENT_QUEUE_HPP
+#define EVENT_QUEUE_HPP
+
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+// Device events waiting for a cycle count, kept in a min-heap so the cpu
+// only has to compare the current cycle with the earliest one. Not thread
+// safe; events are scheduled and run on the cpu's own thread.
+struct event_queue {
+  static constexpr u64 never = ~0llu;
+
+  using action = std::function<void()>;
+
+  void
+  schedule(u64 cycle, action what);
+
+  // The cycle of the earliest event, or never
+  [[nodiscard]] u64
+  next_cycle() const noexcept;
+
+  // Run, in cycle order, every event due at or before now. Events they
+  // schedule for now or earlier run too.
+  void
+  run_due(u64 now);
+
+  [[nodiscard]] bool
+  empty() const noexcept;
+
+ private:
+  struct event {
+    u64 cycle;
+    u64 order;
+    action what;
+
+    bool
+    operator>(event const& other) const noexcept {
+      return cycle != other.cycle ? cycle > other.cycle : order > other.order;
+    }
+  };
+
+  std::priority_queue<event, std::vector<event>, std::greater<>> events;
+  u64 scheduled = 0;
+};
+
+}  // namespace emulator
+
+#endif
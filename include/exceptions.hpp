@@ -15,6 +15,12 @@ class no_such_register : public std::invalid_argument {
   explicit no_such_register(std::string const& msg)
       : std::invalid_argument(msg) {}
 };
+
+// A guest fault that stopped the cpu because the guest installed no handler
+class guest_fault : public std::runtime_error {
+ public:
+  explicit guest_fault(std::string const& msg) : std::runtime_error(msg) {}
+};
 }  // namespace emulator
 
 #endif
@@ -0,0 +1,60 @@
+#ifndef FLIGHT_RECORDER_HPP
+#define FLIGHT_RECORDER_HPP
+
+#include <ostream>
+#include <vector>
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+struct flight_record {
+  u64 cycle;
+  // where the instruction starts, EXT_INSTR prefix included
+  u32 pc;
+  u32 instruction;
+  // ctrl after the instruction
+  u32 ctrl;
+  // the last result the instruction wrote to a GP register, or 0
+  u32 value;
+};
+
+// The last instructions a cpu executed, for post-mortems.
+//
+// Each instruction overwrites the oldest record of a power of two ring,
+// which is a few stores with no branch or lock, so the recorder is always
+// on. It belongs to the cpu's thread; other threads ask the cpu to dump it.
+struct flight_recorder {
+  static constexpr std::size_t default_capacity = 256;
+
+  // Keeps the last capacity records, rounded up to a power of two
+  explicit flight_recorder(std::size_t capacity = default_capacity);
+
+  void
+  record(u64 cycle, u32 pc, u32 instruction, u32 ctrl, u32 value) noexcept {
+    records[head++ & mask] = {cycle, pc, instruction, ctrl, value};
+  }
+
+  [[nodiscard]] std::size_t
+  capacity() const noexcept;
+
+  // Records held, oldest first
+  [[nodiscard]] std::vector<flight_record>
+  history() const;
+
+  void
+  dump(std::ostream& os) const;
+
+  void
+  clear() noexcept;
+
+ private:
+  std::vector<flight_record> records;
+  u64 mask;
+  // records written so far
+  u64 head = 0;
+};
+
+}  // namespace emulator
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef GUEST_POSITION_HPP
+#define GUEST_POSITION_HPP
+
+#include <array>
+#include <atomic>
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+// Where a cpu is in the guest program, published for a sampling profiler
+// on another thread.
+//
+// The interpreter stores the pc of every instruction and keeps a shadow of
+// the guest's call stack on CALL_FN_I and RET, all with relaxed stores, so
+// publishing costs a plain store per instruction. A reader may see a frame
+// that is being pushed or popped; sampling profilers tolerate the odd torn
+// sample.
+struct guest_position {
+  static constexpr u32 max_depth = 128;
+
+  std::atomic<u32> pc = 0;
+  // calls not yet returned from; may exceed max_depth, whose frames are
+  // then not kept
+  std::atomic<u32> depth = 0;
+  // where each call went and where it will return to
+  std::array<std::atomic<u32>, max_depth> targets{};
+  std::array<std::atomic<u32>, max_depth> returns{};
+
+  void
+  call(u32 target, u32 return_address) noexcept {
+    u32 d = depth.load(std::memory_order_relaxed);
+    if (d < max_depth) {
+      targets[d].store(target, std::memory_order_relaxed);
+      returns[d].store(return_address, std::memory_order_relaxed);
+    }
+    depth.store(d + 1, std::memory_order_release);
+  }
+
+  void
+  ret() noexcept {
+    u32 d = depth.load(std::memory_order_relaxed);
+    depth.store(d == 0 ? 0 : d - 1, std::memory_order_release);
+  }
+};
+
+}  // namespace emulator
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef GUEST_TASK_HPP
+#define GUEST_TASK_HPP
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+namespace emulator {
+
+// Why a running guest handed control back to whoever resumed it
+enum class task_state { ready, blocked, halted };
+
+// Coroutine returned by cpu::run_task. Each resume() runs the guest until
+// it has used up its quantum, would block waiting for console input, or
+// halts.
+struct guest_task {
+  struct promise_type {
+    task_state state = task_state::ready;
+    std::exception_ptr error;
+
+    guest_task
+    get_return_object() {
+      return guest_task{handle::from_promise(*this)};
+    }
+
+    std::suspend_always
+    initial_suspend() noexcept {
+      return {};
+    }
+
+    std::suspend_always
+    final_suspend() noexcept {
+      return {};
+    }
+
+    std::suspend_always
+    yield_value(task_state s) noexcept {
+      state = s;
+      return {};
+    }
+
+    void
+    return_void() noexcept {
+      state = task_state::halted;
+    }
+
+    void
+    unhandled_exception() noexcept {
+      error = std::current_exception();
+      state = task_state::halted;
+    }
+  };
+
+  using handle = std::coroutine_handle<promise_type>;
+
+  guest_task() = default;
+  explicit guest_task(handle h) : coroutine(h) {}
+  guest_task(guest_task&& other) noexcept
+      : coroutine(std::exchange(other.coroutine, {})) {}
+  guest_task&
+  operator=(guest_task&& other) noexcept {
+    if (this != &other) {
+      if (coroutine)
+        coroutine.destroy();
+      coroutine = std::exchange(other.coroutine, {});
+    }
+    return *this;
+  }
+  ~guest_task() {
+    if (coroutine)
+      coroutine.destroy();
+  }
+
+  // Run the guest until its next yield. Rethrows anything the guest threw.
+  task_state
+  resume() {
+    if (!coroutine || coroutine.done())
+      return task_state::halted;
+    coroutine.resume();
+    if (coroutine.promise().error)
+      std::rethrow_exception(std::exchange(coroutine.promise().error, {}));
+    return coroutine.promise().state;
+  }
+
+  [[nodiscard]] bool
+  done() const noexcept {
+    return !coroutine || coroutine.done();
+  }
+
+ private:
+  handle coroutine;
+};
+
+}  // namespace emulator
+
+#endif
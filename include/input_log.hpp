@@ -0,0 +1,91 @@
+#ifndef INPUT_LOG_HPP
+#define INPUT_LOG_HPP
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+// Sources of nondeterminism a guest can observe. The numeric values are
+// part of the on-disk format, do not renumber them. rand is no longer
+// written since RND_NUM became a per-cpu deterministic generator. A read
+// entry holds the byte count of a READ_BYTES instruction and is followed by
+// one getc entry per byte, all on the same cycle. RDTIME logs two time
+// entries, the low word of the timestamp and then the high word. SEND logs
+// a send entry that is 1 if the message was queued. RECV logs a recv entry
+// that is 1 if a message arrived, followed by one holding the message.
+enum class input_kind : u8 {
+  getc = 0,
+  rand = 1,
+  read = 2,
+  time = 3,
+  send = 4,
+  recv = 5
+};
+
+// Compact binary log of every nondeterministic input a cpu consumes.
+//
+// Each entry is tagged with the cycle on which it was consumed so that a
+// replayed run can detect when it diverges from the recording. Entries are
+// encoded as
+//
+//   varint(cycle - previous cycle)  u8(kind)  varint(value)
+//
+// after a short header, and are buffered in memory so that recording costs
+// a handful of byte stores per input and one write(2) per buffer.
+struct input_log {
+  enum class mode { record, replay };
+
+  static constexpr char magic[4] = {'E', 'M', 'R', 'P'};
+  static constexpr u8 version = 1;
+  static constexpr std::size_t buffer_size = 64 * 1024;
+
+  static input_log
+  record_to(std::string const& filename);
+
+  static input_log
+  replay_from(std::string const& filename);
+
+  input_log(input_log&&) = default;
+  input_log&
+  operator=(input_log&&) = default;
+  ~input_log();
+
+  [[nodiscard]] mode
+  get_mode() const noexcept;
+
+  // Append an input consumed on the given cycle; record mode only
+  void
+  record(input_kind kind, u64 cycle, u32 value);
+
+  // Return the input the recording consumed on the given cycle; replay
+  // mode only. Throws std::runtime_error if the run has diverged.
+  [[nodiscard]] u32
+  replay(input_kind kind, u64 cycle);
+
+  // Write any buffered entries to the log file
+  void
+  flush();
+
+ private:
+  explicit input_log(mode m);
+
+  void
+  put_varint(u64 value);
+
+  [[nodiscard]] u64
+  get_varint();
+
+  mode m_mode;
+  std::ofstream out;
+  std::vector<u8> buffer;
+  std::size_t position = 0;
+  u64 last_cycle = 0;
+};
+
+}  // namespace emulator
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef LZ_HPP
+#define LZ_HPP
+
+#include <span>
+#include <vector>
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+// A small LZ77 block compressor for traces.
+//
+// A block is a run of sequences, each a token byte holding the literal count
+// in its high nibble and the match length less 4 in its low nibble, then any
+// extra literal count bytes, the literals, a little endian u16 offset back
+// into the output and any extra match length bytes. A nibble of 15 means
+// bytes of 255 follow until one that is less. The last sequence has no
+// match. Traces of loops are highly repetitive, so one hash probe per
+// position finds most of what there is to find.
+
+// Append the compressed form of in to out
+void
+lz_compress(std::span<u8 const> in, std::vector<u8>& out);
+
+// Append the raw_size bytes that in decompresses to to out. Throws
+// std::runtime_error if in is malformed.
+void
+lz_decompress(std::span<u8 const> in,
+              std::size_t raw_size,
+              std::vector<u8>& out);
+
+}  // namespace emulator
+
+#endif
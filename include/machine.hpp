@@ -0,0 +1,41 @@
+#ifndef MACHINE_HPP
+#define MACHINE_HPP
+
+#include <memory>
+#include <vector>
+
+#include "bytedefs.hpp"
+#include "cpu.hpp"
+
+namespace emulator {
+
+// Several cpu cores sharing one ram, each run on its own host thread.
+//
+// Every core starts at pc 0xF000 like a single cpu does, so guests tell the
+// cores apart with the read-only cid register. Core n's stack starts at
+// 0x0100 + n * stack_stride.
+struct machine {
+  static constexpr u32 default_stack_stride = 0x0200;
+
+  explicit machine(unsigned core_count,
+                   u32 stack_stride = default_stack_stride);
+
+  [[nodiscard]] unsigned
+  core_count() const noexcept;
+
+  cpu&
+  core(unsigned id);
+
+  // Run every core until all of them halt. An exception thrown by any core
+  // is rethrown once all the others have stopped.
+  void
+  run();
+
+ private:
+  std::shared_ptr<cpu::ram_type> ram;
+  std::vector<std::unique_ptr<cpu>> cores;
+};
+
+}  // namespace emulator
+
+#endif
@@ -1,10 +1,16 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <algorithm>
+#include <any>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <iostream>
+#include <span>
 #include <stdexcept>
+#include <thread>
 #include <type_traits>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -21,11 +27,19 @@ struct page {
 
   WordSize* bank;
   explicit page() { bank = new WordSize[ByteCount]; }
+  page(page const& other) : size(other.size), bank(new WordSize[ByteCount]) {
+    std::copy(other.bank, other.bank + ByteCount, bank);
+  }
+  page&
+  operator=(page const& other) {
+    if (this != &other)
+      std::copy(other.bank, other.bank + ByteCount, bank);
+    return *this;
+  }
   ~page() { delete[] bank; }
   [[maybe_unused]] void
   initialize() {
-    for (int i = 0; i < ByteCount; i++)
-      bank[i] = static_cast<WordSize>(0);
+    std::fill_n(bank, ByteCount, static_cast<WordSize>(0));
   }
   WordSize&
   operator[](BusSize addr) {
@@ -52,19 +66,71 @@ struct page {
 #endif
 };
 
+// A peripheral that answers loads and stores to a range of addresses in
+// place of ram. Offsets are relative to the start of the range.
+template <std::integral WordSize, std::integral BusSize = WordSize>
+struct device {
+  virtual ~device() = default;
+
+  virtual WordSize
+  read(BusSize offset) = 0;
+
+  virtual void
+  write(BusSize offset, WordSize value) = 0;
+
+  // What a snapshot of the machine keeps of the device, and putting it back
+  // when the snapshot is restored. Devices without state keep the defaults.
+  virtual std::any
+  save_state() {
+    return {};
+  }
+
+  virtual void
+  restore_state(std::any const&) {}
+};
+
 template <std::integral WordSize,
           u64 PageCount,
           u64 PageSize = 4096,
           std::integral BusSize = WordSize>
 struct memory {
+  using page_type = page<WordSize, PageSize, BusSize>;
+  using device_type = device<WordSize, BusSize>;
+
   u64 pageCount = PageCount;
   u64 pageSize = PageSize;
 
-#ifdef UNSAFE_READ
-  mutable
-#endif
-      std::unordered_map<std::size_t, page<WordSize, PageSize, BusSize>>
-          pages;
+  // Pages are allocated on first write and installed with a compare and
+  // swap, so several cpus can share one memory without a lock
+  mutable std::array<std::atomic<page_type*>, PageCount> pages{};
+
+  memory() = default;
+
+  memory(memory const& other) { *this = other; }
+
+  memory&
+  operator=(memory const& other) {
+    if (this == &other)
+      return *this;
+    for (u64 i = 0; i < PageCount; i++) {
+      page_type* theirs = other.pages[i].load(std::memory_order_acquire);
+      page_type* ours = pages[i].load(std::memory_order_relaxed);
+      if (theirs == nullptr) {
+        delete ours;
+        pages[i].store(nullptr, std::memory_order_release);
+      } else if (ours == nullptr) {
+        pages[i].store(new page_type(*theirs), std::memory_order_release);
+      } else {
+        *ours = *theirs;
+      }
+    }
+    return *this;
+  }
+
+  ~memory() {
+    for (auto& p : pages)
+      delete p.load(std::memory_order_relaxed);
+  }
 
   static auto
   get_location(BusSize addr) -> std::pair<std::size_t, std::size_t> {
@@ -81,8 +147,7 @@ struct memory {
     // *metaout << "Getting memory at " << addr << std::endl;
     check_addr(addr);
     auto [page, offset] = get_location(addr);
-    allocated[page] = true;
-    return pages[page][offset];
+    return allocate(page)[offset];
   }
 
 #ifdef NO_BOUNDS_CHECK_MEM
@@ -103,16 +168,224 @@ struct memory {
     check_addr(addr);
     auto [page, offset] = get_location(addr);
 #ifdef UNSAFE_READ
-    return pages[page][offset];
+    return allocate(page)[offset];
 #else
-    if (!allocated[page])
+    page_type* p = pages[page].load(std::memory_order_acquire);
+    if (p == nullptr)
       throw std::runtime_error("readonly access of uninitialized memory");
-    return pages.at(page).at(offset);
+    return p->at(offset);
 #endif
   }
 
+  // Loads and stores made by the guest. Addresses mapped to a device go to
+  // the device, everything else to ram. Only pages holding a device or
+  // fenced for a transfer pay for the lookup. The flag is read with acquire
+  // so a released fence also publishes the data written behind it. Cpus
+  // sharing the memory access ram from several threads, so words are
+  // loaded and stored as relaxed atomics: unordered, but not data races.
+  WordSize
+  load(BusSize addr) {
+    check_addr(addr);
+    if (page_flags[get_location(addr).first].load(std::memory_order_acquire))
+        [[unlikely]] {
+      if (auto* m = flagged_page_access(addr))
+        return m->dev->read(addr - m->base);
+    }
+    return std::atomic_ref<WordSize>((*this)[addr])
+        .load(std::memory_order_relaxed);
+  }
+
+  void
+  store(BusSize addr, WordSize value) {
+    check_addr(addr);
+    if (page_flags[get_location(addr).first].load(std::memory_order_acquire))
+        [[unlikely]] {
+      if (auto* m = flagged_page_access(addr))
+        return m->dev->write(addr - m->base, value);
+    }
+    std::atomic_ref<WordSize>((*this)[addr])
+        .store(value, std::memory_order_relaxed);
+  }
+
+  // A relaxed load of ram that bypasses devices, for instruction fetch.
+  // Throws like the const operator[] if the page is not allocated.
+  [[nodiscard]] WordSize
+  load_ram(BusSize addr) const {
+    return std::atomic_ref<WordSize>(const_cast<WordSize&>((*this)[addr]))
+        .load(std::memory_order_relaxed);
+  }
+
+  // Route load and store for [base, base + length) to dev. Ranges may not
+  // overlap. Mappings are set up before the guest runs and are not copied
+  // along with the contents of memory. Instruction fetch, bulk and atomic
+  // instructions always see the ram behind a device.
+  void
+  map_device(BusSize base, BusSize length, device_type& dev) {
+    if (length == 0)
+      throw std::invalid_argument("Device mapped to an empty range");
+    check_addr(base);
+    check_addr(base + length - 1);
+    for (auto const& m : mappings) {
+      if (base < m.base + m.length && m.base < base + length)
+        throw std::invalid_argument("Device mapped over another device");
+    }
+    mappings.push_back({base, length, &dev});
+    set_page_flags(base, length, device_page);
+  }
+
+  void
+  unmap_device(device_type& dev) {
+    std::erase_if(mappings, [&](auto const& m) { return m.dev == &dev; });
+    for (auto& flags : page_flags)
+      flags.fetch_and(~device_page, std::memory_order_relaxed);
+    for (auto const& m : mappings)
+      set_page_flags(m.base, m.length, device_page);
+  }
+
+  // Hold guest loads and stores to the pages of [base, base + length) until
+  // release_pages, while another thread fills or drains them. Like devices,
+  // fences do not apply to instruction fetch, bulk or atomic instructions.
+  void
+  fence_pages(BusSize base, std::size_t length) {
+    set_page_flags(base, length, fenced_page);
+  }
+
+  void
+  release_pages(BusSize base, std::size_t length) {
+    if (length == 0)
+      return;
+    for (auto p = get_location(base).first;
+         p <= get_location(base + length - 1).first; p++)
+      page_flags[p].fetch_and(~fenced_page, std::memory_order_release);
+  }
+
+  // The device mapped at addr, or nullptr if it is ram
+  [[nodiscard]] device_type*
+  device_at(BusSize addr) const {
+    auto const* m = find_mapping(addr);
+    return m != nullptr ? m->dev : nullptr;
+  }
+
+  // The words from addr to the end of its page, at most length of them, so
+  // instructions that move whole ranges can copy a page at a time
+  [[nodiscard]] std::span<WordSize>
+  run_at(BusSize addr, std::size_t length) {
+    check_addr(addr);
+    auto [page, offset] = get_location(addr);
+    return {allocate(page).bank + offset,
+            std::min<std::size_t>(length, PageSize - offset)};
+  }
+
+  [[nodiscard]] std::span<WordSize const>
+  run_at(BusSize addr, std::size_t length) const {
+    check_addr(addr);
+    auto [page, offset] = get_location(addr);
+#ifdef UNSAFE_READ
+    page_type* p = &allocate(page);
+#else
+    page_type* p = pages[page].load(std::memory_order_acquire);
+    if (p == nullptr)
+      throw std::runtime_error("readonly access of uninitialized memory");
+#endif
+    return {p->bank + offset, std::min<std::size_t>(length, PageSize - offset)};
+  }
+
+  [[nodiscard]] bool
+  is_allocated(BusSize addr) const {
+    auto [page, offset] = get_location(addr);
+    return page < PageCount &&
+           pages[page].load(std::memory_order_acquire) != nullptr;
+  }
+
+  [[nodiscard]] std::size_t
+  allocated_pages() const {
+    return std::count_if(pages.begin(), pages.end(), [](auto const& p) {
+      return p.load(std::memory_order_relaxed) != nullptr;
+    });
+  }
+
+  // The aligned 32 bit big endian word at addr, for atomic read-modify-write
+  // instructions. Plain loads and stores are relaxed and not ordered with
+  // respect to other cpus; these are sequentially consistent.
+  [[nodiscard]] std::atomic_ref<u32>
+  atomic_word(BusSize addr)
+    requires(sizeof(WordSize) == 1)
+  {
+    check_addr(addr + 3);
+    if (addr % 4 != 0)
+      throw std::invalid_argument("Atomic access to an unaligned address");
+    auto [page, offset] = get_location(addr);
+    return std::atomic_ref<u32>(
+        *reinterpret_cast<u32*>(&allocate(page).bank[offset]));
+  }
+
+  // Convert between a word as the guest stores it (most significant byte
+  // first) and as the host's atomic_word sees it
+  static constexpr u32
+  guest_word(u32 host) noexcept {
+    if constexpr (std::endian::native == std::endian::little)
+      return ((host & 0xff) << 24) | ((host & 0xff00) << 8) |
+             ((host >> 8) & 0xff00) | (host >> 24);
+    else
+      return host;
+  }
+
  private:
-  mutable std::unordered_map<std::size_t, bool> allocated;
+  struct mapping {
+    BusSize base;
+    BusSize length;
+    device_type* dev;
+  };
+
+  static constexpr u8 device_page = 1;
+  static constexpr u8 fenced_page = 2;
+
+  [[nodiscard]] mapping const*
+  find_mapping(BusSize addr) const {
+    for (auto const& m : mappings) {
+      if (addr - m.base < m.length)
+        return &m;
+    }
+    return nullptr;
+  }
+
+  // Wait out a fence on addr's page, then find the device at addr if any
+  mapping const*
+  flagged_page_access(BusSize addr) const {
+    auto& flags = page_flags[get_location(addr).first];
+    while (flags.load(std::memory_order_acquire) & fenced_page)
+      std::this_thread::yield();
+    return find_mapping(addr);
+  }
+
+  void
+  set_page_flags(BusSize base, std::size_t length, u8 flag) {
+    if (length == 0)
+      return;
+    check_addr(base);
+    check_addr(base + length - 1);
+    for (auto p = get_location(base).first;
+         p <= get_location(base + length - 1).first; p++)
+      page_flags[p].fetch_or(flag, std::memory_order_relaxed);
+  }
+
+  std::array<std::atomic<u8>, PageCount> page_flags{};
+  std::vector<mapping> mappings;
+
+  page_type&
+  allocate(std::size_t index) const {
+    page_type* p = pages[index].load(std::memory_order_acquire);
+    if (p != nullptr) [[likely]]
+      return *p;
+    auto* fresh = new page_type();
+    fresh->initialize();
+    if (pages[index].compare_exchange_strong(p, fresh,
+                                             std::memory_order_acq_rel))
+      return *fresh;
+    // another cpu installed the page first
+    delete fresh;
+    return *p;
+  }
 };
 }  // namespace emulator
 
@@ -0,0 +1,123 @@
+#ifndef MEMORY_PROFILE_HPP
+#define MEMORY_PROFILE_HPP
+
+#include <algorithm>
+#include <array>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+struct load_map;
+
+// How a guest uses its 64 KiB of ram: instruction fetches, data reads and
+// data writes counted per 64 byte block, the working set over windows of
+// instructions, and the range sp moved through.
+//
+// The cpu reports every instruction once it has executed: the address it
+// was fetched from and the first address of the data it read or wrote, if
+// any. An instruction that reads a range, like PUTS, counts once at the
+// start of it. Pages are the 512 byte pages of the cpu's ram.
+struct memory_profile {
+  static constexpr u32 ram_size = 0x10000;
+  static constexpr u32 block_size = 64;
+  static constexpr u32 page_size = 512;
+  static constexpr u32 block_count = ram_size / block_size;
+  static constexpr u32 page_count = ram_size / page_size;
+  static constexpr u32 no_address = ~0u;
+  static constexpr u64 default_window = 100000;
+
+  // The blocks and pages touched during one window of instructions
+  struct window_sample {
+    u64 first_instruction;
+    u32 blocks;
+    u32 pages;
+  };
+
+  struct block_counts {
+    u64 fetches = 0;
+    u64 reads = 0;
+    u64 writes = 0;
+  };
+
+  explicit memory_profile(u64 window = default_window);
+
+  void
+  record(u32 pc, u32 address, bool write, u32 sp) noexcept {
+    touch(pc);
+    counts[(pc % ram_size) / block_size].fetches++;
+    if (address != no_address) {
+      touch(address);
+      auto& c = counts[(address % ram_size) / block_size];
+      (write ? c.writes : c.reads)++;
+    }
+    lowest_sp = std::min(lowest_sp, sp);
+    highest_sp = std::max(highest_sp, sp);
+    if (++instructions % window == 0) [[unlikely]]
+      close_window();
+  }
+
+  [[nodiscard]] block_counts const&
+  block(u32 index) const noexcept;
+
+  // The working set of every window so far, including the unfinished one
+  [[nodiscard]] std::vector<window_sample>
+  windows() const;
+
+  // The lowest and highest values of sp seen after an instruction
+  [[nodiscard]] std::pair<u32, u32>
+  sp_range() const noexcept;
+
+  [[nodiscard]] u64
+  instruction_count() const noexcept;
+
+  // Totals, the hottest pages, working set sizes and the stack high-water
+  // mark. Pages are labelled with the program's segments if map is given.
+  void
+  write_report(std::ostream& os, load_map const* map = nullptr) const;
+
+  // One line per block that was used: its address, page and counts
+  void
+  write_csv(std::ostream& os) const;
+
+ private:
+  void
+  touch(u32 address) noexcept {
+    u32 b = (address % ram_size) / block_size;
+    if (block_window[b] == current) [[likely]]
+      return;
+    block_window[b] = current;
+    window_blocks++;
+    u32 p = (address % ram_size) / page_size;
+    if (page_window[p] != current) {
+      page_window[p] = current;
+      window_pages++;
+    }
+  }
+
+  void
+  close_window();
+
+  u64 window;
+  u64 instructions = 0;
+  std::array<block_counts, block_count> counts{};
+
+  // the window each block and page was last touched in, counting from 1
+  // so that 0 is never
+  u64 current = 1;
+  std::array<u64, block_count> block_window{};
+  std::array<u64, page_count> page_window{};
+  u32 window_blocks = 0;
+  u32 window_pages = 0;
+  std::vector<window_sample> closed;
+
+  u32 lowest_sp = ~0u;
+  u32 highest_sp = 0;
+};
+
+}  // namespace emulator
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef PERF_BASELINE_HPP
+#define PERF_BASELINE_HPP
+
+#include <map>
+#include <optional>
+#include <string>
+
+namespace emulator {
+
+// Reference results that bench and emucorpus compare their runs with.
+//
+// On disk this is a flat JSON object from a benchmark name to its best
+// result, written in name order so a regenerated baseline diffs one line per
+// benchmark that changed.
+struct perf_baseline {
+  std::map<std::string, double> values;
+
+  // Throws if the file exists but is malformed; a missing file is empty
+  static perf_baseline
+  read(std::string const& filename);
+
+  void
+  write(std::string const& filename) const;
+
+  [[nodiscard]] std::optional<double>
+  find(std::string const& name) const;
+};
+
+}  // namespace emulator
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bytedefs.hpp"
+#include "cpu.hpp"
+
+namespace emulator {
+
+// The segments a program was loaded into, named after their files
+struct load_map {
+  struct segment {
+    u32 start;
+    u32 end;
+    std::string name;
+  };
+
+  std::vector<segment> segments;
+
+  // The segments of a *.spec, *.prog or a.out file: one per file a .spec
+  // loads, the program and its bootstrap for a .prog, nothing for an a.out
+  static load_map
+  of_program(std::string const& name);
+
+  // The name of the segment holding addr, plus the offset into it unless
+  // addr is its start; the address in hex outside every segment
+  [[nodiscard]] std::string
+  label(u32 addr) const;
+
+  // Just the name of the segment holding addr
+  [[nodiscard]] std::string
+  segment_of(u32 addr) const;
+
+ private:
+  [[nodiscard]] segment const*
+  find(u32 addr) const;
+};
+
+// Samples the position of running cpus from a thread of its own.
+//
+// Every sample reads a cpu's published pc and shadow call stack and counts
+// the stack it finds: the segment the outermost code is in, then the
+// function each call went to. write_folded prints the counts in the folded
+// format flame graph tools read, one `frame;frame;frame count` per line.
+struct sampling_profiler {
+  static constexpr double default_hz = 997;
+
+  explicit sampling_profiler(load_map map, double hz = default_hz);
+
+  sampling_profiler(sampling_profiler const&) = delete;
+  sampling_profiler&
+  operator=(sampling_profiler const&) = delete;
+  ~sampling_profiler();
+
+  // Sample proc too; only before start. Stacks of a profiler watching
+  // several cpus start with the cpu's index.
+  void
+  watch(cpu const& proc);
+
+  void
+  start();
+
+  void
+  stop();
+
+  [[nodiscard]] u64
+  samples() const;
+
+  void
+  write_folded(std::ostream& os) const;
+
+ private:
+  void
+  sample(std::size_t index, guest_position const& position);
+
+  load_map map;
+  std::chrono::nanoseconds period;
+  std::vector<cpu const*> cpus;
+
+  mutable std::mutex mutex;
+  // the core, the outermost pc and then the call targets
+  std::map<std::vector<u32>, u64> stacks;
+  u64 total = 0;
+
+  std::atomic<bool> running = false;
+  std::thread sampler;
+};
+
+}  // namespace emulator
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef RNG_HPP
+#define RNG_HPP
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+// xoshiro128** seeded through splitmix64. Small enough to live inside every
+// cpu, which keeps RND_NUM deterministic per instance instead of depending
+// on the process-wide rand() state.
+struct rng {
+  explicit rng(u32 seed = 1) noexcept { this->seed(seed); }
+
+  void
+  seed(u32 value) noexcept {
+    u64 z = value;
+    for (auto& word : state) {
+      z += 0x9e3779b97f4a7c15llu;
+      u64 mixed = z;
+      mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9llu;
+      mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebllu;
+      word = static_cast<u32>(mixed ^ (mixed >> 31));
+    }
+  }
+
+  // Like rand(), results are in [0, 2^31)
+  u32
+  next() noexcept {
+    u32 result = rotl(state[1] * 5, 7) * 9;
+    u32 t = state[1] << 9;
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotl(state[3], 11);
+    return result >> 1;
+  }
+
+ private:
+  static constexpr u32
+  rotl(u32 x, int k) noexcept {
+    return (x << k) | (x >> (32 - k));
+  }
+
+  u32 state[4];
+};
+
+}  // namespace emulator
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef SAMPLE_STATS_HPP
+#define SAMPLE_STATS_HPP
+
+#include <cstddef>
+#include <span>
+
+namespace emulator {
+
+// Summary of repeated timings of the same work
+struct sample_stats {
+  double mean = 0;
+  // sample standard deviation, 0 for a single sample
+  double stddev = 0;
+  double min = 0;
+  double max = 0;
+  std::size_t count = 0;
+
+  static sample_stats
+  of(std::span<double const> samples);
+};
+
+}  // namespace emulator
+
+#endif
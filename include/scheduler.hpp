@@ -0,0 +1,64 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+#include "bytedefs.hpp"
+#include "cpu.hpp"
+#include "guest_task.hpp"
+
+namespace emulator {
+
+// Interleaves many cpus on a few host threads. Each cpu runs as a
+// guest_task; a guest that uses up its quantum goes to the back of the run
+// queue and one waiting for console input is parked until wake() finds its
+// console has input, so mostly idle guests cost nothing but memory.
+struct scheduler {
+  static constexpr u64 default_quantum = 10000;
+
+  // 0 threads means one per hardware thread
+  explicit scheduler(unsigned threads = 0);
+
+  // The cpu and its console must outlive run()
+  void
+  spawn(cpu& guest, u64 quantum = default_quantum);
+
+  // Have parked guests recheck their consoles, e.g. after feeding input.
+  // Those with input go back on the run queue ahead of the next quantum
+  // of any busy guest. Parked guests are not rechecked otherwise.
+  void
+  wake();
+
+  // Run until every guest has halted. The first exception thrown by a
+  // guest is rethrown once the others have finished.
+  void
+  run();
+
+ private:
+  struct entry {
+    cpu* guest;
+    guest_task task;
+  };
+
+  void
+  work();
+
+  unsigned threads;
+  std::vector<entry> entries;
+
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<std::size_t> ready;
+  std::vector<std::size_t> parked;
+  bool woken = false;
+  std::size_t unfinished = 0;
+  std::exception_ptr error;
+};
+
+}  // namespace emulator
+
+#endif
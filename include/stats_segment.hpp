@@ -0,0 +1,155 @@
+#ifndef STATS_SEGMENT_HPP
+#define STATS_SEGMENT_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+struct console;
+struct counting_console;
+struct cpu;
+
+// The counters of one emulator process at one point in time
+struct stats_snapshot {
+  u64 cycles = 0;
+  u64 clock_cycles = 0;
+  u64 instructions = 0;
+  // over the time since the previous snapshot
+  double instructions_per_second = 0;
+  u64 allocated_pages = 0;
+  u64 io_bytes_in = 0;
+  u64 io_bytes_out = 0;
+  u64 faults = 0;
+  u64 pc = 0;
+  u64 halted = 0;
+  // steady clock time of the snapshot in nanoseconds; steady clocks agree
+  // between the processes of one host
+  u64 published_ns = 0;
+};
+
+// Live counters of an emulator process in a POSIX shared memory segment,
+// so other processes can watch a guest without stopping or attaching to it.
+//
+// The segment holds a header naming the process and program, then the
+// counters of a stats_snapshot. One writer updates them under a sequence
+// lock: it makes the sequence odd while it stores the counters and even
+// again afterwards, and readers retry while the sequence is odd or changed
+// under them. Readers never block the writer. Counters are stored as
+// relaxed atomics so a torn read is detected rather than undefined.
+struct stats_segment {
+  static constexpr char magic[4] = {'E', 'M', 'S', 'T'};
+  static constexpr u32 version = 1;
+  static constexpr char name_prefix[] = "/emustat-";
+  static constexpr int read_attempts = 1000;
+
+  // Create the segment for this process, replacing a stale one of the same
+  // name. The segment is removed again when this object is destroyed.
+  static stats_segment
+  create(std::string const& name, std::string const& program);
+
+  // Map an existing segment to read it. Throws std::runtime_error if there
+  // is none or its layout is not this version's.
+  static stats_segment
+  open(std::string const& name);
+
+  // The name emulate publishes under by default, /emustat-<pid>
+  static std::string
+  default_name(u64 pid);
+
+  // Remove a segment by name, e.g. one left behind by a killed emulator
+  static void
+  remove(std::string const& name) noexcept;
+
+  // The names of the segments with the default prefix on this host
+  static std::vector<std::string>
+  list();
+
+  stats_segment(stats_segment&& other) noexcept;
+  stats_segment&
+  operator=(stats_segment&&) = delete;
+  ~stats_segment();
+
+  [[nodiscard]] std::string const&
+  name() const noexcept;
+
+  [[nodiscard]] u64
+  pid() const noexcept;
+
+  [[nodiscard]] std::string
+  program() const;
+
+  void
+  publish(stats_snapshot const& snapshot) noexcept;
+
+  // The latest snapshot, or nullopt if the writer stayed in the middle of
+  // an update for read_attempts tries, e.g. because it died there
+  [[nodiscard]] std::optional<stats_snapshot>
+  read() const noexcept;
+
+ private:
+  static constexpr std::size_t field_count =
+      sizeof(stats_snapshot) / sizeof(u64);
+  static_assert(sizeof(stats_snapshot) == field_count * sizeof(u64));
+  static_assert(std::atomic<u64>::is_always_lock_free,
+                "counters in shared memory need lock free atomics");
+
+  struct layout {
+    char magic[4];
+    u32 version;
+    u64 pid;
+    char program[112];
+    alignas(64) std::atomic<u64> sequence;
+    std::array<std::atomic<u64>, field_count> fields;
+  };
+
+  stats_segment(std::string name, layout* shared, bool owner);
+
+  std::string segment;
+  layout* shared;
+  bool owner;
+};
+
+// Publishes a cpu's counters to a stats segment from the cpu's own thread.
+//
+// start() schedules a device event every check_interval cycles of the
+// emulated clock that publishes once publish_period of wall time has passed
+// since the last snapshot, so the guest pays for a clock read every
+// check_interval cycles and nothing per instruction.
+struct stats_publisher {
+  static constexpr u64 check_interval = 1 << 16;
+  static constexpr std::chrono::milliseconds publish_period{100};
+
+  // io, if given, is the counting console the cpu writes to
+  stats_publisher(stats_segment& segment,
+                  cpu& proc,
+                  counting_console const* io = nullptr);
+
+  // Publish periodically while the cpu runs; call before running it
+  void
+  start();
+
+  // Publish now, e.g. after the guest has stopped
+  void
+  publish();
+
+ private:
+  void
+  check();
+
+  stats_segment& segment;
+  cpu& proc;
+  counting_console const* io;
+  u64 last_instructions = 0;
+  std::chrono::steady_clock::time_point last_publish;
+};
+
+}  // namespace emulator
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace emulator {
+
+// Fixed size pool of workers with one task deque each. Workers take tasks
+// from the front of their own deque and, when it runs dry, steal from the
+// back of the others, so uneven job lengths do not leave threads idle.
+struct thread_pool {
+  using task = std::function<void()>;
+
+  // 0 threads means one per hardware thread
+  explicit thread_pool(unsigned threads = 0);
+  ~thread_pool();
+
+  thread_pool(thread_pool const&) = delete;
+  thread_pool&
+  operator=(thread_pool const&) = delete;
+
+  void
+  submit(task t);
+
+  // Block until every submitted task has finished
+  void
+  wait_idle();
+
+  [[nodiscard]] unsigned
+  size() const noexcept;
+
+ private:
+  struct worker_queue {
+    std::mutex lock;
+    std::deque<task> tasks;
+  };
+
+  void
+  work(unsigned self);
+
+  bool
+  try_take(unsigned self, task& out);
+
+  std::vector<std::unique_ptr<worker_queue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<unsigned> next_queue = 0;
+  std::atomic<bool> stopping = false;
+
+  std::mutex state_lock;
+  std::condition_variable work_available;
+  std::condition_variable all_done;
+  std::size_t queued = 0;
+  std::size_t unfinished = 0;
+};
+
+}  // namespace emulator
+
+#endif
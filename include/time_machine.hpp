@@ -0,0 +1,128 @@
+#ifndef TIME_MACHINE_HPP
+#define TIME_MACHINE_HPP
+
+#include <any>
+#include <deque>
+#include <optional>
+#include <set>
+#include <vector>
+
+#include "bytedefs.hpp"
+#include "cpu.hpp"
+#include "event_queue.hpp"
+#include "input_log.hpp"
+
+namespace emulator {
+
+// Reverse execution for the interactive debugger.
+//
+// The machine state is snapshotted every `interval` cycles into a ring of at
+// most `capacity` snapshots. Moving backwards restores the nearest earlier
+// snapshot and re-executes forward to the requested cycle, feeding the cpu
+// the inputs it consumed the first time round so the re-execution is exact.
+//
+// When the ring is full every other snapshot in its older half is dropped,
+// so recent history stays dense (reverse steps never re-execute more than
+// `interval` cycles) while the ring still reaches back to the start of long
+// runs.
+struct time_machine {
+  static constexpr u64 default_interval = 100000;
+  static constexpr std::size_t default_capacity = 64;
+  static constexpr std::size_t history_limit = 1 << 20;
+
+  explicit time_machine(cpu& target,
+                        u64 interval = default_interval,
+                        std::size_t capacity = default_capacity);
+
+  [[nodiscard]] u64
+  next_snapshot_cycle() const noexcept;
+
+  void
+  take_snapshot();
+
+  [[nodiscard]] std::size_t
+  snapshot_count() const noexcept;
+
+  // True while the cpu is re-executing cycles it has already run once
+  [[nodiscard]] bool
+  replaying(u64 cycle) const noexcept;
+
+  void
+  remember_input(input_kind kind, u64 cycle, u32 value);
+
+  // The nth input consumed on the given cycle, counting from 0
+  [[nodiscard]] u32
+  replay_input(input_kind kind, u64 cycle, std::size_t nth = 0);
+
+  // Move to the state after the given number of cycles. Returns false if
+  // that point is older than the oldest snapshot or newer than the furthest
+  // point executed.
+  bool
+  seek(u64 cycle);
+
+  bool
+  step_back();
+
+  // Move back to the most recent earlier point where pc is a breakpoint, or
+  // to the oldest snapshot if there is none
+  std::optional<u64>
+  reverse_continue(std::set<u32> const& breakpoints);
+
+  // Move back to the most recent cycle that wrote to address. The cpu is left
+  // where it was if no retained history writes to it.
+  std::optional<u64>
+  last_write_to(u32 address);
+
+ private:
+  struct snapshot {
+    u64 cycle;
+    u64 clock_cycles;
+    bool halted;
+    u32 a, b, x;
+    f64 fa, fb, fx;
+    u32 sp, ra, pc, ctrl;
+    cpu::fault_state fault;
+    cpu::perf_counters counted;
+    rng random;
+    event_queue events;
+    u64 next_event;
+    u32 pending_interrupts;
+    // one per device of the cpu, in the order they were added
+    std::vector<std::any> devices;
+    cpu::ram_type ram;
+  };
+
+  struct remembered_input {
+    u64 cycle;
+    input_kind kind;
+    u32 value;
+  };
+
+  void
+  restore(snapshot const& snap);
+
+  void
+  run_until(u64 cycle);
+
+  template <typename Predicate>
+  std::optional<u64>
+  search_backwards(u64 limit, Predicate hit);
+
+  void
+  thin_snapshots();
+
+  void
+  prune_history();
+
+  cpu& target;
+  u64 interval;
+  std::size_t capacity;
+  u64 next_snapshot = 0;
+  u64 high_water = 0;
+  std::deque<snapshot> snapshots;
+  std::deque<remembered_input> history;
+};
+
+}  // namespace emulator
+
+#endif
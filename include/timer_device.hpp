@@ -0,0 +1,64 @@
+#ifndef TIMER_DEVICE_HPP
+#define TIMER_DEVICE_HPP
+
+#include <any>
+#include <array>
+
+#include "bytedefs.hpp"
+#include "cpu.hpp"
+
+namespace emulator {
+
+// Periodic timer counting the clock cycles of the cpu it is attached to.
+//
+// Registers, big endian like words in guest memory:
+//
+//   0x00 interval   cycles between expirations
+//   0x04 control    store 1 to start, 0 to stop
+//   0x08 count      expirations so far; read only
+//
+// Every expiration raises the timer's interrupt line. The timer is an event
+// in the cpu's event queue rather than something polled each cycle.
+struct timer_device : cpu::ram_type::device_type {
+  static constexpr u32 register_count = 0x0C;
+  static constexpr u32 default_line = 0;
+
+  // owner must outlive the timer
+  explicit timer_device(cpu& owner, u32 line = default_line);
+
+  u8
+  read(u32 offset) override;
+
+  void
+  write(u32 offset, u8 value) override;
+
+  std::any
+  save_state() override;
+
+  void
+  restore_state(std::any const& saved) override;
+
+ private:
+  struct state {
+    std::array<u8, register_count> registers;
+    u32 expirations;
+    u64 generation;
+  };
+
+  [[nodiscard]] u32
+  word_at(u32 offset) const noexcept;
+
+  void
+  arm();
+
+  cpu& owner;
+  u32 line;
+  std::array<u8, register_count> registers{};
+  u32 expirations = 0;
+  // bumped on every start and stop so stale events know to do nothing
+  u64 generation = 0;
+};
+
+}  // namespace emulator
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bytedefs.hpp"
+
+namespace emulator {
+
+// One executed instruction as a trace stores it
+struct trace_record {
+  static constexpr u32 no_address = ~0u;
+
+  // where the instruction word was fetched
+  u32 pc;
+  u8 opcode;
+  bool extended;
+  // the last result the instruction wrote to a GP register, or 0
+  u32 value;
+  // the last data address the instruction accessed, or no_address
+  u32 address;
+};
+
+// Layout shared by trace_writer and trace_reader.
+//
+// A trace file is the magic and version, then blocks of
+//
+//   u32 raw size  u32 stored size  u32 record count  stored bytes
+//
+// in little endian. The stored bytes are lz compressed unless the stored
+// size equals the raw size. Decompressed, every record is
+//
+//   u8(flags)  u8(opcode)
+//   varint(zigzag(pc - previous pc - 4))          if flags & pc_jump
+//   varint(value)                                 if flags & value_changed
+//   varint(zigzag(address - previous address))    if flags & has_address
+//
+// where the previous values start at 0 in every block, so blocks decode on
+// their own and straight line code costs two bytes an instruction before
+// compression.
+struct trace_format {
+  static constexpr char magic[4] = {'E', 'M', 'T', 'R'};
+  static constexpr u8 version = 1;
+  static constexpr std::size_t block_size = 1 << 16;
+
+  static constexpr u8 pc_jump = 1;
+  static constexpr u8 value_changed = 2;
+  static constexpr u8 has_address = 4;
+  static constexpr u8 extended = 8;
+};
+
+// Streams trace records to a file.
+//
+// The cpu encodes records into one block buffer while a background thread
+// compresses and writes the other, so recording only waits when the thread
+// falls a whole block behind.
+struct trace_writer {
+  explicit trace_writer(std::string const& filename);
+
+  trace_writer(trace_writer const&) = delete;
+  trace_writer&
+  operator=(trace_writer const&) = delete;
+  ~trace_writer();
+
+  void
+  record(u32 pc, u8 opcode, bool extended, u32 value, u32 address) noexcept {
+    // flags, opcode and three 5 byte varints at most
+    if (used + 17 > trace_format::block_size) [[unlikely]]
+      hand_off();
+    u8* start = filling.data() + used;
+    u8* p = start + 2;
+    u8 flags = extended ? trace_format::extended : 0;
+    if (pc != last_pc + 4) {
+      flags |= trace_format::pc_jump;
+      p = put_varint(p, zigzag(pc - last_pc - 4));
+    }
+    if (value != last_value) {
+      flags |= trace_format::value_changed;
+      p = put_varint(p, value);
+    }
+    if (address != trace_record::no_address) {
+      flags |= trace_format::has_address;
+      p = put_varint(p, zigzag(address - last_address));
+      last_address = address;
+    }
+    start[0] = flags;
+    start[1] = opcode;
+    last_pc = pc;
+    last_value = value;
+    used += p - start;
+    block_records++;
+    total_records++;
+  }
+
+  [[nodiscard]] u64
+  records() const noexcept;
+
+  // Write out every record so far and stop the background thread. Throws
+  // std::runtime_error if writing the file failed.
+  void
+  finish();
+
+ private:
+  static u32
+  zigzag(u32 delta) noexcept {
+    return (delta << 1) ^ static_cast<u32>(static_cast<i32>(delta) >> 31);
+  }
+
+  static u8*
+  put_varint(u8* p, u32 value) noexcept {
+    while (value >= 0x80) {
+      *p++ = static_cast<u8>(value | 0x80);
+      value >>= 7;
+    }
+    *p++ = static_cast<u8>(value);
+    return p;
+  }
+
+  // pass the filled block to the background thread and start a new one
+  void
+  hand_off();
+
+  void
+  write_loop();
+
+  std::ofstream out;
+  std::vector<u8> filling;
+  std::size_t used = 0;
+  u32 block_records = 0;
+  u64 total_records = 0;
+  u32 last_pc = 0, last_value = 0, last_address = 0;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<u8> pending;
+  std::size_t pending_used = 0;
+  u32 pending_records = 0;
+  bool pending_ready = false;
+  bool stopping = false;
+  bool failed = false;
+  std::thread writer;
+};
+
+// Reads the records of a trace file in order
+struct trace_reader {
+  // Throws std::runtime_error if the file is not a trace
+  explicit trace_reader(std::string const& filename);
+
+  // Decode the next record into r; false at the end of the trace. Throws
+  // std::runtime_error if the file is malformed.
+  bool
+  next(trace_record& r);
+
+  // Bytes of the file read so far and what they decompressed to
+  [[nodiscard]] u64
+  stored_bytes() const noexcept;
+
+  [[nodiscard]] u64
+  raw_bytes() const noexcept;
+
+ private:
+  bool
+  read_block();
+
+  u32
+  get_varint();
+
+  std::ifstream in;
+  std::string filename;
+  std::vector<u8> stored;
+  std::vector<u8> block;
+  std::size_t position = 0;
+  u32 block_records = 0;
+  u32 last_pc = 0, last_value = 0, last_address = 0;
+  u64 stored_total = 0;
+  u64 raw_total = 0;
+};
+
+}  // namespace emulator
+
+#endif
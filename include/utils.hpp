@@ -28,6 +28,16 @@ skip_comment(std::ifstream& f);
 std::map<std::string, emulator::u64>
 parse_program_spec(std::string const& config_name);
 
+void
+load_program_spec(std::string_view config_name, emulator::cpu& oncpu);
+
+void
+load_program_file(std::string_view filename, emulator::cpu& oncpu);
+
+// Load a *.spec, *.prog or a.out file, chosen by the name's extension
+void
+load_program(std::string const& name, emulator::cpu& oncpu);
+
 void
 run_program_spec(std::string_view config_name, emulator::cpu& oncpu);
 
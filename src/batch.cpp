@@ -0,0 +1,299 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bytedefs.hpp"
+#include "console.hpp"
+#include "cpu.hpp"
+#include "cpu_breaker.hpp"
+#include "printer.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+// Runs every program listed in a manifest on a pool of worker threads and
+// writes one JSON document with each program's outcome.
+//
+// Each manifest line names a *.spec, *.prog or a.out file, optionally
+// followed by a cycle budget and a time budget in milliseconds for that job.
+// A budget of '-' falls back to the command line default. Blank lines and
+// text after '#' are ignored.
+
+namespace {
+
+using emulator::u64;
+
+struct job {
+  std::string program;
+  u64 max_cycles;
+  u64 max_ms;
+};
+
+struct job_result {
+  std::string status;
+  std::string error;
+  u64 cycles = 0;
+  u64 clock_cycles = 0;
+  long long micros = 0;
+  std::string output;
+  // the flight recorder, dumped when a fault stops the guest
+  std::string flight;
+  emulator::u32 a = 0, b = 0, x = 0, sp = 0, ra = 0, pc = 0, ctrl = 0;
+  emulator::f64 fa = 0, fb = 0, fx = 0;
+};
+
+struct options {
+  std::string manifest;
+  std::string out;
+  unsigned threads = 0;
+  u64 max_cycles = ~0llu;
+  u64 max_ms = 0;
+};
+
+void
+usage() {
+  std::cerr << "usage: emubatch MANIFEST [--out FILE] [--threads N] "
+               "[--max-cycles N] [--max-ms N]"
+            << std::endl;
+}
+
+u64
+parse_budget(std::string const& tok, u64 fallback) {
+  if (tok.empty() || tok == "-")
+    return fallback;
+  return std::stoull(tok, nullptr, 0);
+}
+
+std::vector<job>
+read_manifest(options const& opts) {
+  std::ifstream f{opts.manifest};
+  if (!f)
+    throw std::runtime_error("Failed to open manifest " + opts.manifest);
+
+  std::vector<job> jobs;
+  std::string line;
+  while (std::getline(f, line)) {
+    if (auto hash = line.find('#'); hash != std::string::npos)
+      line.erase(hash);
+    std::stringstream ss{line};
+    std::string program, cycles, ms;
+    if (!(ss >> program))
+      continue;
+    ss >> cycles >> ms;
+    jobs.push_back({program, parse_budget(cycles, opts.max_cycles),
+                    parse_budget(ms, opts.max_ms)});
+  }
+  return jobs;
+}
+
+job_result
+run_job(job const& j) {
+  job_result result;
+  emulator::buffer_console io;
+  emulator::cpu proc;
+  emulator::cpu_breaker breaker{proc};
+  std::stringstream flight;
+  proc.metaout = emulator::printer::nullprinter;
+  proc.flight_output = &flight;
+  proc.attach_console(io);
+
+  auto start = std::chrono::steady_clock::now();
+  try {
+    load_program(j.program, proc);
+    auto time_budget = j.max_ms == 0 ? std::chrono::microseconds::max()
+                                     : std::chrono::microseconds(
+                                           j.max_ms * 1000);
+    switch (proc.run_for(j.max_cycles, time_budget)) {
+      case emulator::cpu::stop_reason::halted:
+        result.status = "halted";
+        break;
+      case emulator::cpu::stop_reason::cycle_budget:
+        result.status = "cycle_budget";
+        break;
+      case emulator::cpu::stop_reason::time_budget:
+        result.status = "time_budget";
+        break;
+      case emulator::cpu::stop_reason::fault:
+        result.status = "fault";
+        result.error = proc.fault_description();
+        break;
+    }
+  } catch (std::exception const& e) {
+    result.status = "error";
+    result.error = e.what();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  result.micros =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+          .count();
+  result.cycles = proc.cycles();
+  result.clock_cycles = proc.clock_cycles();
+  result.output = io.output();
+  result.flight = flight.str();
+  result.a = breaker.a();
+  result.b = breaker.b();
+  result.x = breaker.x();
+  result.sp = breaker.sp();
+  result.ra = breaker.ra();
+  result.pc = breaker.pc();
+  result.ctrl = breaker.ctrl();
+  result.fa = breaker.fa();
+  result.fb = breaker.fb();
+  result.fx = breaker.fx();
+  return result;
+}
+
+void
+write_json_string(std::ostream& os, std::string const& s) {
+  os << '"';
+  for (unsigned char c : s) {
+    switch (c) {
+      case '"':
+        os << "\\\"";
+        break;
+      case '\\':
+        os << "\\\\";
+        break;
+      case '\n':
+        os << "\\n";
+        break;
+      case '\t':
+        os << "\\t";
+        break;
+      default:
+        if (c < 0x20 || c >= 0x7f) {
+          char buf[8];
+          std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+          os << buf;
+        } else {
+          os << c;
+        }
+    }
+  }
+  os << '"';
+}
+
+void
+write_json_float(std::ostream& os, emulator::f64 value) {
+  if (std::isfinite(value))
+    os << value;
+  else
+    os << "null";
+}
+
+void
+write_results(std::ostream& os,
+              std::vector<job> const& jobs,
+              std::vector<job_result> const& results,
+              unsigned threads,
+              long long wall_micros) {
+  os << "{\n";
+  os << "  \"jobs\": " << jobs.size() << ",\n";
+  os << "  \"threads\": " << threads << ",\n";
+  os << "  \"wall_us\": " << wall_micros << ",\n";
+  os << "  \"results\": [";
+  for (std::size_t i = 0; i < jobs.size(); i++) {
+    auto const& r = results[i];
+    os << (i == 0 ? "\n" : ",\n") << "    {\"program\": ";
+    write_json_string(os, jobs[i].program);
+    os << ", \"status\": \"" << r.status << "\"";
+    if (!r.error.empty()) {
+      os << ", \"error\": ";
+      write_json_string(os, r.error);
+    }
+    os << ", \"cycles\": " << r.cycles
+       << ", \"clock_cycles\": " << r.clock_cycles << ", \"us\": " << r.micros;
+    os << ", \"output\": ";
+    write_json_string(os, r.output);
+    if (!r.flight.empty()) {
+      os << ", \"flight_recorder\": ";
+      write_json_string(os, r.flight);
+    }
+    os << ", \"registers\": {\"a\": " << r.a << ", \"b\": " << r.b
+       << ", \"x\": " << r.x << ", \"sp\": " << r.sp << ", \"ra\": " << r.ra
+       << ", \"pc\": " << r.pc << ", \"ctrl\": " << r.ctrl << ", \"fa\": ";
+    write_json_float(os, r.fa);
+    os << ", \"fb\": ";
+    write_json_float(os, r.fb);
+    os << ", \"fx\": ";
+    write_json_float(os, r.fx);
+    os << "}}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+}  // namespace
+
+int
+main(int argc, char const** argv) {
+  options opts;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--out" && has_value) {
+      opts.out = argv[++i];
+    } else if (arg == "--threads" && has_value) {
+      opts.threads = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--max-cycles" && has_value) {
+      opts.max_cycles = std::strtoull(argv[++i], nullptr, 0);
+    } else if (arg == "--max-ms" && has_value) {
+      opts.max_ms = std::strtoull(argv[++i], nullptr, 0);
+    } else if (opts.manifest.empty() && !arg.starts_with("--")) {
+      opts.manifest = arg;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (opts.manifest.empty()) {
+    usage();
+    return 1;
+  }
+
+  // the loaders report through the global printer
+  emulator::metaout = emulator::printer::nullprinter;
+
+  std::vector<job> jobs;
+  try {
+    jobs = read_manifest(opts);
+  } catch (std::exception const& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::vector<job_result> results(jobs.size());
+  auto start = std::chrono::steady_clock::now();
+  unsigned threads;
+  {
+    emulator::thread_pool pool{opts.threads};
+    threads = pool.size();
+    for (std::size_t i = 0; i < jobs.size(); i++)
+      pool.submit([&, i] { results[i] = run_job(jobs[i]); });
+    pool.wait_idle();
+  }
+  auto end = std::chrono::steady_clock::now();
+  auto wall =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+          .count();
+
+  if (opts.out.empty()) {
+    write_results(std::cout, jobs, results, threads, wall);
+  } else {
+    std::ofstream f{opts.out};
+    write_results(f, jobs, results, threads, wall);
+  }
+
+  std::size_t failed = 0;
+  for (auto const& r : results)
+    failed += r.status == "error" || r.status == "fault";
+  std::cerr << jobs.size() << " jobs, " << failed << " errors, " << wall
+            << " us on " << threads << " threads" << std::endl;
+  return failed == 0 ? 0 : 2;
+}
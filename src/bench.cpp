@@ -0,0 +1,436 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bytedefs.hpp"
+#include "cpu.hpp"
+#include "cpu_breaker.hpp"
+#include "emulator.hpp"
+#include "memory.hpp"
+#include "perf_baseline.hpp"
+#include "printer.hpp"
+#include "sample_stats.hpp"
+#include "utils.hpp"
+
+// Microbenchmarks for the hot paths of the interpreter.
+//
+// Each benchmark does a fixed number of operations per repetition. After one
+// warm up repetition the table reports the mean time per operation over the
+// repetitions, its standard deviation and the fastest repetition, so a change
+// to the engine or to memory<> can be checked against numbers. Dispatch
+// benchmarks count one operation per fetch-decode-execute cycle, so an
+// extended instruction counts as two.
+//
+// With --baseline FILE the fastest repetition of each benchmark is compared
+// with the one recorded in FILE. A single benchmark can land on a slow code or
+// heap alignment in one process and not the next, so only the geometric mean
+// of the ratios decides: the exit status is 2 if it is slower than --tolerance
+// allows, and single benchmarks that are that slow are listed. Those are
+// measured a second time first. --update-baseline records this run in FILE
+// instead.
+
+namespace {
+
+using emulator::byte;
+using emulator::u32;
+using emulator::u64;
+using ops = emulator::cpu::opcodes;
+
+struct benchmark {
+  std::string name;
+  u64 ops;
+  // does ops operations
+  std::function<void()> run;
+};
+
+struct result {
+  std::string name;
+  emulator::sample_stats ns_per_op;
+};
+
+struct options {
+  unsigned reps = 10;
+  std::string filter;
+  std::string json;
+  std::string baseline;
+  double tolerance = 0.25;
+  bool update_baseline = false;
+};
+
+void
+usage() {
+  std::cerr << "usage: bench [--reps N] [--filter TEXT] [--json FILE] "
+               "[--baseline FILE [--tolerance F] [--update-baseline]]"
+            << std::endl;
+}
+
+// keep the compiler from optimizing away a value that is never used
+template <typename T>
+inline void
+keep(T const& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct machine_state {
+  emulator::cpu proc;
+  emulator::cpu_breaker breaker{proc};
+
+  machine_state() { proc.metaout = emulator::printer::nullprinter; }
+};
+
+// A cpu looping over pattern, repeated to fill a page of code, forever
+std::shared_ptr<machine_state>
+looping_machine(std::vector<byte> const& pattern) {
+  constexpr u32 loop = 0x4000;
+  constexpr u32 code_size = 0x800;
+  auto state = std::make_shared<machine_state>();
+  std::vector<byte> code;
+  while (code.size() + pattern.size() + 4 <= code_size)
+    code.insert(code.end(), pattern.begin(), pattern.end());
+  std::vector<byte> jump = {ops::JMP, 0x00, 0x40, 0x00};
+  code.insert(code.end(), jump.begin(), jump.end());
+  state->proc.set_memory(code.data(), code.size(), loop);
+  state->proc.set_memory(jump.data(), jump.size(), 0xF000);
+  return state;
+}
+
+benchmark
+dispatch(std::string name, std::vector<byte> const& pattern) {
+  constexpr u64 cycles = 1 << 20;
+  auto state = looping_machine(pattern);
+  return {"dispatch/" + name, cycles,
+          [state] { state->proc.run_for(cycles); }};
+}
+
+std::vector<benchmark>
+memory_benchmarks() {
+  constexpr u64 count = 1 << 22;
+  using ram_type = emulator::cpu::ram_type;
+  auto mem = std::make_shared<ram_type>();
+  for (u32 addr = 0; addr < 0x10000; addr++)
+    (*mem)[addr] = static_cast<byte>(addr * 7);
+
+  return {
+      {"memory/operator[] read", count,
+       [mem] {
+         u32 sum = 0;
+         for (u64 i = 0; i < count; i++)
+           sum += (*mem)[(i * 61) & 0xffff];
+         keep(sum);
+       }},
+      {"memory/operator[] const read", count,
+       [mem] {
+         ram_type const& m = *mem;
+         u32 sum = 0;
+         for (u64 i = 0; i < count; i++)
+           sum += m[(i * 61) & 0xffff];
+         keep(sum);
+       }},
+      {"memory/operator[] write", count,
+       [mem] {
+         for (u64 i = 0; i < count; i++)
+           (*mem)[(i * 61) & 0xffff] = static_cast<byte>(i);
+         keep(mem.get());
+       }},
+      {"memory/load", count,
+       [mem] {
+         u32 sum = 0;
+         for (u64 i = 0; i < count; i++)
+           sum += mem->load((i * 61) & 0xffff);
+         keep(sum);
+       }},
+      {"memory/store", count,
+       [mem] {
+         for (u64 i = 0; i < count; i++)
+           mem->store((i * 61) & 0xffff, static_cast<byte>(i));
+         keep(mem.get());
+       }},
+  };
+}
+
+std::vector<benchmark>
+decode_benchmarks() {
+  constexpr u64 count = 1 << 22;
+  auto state = std::make_shared<machine_state>();
+  std::vector<byte> code(0x1000);
+  for (std::size_t i = 0; i < code.size(); i++)
+    code[i] = static_cast<byte>(i * 13);
+  state->proc.set_memory(code.data(), code.size(), 0x4000);
+
+  // valid register indices in every byte the decoders look at
+  auto instruction = [](u64 i) {
+    return static_cast<u32>(0x81000000 | ((i % 3) << 16) |
+                            (((i + 1) % 3) << 8) | ((i + 2) % 3));
+  };
+
+  return {
+      {"cpu/fetch", count,
+       [state] {
+         u32 sum = 0;
+         for (u64 i = 0; i < count; i++)
+           sum += state->breaker.fetch(0x4000 + ((i * 4) & 0xffc));
+         keep(sum);
+       }},
+      {"decode/register_decode_dss", count,
+       [state, instruction] {
+         for (u64 i = 0; i < count; i++) {
+           auto regs =
+               state->breaker.register_decode_dss<u32>(instruction(i));
+           keep(regs);
+         }
+       }},
+      {"decode/register_decode_dsi", count,
+       [state, instruction] {
+         for (u64 i = 0; i < count; i++) {
+           auto regs =
+               state->breaker.register_decode_dsi<u32>(instruction(i));
+           keep(regs);
+         }
+       }},
+      {"decode/literal_decode<8>", count,
+       [state] {
+         u32 sum = 0;
+         for (u64 i = 0; i < count; i++)
+           sum += state->breaker.literal_decode<8>(static_cast<u32>(i));
+         keep(sum);
+       }},
+      {"decode/literal_decode<24>", count,
+       [state] {
+         u32 sum = 0;
+         for (u64 i = 0; i < count; i++)
+           sum += state->breaker.literal_decode<24>(static_cast<u32>(i));
+         keep(sum);
+       }},
+      {"ctrl/set_needed_ctrl", count,
+       [state] {
+         for (u64 i = 0; i < count; i++) {
+           u32 value = static_cast<u32>(i * 0x9e3779b9) & 0xffffff;
+           state->breaker.set_needed_ctrl(&value);
+           keep(value);
+         }
+       }},
+  };
+}
+
+std::vector<benchmark>
+dispatch_benchmarks() {
+  return {
+      dispatch("MOVE", {ops::MOVE, 0x01, 0x02, 0x00}),
+      dispatch("AND_R", {ops::AND_R, 0x01, 0x01, 0x02}),
+      dispatch("LLSH_I", {ops::LLSH_I, 0x01, 0x01, 0x01}),
+      dispatch("ADD_DSS", {ops::ADD_DSS, 0x01, 0x01, 0x02}),
+      dispatch("ADD_DSI", {ops::ADD_DSI, 0x01, 0x01, 0x01}),
+      dispatch("MULT_DSS", {ops::MULT_DSS, 0x01, 0x01, 0x02}),
+      dispatch("LD_IM_A", {ops::LD_IM_A, 0x00, 0x12, 0x34}),
+      dispatch("INC_A", {ops::INC_A, 0x00, 0x00, 0x00}),
+      dispatch("TEST_EQ", {ops::TEST_EQ, 0x00, 0x01, 0x02}),
+      dispatch("BNCH not taken", {ops::BNCH, 0x00, 0x40, 0x00}),
+      dispatch("JMP_WITH_OFFSET", {ops::JMP_WITH_OFFSET, 0x80, 0x00, 0x00}),
+      dispatch("LOAD_AT_ADDR", {ops::LOAD_AT_ADDR, 0x02, 0x01, 0x00}),
+      dispatch("STORE_AT_ADDR", {ops::STORE_AT_ADDR, 0x01, 0x02, 0x00}),
+      dispatch("REG_PUSH/REG_POP", {ops::REG_PUSH, 0x00, 0x00, 0x01,
+                                    ops::REG_POP, 0x00, 0x00, 0x01}),
+      dispatch("POPCNT", {ops::POPCNT, 0x01, 0x02, 0x00}),
+      dispatch("RND_NUM", {ops::RND_NUM, 0x00, 0x00, 0x01}),
+      dispatch("EXT FADD_DSS", {EXT_INSTR(FADD_DSS, 0x01, 0x01, 0x02)}),
+      dispatch("EXT FMULT_DSI", {EXT_INSTR(FMULT_DSI, 0x01, 0x01, 0x01)}),
+      dispatch("EXT FSQRT_R_I", {EXT_INSTR(FSQRT_R_I, 0x00, 0x00, 0x01)}),
+      dispatch("EXT ATOMIC_FETCH_ADD",
+               {EXT_INSTR(ATOMIC_FETCH_ADD, 0x02, 0x01, 0x03)}),
+      dispatch("EXT FENCE", {EXT_INSTR(FENCE, 0x00, 0x00, 0x00)}),
+      dispatch("EXT mixed", {EXT_INSTR(FADD_DSS, 0x01, 0x01, 0x02),
+                             EXT_INSTR(FMULT_DSS, 0x02, 0x01, 0x02),
+                             EXT_INSTR(FSUB_DSS, 0x03, 0x01, 0x02)}),
+  };
+}
+
+void
+write_file(std::filesystem::path const& path, std::vector<byte> const& data) {
+  std::ofstream f{path, std::ios::binary};
+  f.write(reinterpret_cast<char const*>(data.data()),
+          static_cast<std::streamsize>(data.size()));
+}
+
+std::vector<benchmark>
+loader_benchmarks(std::filesystem::path const& dir) {
+  constexpr u64 count = 64;
+  std::vector<byte> image(0x10000);
+  for (std::size_t i = 0; i < image.size(); i++)
+    image[i] = static_cast<byte>(i * 31);
+  write_file(dir / "bench-a.out", image);
+  write_file(dir / "bench.prog",
+             std::vector<byte>(image.begin(), image.begin() + 0x4000));
+  write_file(dir / "bench-code.fn",
+             std::vector<byte>(image.begin(), image.begin() + 0x2000));
+  write_file(dir / "bench-data.str",
+             std::vector<byte>(image.begin(), image.begin() + 0x1000));
+  {
+    std::ofstream spec{dir / "bench.spec"};
+    spec << (dir / "bench-data.str").string() << " = 0x1000\n"
+         << (dir / "bench-code.fn").string() << " = 0x2000\n";
+  }
+
+  auto state = std::make_shared<machine_state>();
+  auto loader = [state, dir](std::string file) {
+    return [state, path = (dir / file).string()] {
+      for (u64 i = 0; i < count; i++)
+        load_program(path, state->proc);
+    };
+  };
+  return {
+      {"loader/a.out", count, loader("bench-a.out")},
+      {"loader/prog", count, loader("bench.prog")},
+      {"loader/spec", count, loader("bench.spec")},
+  };
+}
+
+result
+measure(benchmark const& bench, unsigned reps) {
+  using clock = std::chrono::steady_clock;
+  bench.run();
+  std::vector<double> per_op;
+  for (unsigned r = 0; r < reps; r++) {
+    auto start = clock::now();
+    bench.run();
+    std::chrono::duration<double, std::nano> elapsed = clock::now() - start;
+    per_op.push_back(elapsed.count() / static_cast<double>(bench.ops));
+  }
+  return {bench.name, emulator::sample_stats::of(per_op)};
+}
+
+void
+write_json(std::ostream& os, std::vector<result> const& results) {
+  os << "{\n  \"benchmarks\": [";
+  for (std::size_t i = 0; i < results.size(); i++) {
+    auto const& r = results[i];
+    os << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << r.name
+       << "\", \"ns_per_op\": " << r.ns_per_op.mean
+       << ", \"stddev\": " << r.ns_per_op.stddev
+       << ", \"min\": " << r.ns_per_op.min
+       << ", \"reps\": " << r.ns_per_op.count << "}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+}  // namespace
+
+int
+main(int argc, char const** argv) {
+  options opts;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--reps" && has_value) {
+      opts.reps = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--filter" && has_value) {
+      opts.filter = argv[++i];
+    } else if (arg == "--json" && has_value) {
+      opts.json = argv[++i];
+    } else if (arg == "--baseline" && has_value) {
+      opts.baseline = argv[++i];
+    } else if (arg == "--tolerance" && has_value) {
+      opts.tolerance = std::strtod(argv[++i], nullptr);
+    } else if (arg == "--update-baseline") {
+      opts.update_baseline = true;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (opts.update_baseline && opts.baseline.empty()) {
+    usage();
+    return 1;
+  }
+
+  emulator::perf_baseline baseline;
+  try {
+    baseline = emulator::perf_baseline::read(opts.baseline);
+  } catch (std::exception const& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  bool compare = !opts.baseline.empty() && !opts.update_baseline;
+
+  // the loaders report through the global printer
+  emulator::metaout = emulator::printer::nullprinter;
+
+  auto dir = std::filesystem::temp_directory_path() /
+             ("emulator-bench-" + std::to_string(::getpid()));
+  std::filesystem::create_directories(dir);
+
+  std::vector<benchmark> benchmarks;
+  for (auto group : {memory_benchmarks(), decode_benchmarks(),
+                     dispatch_benchmarks(), loader_benchmarks(dir)})
+    benchmarks.insert(benchmarks.end(), group.begin(), group.end());
+
+  std::vector<result> results;
+  std::vector<std::string> slower;
+  double log_ratios = 0;
+  std::size_t compared = 0;
+  std::printf("%-36s %12s %10s %12s\n", "benchmark", "ns/op", "+/-", "min");
+  for (auto const& bench : benchmarks) {
+    if (bench.name.find(opts.filter) == std::string::npos)
+      continue;
+    auto r = measure(bench, opts.reps);
+    auto reference = baseline.find(r.name);
+    auto too_slow = [&] {
+      return compare && reference &&
+             r.ns_per_op.min > *reference * (1 + opts.tolerance);
+    };
+    if (too_slow()) {
+      // one unlucky round is not a regression, so measure it again
+      auto again = measure(bench, opts.reps);
+      if (again.ns_per_op.min < r.ns_per_op.min)
+        r = again;
+      if (too_slow()) {
+        char msg[160];
+        std::snprintf(msg, sizeof(msg),
+                      "%s: %.3f ns/op, baseline %.3f (+%.0f%%)",
+                      r.name.c_str(), r.ns_per_op.min, *reference,
+                      100 * (r.ns_per_op.min / *reference - 1));
+        slower.push_back(msg);
+      }
+    }
+    if (compare && reference) {
+      log_ratios += std::log(r.ns_per_op.min / *reference);
+      compared++;
+    }
+    std::printf("%-36s %12.3f %10.3f %12.3f\n", r.name.c_str(),
+                r.ns_per_op.mean, r.ns_per_op.stddev, r.ns_per_op.min);
+    std::fflush(stdout);
+    results.push_back(r);
+  }
+  std::filesystem::remove_all(dir);
+
+  if (opts.update_baseline) {
+    for (auto const& r : results)
+      baseline.values[r.name] = r.ns_per_op.min;
+    baseline.write(opts.baseline);
+  }
+  bool regressed = false;
+  if (compared > 0) {
+    double ratio = std::exp(log_ratios / static_cast<double>(compared));
+    regressed = ratio > 1 + opts.tolerance;
+    for (auto const& msg : slower)
+      std::printf("slower %s\n", msg.c_str());
+    std::printf("%s: %zu benchmarks take %.2fx the baseline time\n",
+                regressed ? "REGRESSION" : "ok", compared, ratio);
+  }
+
+  if (!opts.json.empty()) {
+    std::ofstream f{opts.json};
+    write_json(f, results);
+  }
+  return regressed ? 2 : 0;
+}
@@ -0,0 +1,135 @@
+#include "block_device.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+namespace emulator {
+
+namespace {
+constexpr u32 sector_register = 0x00;
+constexpr u32 buffer_register = 0x04;
+constexpr u32 count_register = 0x08;
+constexpr u32 command_register = 0x0C;
+constexpr u32 status_register = 0x0D;
+constexpr u32 sectors_register = 0x10;
+}  // namespace
+
+block_device::block_device(std::string const& path, cpu& owner)
+    : owner(owner), ram(owner.get_ram()) {
+  int fd = open(path.c_str(), O_RDWR);
+  if (fd < 0) {
+    writable = false;
+    fd = open(path.c_str(), O_RDONLY);
+  }
+  if (fd < 0)
+    throw std::runtime_error("open " + path + ": " + std::strerror(errno));
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    throw std::runtime_error("fstat " + path + ": " + std::strerror(errno));
+  }
+  size = static_cast<u64>(info.st_size);
+  if (size != 0) {
+    void* mapped = mmap(nullptr, size, PROT_READ | (writable ? PROT_WRITE : 0),
+                        MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("mmap " + path + ": " + std::strerror(errno));
+    }
+    data = static_cast<u8*>(mapped);
+  }
+  // the mapping keeps the file open
+  close(fd);
+
+  u32 sectors = static_cast<u32>(
+      std::min<u64>(sector_count(), std::numeric_limits<u32>::max()));
+  for (u32 i = 0; i < 4; i++)
+    registers[sectors_register + i] = static_cast<u8>(sectors >> (24 - 8 * i));
+}
+
+block_device::~block_device() {
+  if (data != nullptr)
+    munmap(data, size);
+}
+
+u64
+block_device::sector_count() const noexcept {
+  return size / sector_size;
+}
+
+std::span<u8>
+block_device::contents() const noexcept {
+  return {data, size};
+}
+
+bool
+block_device::is_writable() const noexcept {
+  return writable;
+}
+
+u8
+block_device::read(u32 offset) {
+  return registers[offset];
+}
+
+void
+block_device::write(u32 offset, u8 value) {
+  if (offset == command_register)
+    registers[status_register] = transfer(value) ? status_ok : status_error;
+  else if (offset < command_register)
+    registers[offset] = value;
+}
+
+std::any
+block_device::save_state() {
+  return registers;
+}
+
+void
+block_device::restore_state(std::any const& saved) {
+  registers = std::any_cast<decltype(registers) const&>(saved);
+}
+
+u32
+block_device::word_at(u32 offset) const noexcept {
+  return (registers[offset] << 24) | (registers[offset + 1] << 16) |
+         (registers[offset + 2] << 8) | registers[offset + 3];
+}
+
+bool
+block_device::transfer(u8 command) {
+  u64 first = word_at(sector_register);
+  u64 count = word_at(count_register);
+  u32 address = word_at(buffer_register);
+  u64 bytes = count * sector_size;
+  if (first + count > sector_count() ||
+      address + bytes > ram.pageCount * ram.pageSize)
+    return false;
+  if (command == write_command && !writable)
+    return false;
+  if (command != read_command && command != write_command)
+    return false;
+
+  if (command == read_command)
+    owner.device_wrote(address, static_cast<u32>(bytes));
+  u8* disk = data + first * sector_size;
+  for (u64 done = 0; done < bytes;) {
+    auto run = ram.run_at(static_cast<u32>(address + done), bytes - done);
+    if (command == read_command)
+      std::memcpy(run.data(), disk + done, run.size());
+    else
+      std::memcpy(disk + done, run.data(), run.size());
+    done += run.size();
+  }
+  return true;
+}
+
+}  // namespace emulator
@@ -0,0 +1,127 @@
+#include "cluster.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+namespace emulator {
+
+cluster::cluster(std::string name, u32 node_id, u32 node_count)
+    : name(std::move(name)),
+      id(node_id),
+      count(node_count),
+      outgoing(node_count),
+      incoming(node_count) {
+  if (node_id >= node_count)
+    throw std::invalid_argument("Node id is not part of the cluster");
+  for (u32 other = 0; other < count; other++) {
+    if (other == id)
+      continue;
+    outgoing[other].shared = map_ring(segment_name(this->name, id, other));
+    incoming[other].shared = map_ring(segment_name(this->name, other, id));
+    // drop what an earlier run of this node sent but nobody received
+    auto* out = outgoing[other].shared;
+    u64 tail = out->tail.load(std::memory_order_acquire);
+    out->head.store(tail, std::memory_order_release);
+    outgoing[other].cached_other = tail;
+  }
+}
+
+cluster::~cluster() {
+  for (auto* ends : {&outgoing, &incoming})
+    for (auto& e : *ends)
+      if (e.shared != nullptr)
+        munmap(e.shared, sizeof(ring));
+  // nobody reads the rings this node received on any more; the rings it
+  // sent on stay for nodes that have not received everything yet
+  for (u32 other = 0; other < count; other++)
+    if (other != id)
+      shm_unlink(segment_name(name, other, id).c_str());
+}
+
+u32
+cluster::node_id() const noexcept {
+  return id;
+}
+
+u32
+cluster::node_count() const noexcept {
+  return count;
+}
+
+bool
+cluster::send(u32 to, u32 message) {
+  if (to >= count || to == id)
+    return false;
+  auto& e = outgoing[to];
+  u64 head = e.shared->head.load(std::memory_order_relaxed);
+  if (head - e.cached_other == ring_capacity) {
+    e.cached_other = e.shared->tail.load(std::memory_order_acquire);
+    if (head - e.cached_other == ring_capacity)
+      return false;
+  }
+  e.shared->slots[head % ring_capacity] = message;
+  e.shared->head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+std::optional<u32>
+cluster::receive(u32 from) {
+  if (from >= count || from == id)
+    return std::nullopt;
+  auto& e = incoming[from];
+  u64 tail = e.shared->tail.load(std::memory_order_relaxed);
+  if (tail == e.cached_other) {
+    e.cached_other = e.shared->head.load(std::memory_order_acquire);
+    if (tail == e.cached_other)
+      return std::nullopt;
+  }
+  u32 message = e.shared->slots[tail % ring_capacity];
+  e.shared->tail.store(tail + 1, std::memory_order_release);
+  return message;
+}
+
+void
+cluster::unlink(std::string const& name, u32 node_count) {
+  for (u32 from = 0; from < node_count; from++)
+    for (u32 to = 0; to < node_count; to++)
+      if (from != to)
+        shm_unlink(segment_name(name, from, to).c_str());
+}
+
+std::string
+cluster::segment_name(std::string const& name, u32 from, u32 to) {
+  return "/" + name + "-" + std::to_string(from) + "-" + std::to_string(to);
+}
+
+cluster::ring*
+cluster::map_ring(std::string const& segment) {
+  int fd = shm_open(segment.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0)
+    throw std::runtime_error("shm_open " + segment + ": " +
+                             std::strerror(errno));
+  // a new segment is zero filled, which is an empty ring, so whichever
+  // node gets here first needs no further initialisation. Some systems only
+  // allow sizing a segment once.
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      (info.st_size == 0 && ftruncate(fd, sizeof(ring)) != 0)) {
+    close(fd);
+    throw std::runtime_error("ftruncate " + segment + ": " +
+                             std::strerror(errno));
+  }
+  void* mapped =
+      mmap(nullptr, sizeof(ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    throw std::runtime_error("mmap " + segment + ": " + std::strerror(errno));
+  return static_cast<ring*>(mapped);
+}
+
+}  // namespace emulator
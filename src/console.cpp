@@ -0,0 +1,298 @@
+#include "console.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <utility>
+
+namespace emulator {
+
+std::size_t
+format_decimal(char* out, u32 value) noexcept {
+  return static_cast<std::size_t>(std::to_chars(out, out + 10, value).ptr -
+                                  out);
+}
+
+void
+console::write(std::span<char const> bytes) {
+  for (char c : bytes)
+    put_char(c);
+}
+
+std::size_t
+console::read(std::span<char> bytes) {
+  std::size_t count = 0;
+  while (count < bytes.size()) {
+    int c = get_char();
+    if (c == EOF)
+      break;
+    bytes[count++] = static_cast<char>(c);
+    if (c == '\n')
+      break;
+  }
+  return count;
+}
+
+stream_console::stream_console(std::ostream& out, std::istream& in)
+    : out(&out), in(&in) {}
+
+stream_console::~stream_console() {
+  flush();
+}
+
+void
+stream_console::put_char(char c) {
+  std::lock_guard guard{lock};
+  if (used == buffer.size())
+    drain();
+  buffer[used++] = c;
+}
+
+void
+stream_console::put_int(u32 value) {
+  std::lock_guard guard{lock};
+  if (buffer.size() - used < 10)
+    drain();
+  used += format_decimal(buffer.data() + used, value);
+}
+
+int
+stream_console::get_char() {
+  // a guest prompting for input expects its prompt to be visible
+  flush();
+  std::lock_guard guard{input_lock};
+  return in->get();
+}
+
+void
+stream_console::write(std::span<char const> bytes) {
+  std::lock_guard guard{lock};
+  if (buffer.size() - used < bytes.size())
+    drain();
+  if (bytes.size() >= buffer.size()) {
+    out->write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    return;
+  }
+  std::copy(bytes.begin(), bytes.end(), buffer.begin() + used);
+  used += bytes.size();
+}
+
+std::size_t
+stream_console::read(std::span<char> bytes) {
+  flush();
+  std::lock_guard guard{input_lock};
+  std::streambuf* source = in->rdbuf();
+  std::size_t count = 0;
+  while (count < bytes.size()) {
+    int c = source->sbumpc();
+    if (c == EOF) {
+      in->setstate(std::ios::eofbit);
+      break;
+    }
+    bytes[count++] = static_cast<char>(c);
+    if (c == '\n')
+      break;
+  }
+  return count;
+}
+
+void
+stream_console::flush() {
+  std::lock_guard guard{lock};
+  drain();
+}
+
+void
+stream_console::drain() {
+  if (used == 0)
+    return;
+  out->write(buffer.data(), static_cast<std::streamsize>(used));
+  out->flush();
+  used = 0;
+}
+
+buffer_console::buffer_console(std::string input) : input(std::move(input)) {}
+
+void
+buffer_console::put_char(char c) {
+  written.push_back(c);
+}
+
+void
+buffer_console::put_int(u32 value) {
+  char digits[10];
+  written.append(digits, format_decimal(digits, value));
+}
+
+int
+buffer_console::get_char() {
+  if (read_position >= input.size())
+    return EOF;
+  return static_cast<unsigned char>(input[read_position++]);
+}
+
+void
+buffer_console::write(std::span<char const> bytes) {
+  written.append(bytes.data(), bytes.size());
+}
+
+std::size_t
+buffer_console::read(std::span<char> bytes) {
+  std::size_t available = input.size() - std::min(read_position, input.size());
+  std::size_t count = std::min(bytes.size(), available);
+  auto start = input.begin() + static_cast<std::ptrdiff_t>(read_position);
+  auto newline = std::find(start, start + static_cast<std::ptrdiff_t>(count),
+                           '\n');
+  if (newline != start + static_cast<std::ptrdiff_t>(count))
+    count = static_cast<std::size_t>(newline - start) + 1;
+  std::copy_n(start, count, bytes.begin());
+  read_position += count;
+  return count;
+}
+
+std::string const&
+buffer_console::output() const noexcept {
+  return written;
+}
+
+void
+queue_console::feed(std::string const& text) {
+  {
+    std::lock_guard guard{lock};
+    input.insert(input.end(), text.begin(), text.end());
+  }
+  fed.notify_all();
+}
+
+void
+queue_console::close() {
+  {
+    std::lock_guard guard{lock};
+    closed = true;
+  }
+  fed.notify_all();
+}
+
+void
+queue_console::put_char(char c) {
+  std::lock_guard guard{lock};
+  written.push_back(c);
+}
+
+void
+queue_console::put_int(u32 value) {
+  char digits[10];
+  std::size_t length = format_decimal(digits, value);
+  std::lock_guard guard{lock};
+  written.append(digits, length);
+}
+
+void
+queue_console::write(std::span<char const> bytes) {
+  std::lock_guard guard{lock};
+  written.append(bytes.data(), bytes.size());
+}
+
+int
+queue_console::get_char() {
+  std::unique_lock guard{lock};
+  fed.wait(guard, [this] { return !input.empty() || closed; });
+  if (input.empty())
+    return EOF;
+  char c = input.front();
+  input.pop_front();
+  return static_cast<unsigned char>(c);
+}
+
+std::size_t
+queue_console::read(std::span<char> bytes) {
+  // wait for the first byte only and take what has been fed so far, so a
+  // guest reading a line is not held up by input fed in pieces
+  std::unique_lock guard{lock};
+  fed.wait(guard, [this] { return !input.empty() || closed; });
+  std::size_t count = 0;
+  while (count < bytes.size() && !input.empty()) {
+    char c = input.front();
+    input.pop_front();
+    bytes[count++] = c;
+    if (c == '\n')
+      break;
+  }
+  return count;
+}
+
+bool
+queue_console::input_ready() {
+  std::lock_guard guard{lock};
+  return !input.empty() || closed;
+}
+
+std::string
+queue_console::output() {
+  std::lock_guard guard{lock};
+  return written;
+}
+
+counting_console::counting_console(console& inner) : inner(inner) {}
+
+void
+counting_console::put_char(char c) {
+  out++;
+  inner.put_char(c);
+}
+
+void
+counting_console::put_int(u32 value) {
+  char digits[10];
+  out += format_decimal(digits, value);
+  inner.put_int(value);
+}
+
+int
+counting_console::get_char() {
+  int c = inner.get_char();
+  if (c != EOF)
+    in++;
+  return c;
+}
+
+void
+counting_console::write(std::span<char const> bytes) {
+  out += bytes.size();
+  inner.write(bytes);
+}
+
+std::size_t
+counting_console::read(std::span<char> bytes) {
+  std::size_t count = inner.read(bytes);
+  in += count;
+  return count;
+}
+
+bool
+counting_console::input_ready() {
+  return inner.input_ready();
+}
+
+void
+counting_console::flush() {
+  inner.flush();
+}
+
+u64
+counting_console::bytes_in() const noexcept {
+  return in;
+}
+
+u64
+counting_console::bytes_out() const noexcept {
+  return out;
+}
+
+console&
+standard_console() {
+  static stream_console standard;
+  return standard;
+}
+
+}  // namespace emulator
@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bytedefs.hpp"
+#include "console.hpp"
+#include "cpu.hpp"
+#include "cpu_breaker.hpp"
+#include "perf_baseline.hpp"
+#include "printer.hpp"
+#include "sample_stats.hpp"
+#include "utils.hpp"
+
+// Runs the guest benchmark corpus and reports the speed of each workload in
+// millions of emulated instructions per second.
+//
+// Each manifest line names a *.spec, *.prog or a.out file, the number of
+// fetch-decode-execute cycles it takes to halt, a file holding its expected
+// console output, and optionally register checks like `fa=2`. Blank lines and
+// text after '#' are ignored. Paths are relative to the working directory, as
+// in .spec files. Every workload is loaded afresh and run --reps times; only
+// the run itself is timed. A workload whose output, cycle count or registers
+// differ from the manifest fails, and the exit status is then 2.
+//
+// With --baseline FILE the best MIPS of each workload is compared with the
+// one recorded in FILE, and the exit status is also 2 if the geometric mean
+// of the slowdowns exceeds --tolerance. Workloads slower than that on their
+// own are run a second time and then listed. --update-baseline records this
+// run in FILE instead.
+
+namespace {
+
+using emulator::u32;
+using emulator::u64;
+
+struct register_check {
+  std::string name;
+  double value;
+};
+
+struct workload {
+  std::string program;
+  u64 cycles;
+  std::string expected_output;
+  std::vector<register_check> checks;
+};
+
+struct outcome {
+  std::string error;
+  emulator::sample_stats mips;
+};
+
+struct options {
+  std::string manifest = "benchmarks/corpus.txt";
+  unsigned reps = 5;
+  std::string json;
+  std::string baseline;
+  double tolerance = 0.25;
+  bool update_baseline = false;
+};
+
+void
+usage() {
+  std::cerr << "usage: emucorpus [MANIFEST] [--reps N] [--json FILE] "
+               "[--baseline FILE [--tolerance F] [--update-baseline]]"
+            << std::endl;
+}
+
+std::string
+read_file(std::string const& name) {
+  std::ifstream f{name, std::ios::binary};
+  if (!f)
+    throw std::runtime_error("Failed to open " + name);
+  return {std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+}
+
+std::vector<workload>
+read_manifest(std::string const& name) {
+  std::ifstream f{name};
+  if (!f)
+    throw std::runtime_error("Failed to open manifest " + name);
+
+  std::vector<workload> workloads;
+  std::string line;
+  while (std::getline(f, line)) {
+    if (auto hash = line.find('#'); hash != std::string::npos)
+      line.erase(hash);
+    std::stringstream ss{line};
+    workload w;
+    std::string output;
+    if (!(ss >> w.program))
+      continue;
+    if (!(ss >> w.cycles >> output))
+      throw std::runtime_error("Malformed manifest line for " + w.program);
+    w.expected_output = read_file(output);
+    for (std::string check; ss >> check;) {
+      auto eq = check.find('=');
+      if (eq == std::string::npos)
+        throw std::runtime_error("Malformed register check " + check);
+      w.checks.push_back(
+          {check.substr(0, eq), std::stod(check.substr(eq + 1))});
+    }
+    workloads.push_back(std::move(w));
+  }
+  return workloads;
+}
+
+double
+register_value(emulator::cpu_breaker const& breaker, std::string const& name) {
+  if (name == "a")
+    return breaker.a();
+  if (name == "b")
+    return breaker.b();
+  if (name == "x")
+    return breaker.x();
+  if (name == "fa")
+    return breaker.fa();
+  if (name == "fb")
+    return breaker.fb();
+  if (name == "fx")
+    return breaker.fx();
+  throw std::runtime_error("No register " + name + " to check");
+}
+
+// Run w once, returning the wall time of the run in microseconds. Sets error
+// if the run does not match the manifest.
+double
+run_once(workload const& w, std::string& error) {
+  emulator::buffer_console io;
+  emulator::cpu proc;
+  emulator::cpu_breaker breaker{proc};
+  proc.metaout = emulator::printer::nullprinter;
+  proc.flight_output = nullptr;
+  proc.attach_console(io);
+  load_program(w.program, proc);
+
+  auto start = std::chrono::steady_clock::now();
+  auto stop = proc.run_for(w.cycles + 1);
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::stringstream msg;
+  if (stop == emulator::cpu::stop_reason::fault)
+    msg << proc.fault_description();
+  else if (stop != emulator::cpu::stop_reason::halted)
+    msg << "did not halt within " << w.cycles << " cycles";
+  else if (proc.cycles() != w.cycles)
+    msg << "halted after " << proc.cycles() << " cycles, expected "
+        << w.cycles;
+  else if (io.output() != w.expected_output)
+    msg << "console output differs from the expected output";
+  for (auto const& check : w.checks) {
+    double value = register_value(breaker, check.name);
+    if (std::abs(value - check.value) > 1e-9 * std::abs(check.value))
+      msg << (msg.tellp() > 0 ? "; " : "") << check.name << " is " << value
+          << ", expected " << check.value;
+  }
+  error = msg.str();
+  return elapsed.count();
+}
+
+outcome
+run_workload(workload const& w, unsigned reps) {
+  outcome result;
+  std::vector<double> mips;
+  try {
+    for (unsigned r = 0; r < reps && result.error.empty(); r++)
+      mips.push_back(static_cast<double>(w.cycles) /
+                     run_once(w, result.error));
+  } catch (std::exception const& e) {
+    result.error = e.what();
+  }
+  result.mips = emulator::sample_stats::of(mips);
+  return result;
+}
+
+void
+write_json(std::ostream& os,
+           std::vector<workload> const& workloads,
+           std::vector<outcome> const& outcomes) {
+  os << "{\n  \"workloads\": [";
+  for (std::size_t i = 0; i < workloads.size(); i++) {
+    auto const& o = outcomes[i];
+    os << (i == 0 ? "\n" : ",\n") << "    {\"name\": \""
+       << workloads[i].program << "\", \"status\": \""
+       << (o.error.empty() ? "ok" : "failed")
+       << "\", \"cycles\": " << workloads[i].cycles
+       << ", \"mips\": " << o.mips.mean << ", \"stddev\": " << o.mips.stddev
+       << ", \"max\": " << o.mips.max << ", \"reps\": " << o.mips.count
+       << "}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+}  // namespace
+
+int
+main(int argc, char const** argv) {
+  options opts;
+  bool manifest_given = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--reps" && has_value) {
+      opts.reps = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--json" && has_value) {
+      opts.json = argv[++i];
+    } else if (arg == "--baseline" && has_value) {
+      opts.baseline = argv[++i];
+    } else if (arg == "--tolerance" && has_value) {
+      opts.tolerance = std::strtod(argv[++i], nullptr);
+    } else if (arg == "--update-baseline") {
+      opts.update_baseline = true;
+    } else if (!manifest_given && !arg.starts_with("--")) {
+      opts.manifest = arg;
+      manifest_given = true;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (opts.update_baseline && opts.baseline.empty()) {
+    usage();
+    return 1;
+  }
+
+  // the loaders report through the global printer
+  emulator::metaout = emulator::printer::nullprinter;
+
+  std::vector<workload> workloads;
+  emulator::perf_baseline baseline;
+  try {
+    workloads = read_manifest(opts.manifest);
+    baseline = emulator::perf_baseline::read(opts.baseline);
+  } catch (std::exception const& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::vector<outcome> outcomes;
+  std::size_t failed = 0;
+  std::printf("%-28s %10s %10s %8s %10s\n", "workload", "cycles", "MIPS",
+              "+/-", "best");
+  bool compare = !opts.baseline.empty() && !opts.update_baseline;
+  std::vector<std::string> slower;
+  double log_ratios = 0;
+  std::size_t compared = 0;
+  for (auto const& w : workloads) {
+    auto o = run_workload(w, opts.reps);
+    auto reference = baseline.find(w.program);
+    auto too_slow = [&] {
+      return compare && reference && o.error.empty() &&
+             o.mips.max * (1 + opts.tolerance) < *reference;
+    };
+    if (too_slow()) {
+      // one unlucky round is not a regression, so run it again
+      auto again = run_workload(w, opts.reps);
+      if (!again.error.empty() || again.mips.max > o.mips.max)
+        o = std::move(again);
+      if (too_slow()) {
+        char msg[160];
+        std::snprintf(msg, sizeof(msg),
+                      "%s: %.2f MIPS, baseline %.2f (%.0f%% slower)",
+                      w.program.c_str(), o.mips.max, *reference,
+                      100 * (*reference / o.mips.max - 1));
+        slower.push_back(msg);
+      }
+    }
+    if (compare && reference && o.error.empty()) {
+      log_ratios += std::log(*reference / o.mips.max);
+      compared++;
+    }
+    if (opts.update_baseline && o.error.empty())
+      baseline.values[w.program] = o.mips.max;
+    if (o.error.empty()) {
+      std::printf("%-28s %10llu %10.2f %8.2f %10.2f\n", w.program.c_str(),
+                  static_cast<unsigned long long>(w.cycles), o.mips.mean,
+                  o.mips.stddev, o.mips.max);
+    } else {
+      std::printf("%-28s FAILED: %s\n", w.program.c_str(), o.error.c_str());
+      failed++;
+    }
+    std::fflush(stdout);
+    outcomes.push_back(std::move(o));
+  }
+
+  if (!opts.json.empty()) {
+    std::ofstream f{opts.json};
+    write_json(f, workloads, outcomes);
+  }
+  if (opts.update_baseline)
+    baseline.write(opts.baseline);
+
+  bool regressed = false;
+  if (compared > 0) {
+    double ratio = std::exp(log_ratios / static_cast<double>(compared));
+    regressed = ratio > 1 + opts.tolerance;
+    for (auto const& msg : slower)
+      std::printf("slower %s\n", msg.c_str());
+    std::printf("%s: %zu workloads take %.2fx the baseline time\n",
+                regressed ? "REGRESSION" : "ok", compared, ratio);
+  }
+  return failed == 0 && !regressed ? 0 : 2;
+}
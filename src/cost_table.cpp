@@ -0,0 +1,59 @@
+#include "cost_table.hpp"
+
+#include <stdexcept>
+
+#include "cpu.hpp"
+#include "utils.hpp"
+
+namespace emulator {
+
+cost_table
+cost_table::defaults() {
+  using op = cpu::opcodes;
+  using ext = cpu::extended_opcodes;
+  cost_table table;
+  table.base.fill(1);
+  table.extended.fill(1);
+
+  for (u8 code : {op::LOAD_AT_ADDR, op::STORE_AT_ADDR, op::REG_PUSH,
+                  op::REG_POP, op::CALL_FN_I, op::RET})
+    table.base[code] = 2;
+  for (u8 code : {op::PRINT_I_R, op::PUTC_R, op::GETC_R, op::RND_NUM})
+    table.base[code] = 4;
+  table.base[op::MULT_DSS] = 3;
+  table.base[op::MULT_DSI] = 3;
+  table.base[op::SQRT_R_I] = 12;
+
+  for (u8 code : {ext::FADD_DSS, ext::FSUB_DSS, ext::FADD_DSI, ext::FSUB_DSI})
+    table.extended[code] = 3;
+  table.extended[ext::FMULT_DSS] = 4;
+  table.extended[ext::FMULT_DSI] = 4;
+  table.extended[ext::FSQRT_R_I] = 16;
+  for (u8 code : {ext::ATOMIC_CAS, ext::ATOMIC_FETCH_ADD, ext::FENCE})
+    table.extended[code] = 8;
+  for (u8 code : {ext::SEND, ext::RECV, ext::PUTS, ext::WRITE_BYTES,
+                  ext::READ_BYTES})
+    table.extended[code] = 8;
+  return table;
+}
+
+void
+cost_table::load(std::string const& filename) {
+  for (auto const& [key, cycles] : parse_program_spec(filename)) {
+    bool is_extended = key.starts_with("ext:");
+    std::string code = is_extended ? key.substr(4) : key;
+    std::size_t used = 0;
+    unsigned long opcode = 0;
+    try {
+      opcode = std::stoul(code, &used, 16);
+    } catch (std::logic_error const&) {
+      used = 0;
+    }
+    if (used == 0 || used != code.size() || opcode > 0xff)
+      throw std::invalid_argument("Bad opcode '" + key + "' in cost table " +
+                                  filename);
+    (is_extended ? extended : base)[opcode] = static_cast<u32>(cycles);
+  }
+}
+
+}  // namespace emulator
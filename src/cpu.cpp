@@ -1,22 +1,62 @@
 #include "cpu.hpp"
 
+#include <algorithm>
+#include <bit>
 #include <ios>
 #include <iostream>
 #include <optional>
 #include <string>
+#include <thread>
+#include <utility>
 
 #include "bytedefs.hpp"
 #include "printer.hpp"
+#include "time_machine.hpp"
 #include "utils.hpp"
 
 namespace emulator {
 
+namespace {
+
+// The cpu executing instructions on this thread. Cores sharing ram share
+// one console port, which acts on the core that accessed it.
+thread_local cpu* executing = nullptr;
+
+struct executing_scope {
+  explicit executing_scope(cpu* proc)
+      : previous(std::exchange(executing, proc)) {}
+  ~executing_scope() { executing = previous; }
+
+  executing_scope(executing_scope const&) = delete;
+  executing_scope&
+  operator=(executing_scope const&) = delete;
+
+  cpu* previous;
+};
+
+}  // namespace
+
 // public functions
-cpu::cpu() {
+cpu::cpu() : cpu(std::make_shared<ram_type>(), 0, 0x0100) {}
+
+cpu::cpu(std::shared_ptr<ram_type> shared_ram, u32 core_id, u32 stack_base)
+    : cid(core_id),
+      stack_base(stack_base),
+      shared_ram(std::move(shared_ram)),
+      ram(*this->shared_ram) {
+  if (ram.device_at(console_data) == nullptr)
+    ram.map_device(console_data, 2, port);
   reset();
 }
 
-bool cpu::debugging = false;
+cpu::~cpu() {
+  ram.unmap_device(port);
+  // later devices may use earlier ones, e.g. a dma controller and its disk
+  while (!devices.empty()) {
+    ram.unmap_device(*devices.back());
+    devices.pop_back();
+  }
+}
 
 void
 cpu::reset() {
@@ -24,22 +64,121 @@ cpu::reset() {
   pc = 0xF000;
   a = b = x = 0;
   fa = fb = fx = 0.0;
-  sp = 0x0100;
+  sp = stack_base;
   ra = 0;
   ctrl = 0;
   m_cycles = 0;
+  m_clock_cycles = 0;
+  fault = {};
+  counted = {};
+  flight.clear();
+  published.depth = 0;
+  random.seed(1);
 }
 
-int
+u64
 cpu::cycles() const noexcept {
   return m_cycles;
 }
 
+u64
+cpu::clock_cycles() const noexcept {
+  return m_clock_cycles;
+}
+
+u64
+cpu::instructions() const noexcept {
+  return m_cycles - counted.prefixes;
+}
+
+u64
+cpu::faults() const noexcept {
+  return counted.faults;
+}
+
+void
+cpu::set_costs(cost_table const& table) noexcept {
+  costs = table;
+}
+
+void
+cpu::set_frequency(double mhz) {
+  frequency = mhz;
+  pace_generation++;
+  if (frequency <= 0)
+    return;
+  pace_start_cycles = m_clock_cycles;
+  pace_start = std::chrono::steady_clock::now();
+  pace();
+}
+
+void
+cpu::pace() {
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  auto due = pace_start + duration_cast<steady_clock::duration>(
+                              duration<double, std::micro>(
+                                  (m_clock_cycles - pace_start_cycles) /
+                                  frequency));
+  if (due > now) {
+    std::this_thread::sleep_until(due);
+  } else if (now - due > milliseconds(50)) {
+    // the guest fell well behind, e.g. in the debugger; start over rather
+    // than racing to catch up
+    pace_start_cycles = m_clock_cycles;
+    pace_start = now;
+  }
+  auto quantum = std::max<u64>(static_cast<u64>(frequency * 1000), 1);
+  schedule(m_clock_cycles + quantum, [this, armed = pace_generation] {
+    if (armed == pace_generation)
+      pace();
+  });
+}
+
 bool
 cpu::is_halted() const noexcept {
   return halted;
 }
 
+guest_position const&
+cpu::position() const noexcept {
+  return published;
+}
+
+flight_recorder&
+cpu::recorder() noexcept {
+  return flight;
+}
+
+void
+cpu::request_flight_dump() noexcept {
+  flight_dump_requested.store(true);
+  next_event.store(0);
+}
+
+u32
+cpu::fault_cause() const noexcept {
+  return fault.cause;
+}
+
+std::string
+cpu::fault_description() const {
+  static constexpr char const* causes[] = {
+      "no fault",    "bad opcode",          "bad register",
+      "bad address", "uninitialized fetch", "misaligned access"};
+  std::stringstream msg;
+  msg << "Guest fault: "
+      << (fault.cause < std::size(causes) ? causes[fault.cause] : "unknown")
+      << std::hex << std::showbase << " at pc " << fault.pc << ", address "
+      << fault.address;
+  return msg.str();
+}
+
+void
+cpu::dump_registers() const {
+  dump_registers(metaout);
+}
+
 void
 cpu::dump_registers(printer out) const {
   out << std::hex << std::showbase;
@@ -62,11 +201,18 @@ cpu::dump_registers(printer out) const {
 
 void
 cpu::debug_tick(std::string& prevline, long long& cpu_time) {
+  io->flush();
   std::cout << "Enter a command: (d)ump regs, (p)rint ram, (n)ext "
-               "instruction, (c)ontinue"
+               "instruction, (c)ontinue, (b)reak ADDR, (r)everse step, "
+               "(R)everse continue, (w)rite to ADDR last, (h)istory"
             << std::endl;
   std::string line;
-  std::getline(std::cin, line);
+  if (!std::getline(std::cin, line)) {
+    debugging = false;
+    return;
+  }
+  if (line.empty() && prevline.empty())
+    return;
 reswitch:
   char c = line[0];
   switch (c) {
@@ -92,10 +238,52 @@ reswitch:
     case 'n':
       cpu_time += tick().value_or(0);
       break;
+    case 'h':
+      flight.dump(std::cout);
+      break;
     case 'c':
     case EOF:
       debugging = false;
       break;
+    case 'b':
+    case 'w': {
+      u32 addr;
+      try {
+        addr = parse_int(line.substr(line.find_first_not_of(" ", 1)));
+      } catch (std::exception const&) {
+        std::cout << "Format of the " << c << " command: " << c << " ADDR"
+                  << std::endl;
+        break;
+      }
+      if (c == 'b') {
+        breakpoints.insert(addr);
+        break;
+      }
+      if (travel == nullptr) {
+        std::cout << "Time travel is not enabled" << std::endl;
+        break;
+      }
+      if (auto found = travel->last_write_to(addr))
+        std::cout << "Last written on cycle " << std::dec << *found
+                  << std::endl;
+      else
+        std::cout << "No write to that address in the retained history"
+                  << std::endl;
+    } break;
+    case 'r':
+    case 'R':
+      if (travel == nullptr) {
+        std::cout << "Time travel is not enabled" << std::endl;
+      } else if (c == 'r') {
+        if (!travel->step_back())
+          std::cout << "Already at the oldest retained cycle" << std::endl;
+      } else if (!travel->reverse_continue(breakpoints)) {
+        std::cout << "No earlier breakpoint; at the oldest retained cycle"
+                  << std::endl;
+      }
+      std::cout << "Now at cycle " << std::dec << m_cycles << " pc "
+                << std::hex << std::showbase << pc << std::dec << std::endl;
+      break;
     default:
       break;
   }
@@ -108,20 +296,30 @@ cpu::run() {
   using us = std::chrono::microseconds;
   auto start = std::chrono::system_clock::now();
   std::string pline;
-  while (!halted) {
+  // a halted cpu stays in the debugger so it can still be stepped backwards
+  while (!halted || debugging) {
+    if (travel != nullptr && m_cycles >= travel->next_snapshot_cycle())
+      travel->take_snapshot();
     if (debugging) {
       debug_tick(pline, cpu_time);
     } else {
       auto o = tick();
       cpu_time += o.value_or(0);
+      if (!breakpoints.empty() && breakpoints.contains(pc))
+        debugging = true;
     }
   }
   auto end = std::chrono::system_clock::now();
   auto mseconds = std::chrono::duration_cast<us>(end - start).count();
+  if (inputs != nullptr)
+    inputs->flush();
 
-  metaout << std::dec << "CPU Ran for " << cycles() << " cycles." << endl;
+  metaout << std::dec << "CPU Ran for " << cycles() << " cycles, "
+          << clock_cycles() << " clock cycles." << endl;
   metaout << "CPU: " << cpu_time << " us. " << endl;
   metaout << "REAL: " << mseconds << " us. " << endl;
+  if (fault.stopped)
+    throw_fault();
 }
 
 auto
@@ -131,32 +329,248 @@ cpu::tick() -> std::optional<long long> {
 
   using us = std::chrono::microseconds;
   auto start = std::chrono::system_clock::now();
+  executing_scope scope{this};
+  step();
+  auto end = std::chrono::system_clock::now();
+  auto mseconds = std::chrono::duration_cast<us>(end - start).count();
+  return std::make_optional(mseconds);
+}
+
+cpu::stop_reason
+cpu::run_for(u64 max_cycles, std::chrono::microseconds max_time) {
+  auto deadline = std::chrono::steady_clock::time_point::max();
+  if (max_time != std::chrono::microseconds::max())
+    deadline = std::chrono::steady_clock::now() + max_time;
+  u64 limit = (max_cycles > ~0llu - m_cycles) ? ~0llu : m_cycles + max_cycles;
+  executing_scope scope{this};
+  while (!halted) {
+    if (m_cycles >= limit)
+      return stop_reason::cycle_budget;
+    if (m_cycles % time_check_interval == 0 &&
+        std::chrono::steady_clock::now() >= deadline)
+      return stop_reason::time_budget;
+    step();
+  }
+  return fault.stopped ? stop_reason::fault : stop_reason::halted;
+}
+
+guest_task
+cpu::run_task(u64 quantum) {
+  cooperative = true;
+  while (!halted) {
+    {
+      // not held across co_yield, the thread may resume another guest
+      executing_scope scope{this};
+      for (u64 i = 0; i < quantum && !halted && !waiting_for_input; i++)
+        step();
+    }
+    if (waiting_for_input) {
+      waiting_for_input = false;
+      co_yield task_state::blocked;
+    } else if (!halted) {
+      co_yield task_state::ready;
+    }
+  }
+  cooperative = false;
+  if (fault.stopped)
+    throw_fault();
+}
 
+bool
+cpu::input_ready() const {
+  return reexecuting() ||
+         (inputs != nullptr &&
+          inputs->get_mode() == input_log::mode::replay) ||
+         io->input_ready();
+}
+
+void
+cpu::set_memory(byte const* bytes, u64 count, u64 addr_start) {
+  if (count > 0)
+    ram.check_addr(addr_start + count - 1);
+  for (u64 i = 0; i < count; i++)
+    ram[addr_start + i] = bytes[i];
+  metaout << "Loaded " << count << " bytes into memory at " << addr_start
+          << endl;
+}
+
+void
+cpu::attach_input_log(input_log* log) noexcept {
+  inputs = log;
+}
+
+void
+cpu::attach_time_machine(time_machine* machine) noexcept {
+  travel = machine;
+}
+
+void
+cpu::attach_trace(trace_writer* writer) noexcept {
+  trace = writer;
+}
+
+void
+cpu::attach_memory_profile(memory_profile* profile) noexcept {
+  heat = profile;
+}
+
+void
+cpu::attach_console(console& device) noexcept {
+  io = &device;
+}
+
+void
+cpu::attach_cluster(cluster& link) noexcept {
+  node = &link;
+}
+
+void
+cpu::add_device(std::unique_ptr<ram_type::device_type> device,
+                u32 base,
+                u32 length) {
+  ram.map_device(base, length, *device);
+  devices.push_back(std::move(device));
+}
+
+cpu::ram_type&
+cpu::get_ram() noexcept {
+  return ram;
+}
+
+void
+cpu::raise_interrupt(u32 line) {
+  if (line >= interrupt_lines)
+    throw std::invalid_argument("No such interrupt line");
+  pending_interrupts.fetch_or(1u << line);
+  next_event.store(0);
+}
+
+void
+cpu::schedule(u64 cycle, event_queue::action what) {
+  events.schedule(cycle, std::move(what));
+  if (cycle < next_event.load())
+    next_event.store(cycle);
+}
+
+void
+cpu::device_wrote(u32 addr, u32 length) noexcept {
+  note_write(addr, length);
+}
+
+// private functions
+
+void
+cpu::step() {
+  if (m_clock_cycles >= next_event.load(std::memory_order_relaxed))
+      [[unlikely]] {
+    service_events();
+    if (halted)
+      return;
+  }
   m_cycles++;
   metaout << "tick" << endl;
   zero_check();
 
+  instruction_pc = pc;
+  published.pc.store(pc, std::memory_order_relaxed);
+  written = 0;
   auto [opcode, instruction] = get_next_instruction();
-  if (ctrl_get(ctrl_bits::CTRL_EXT_FNC)) {
+  accessed = trace_record::no_address;
+  stored = false;
+  u32 cost;
+  bool extended = ctrl_get(ctrl_bits::CTRL_EXT_FNC);
+  if (extended) {
+    instruction_pc -= 4;
+    counted.prefixes++;
     execute_extended_instruction(opcode, instruction);
+    cost = costs.extended[opcode];
   } else {
     execute_instruction(opcode, instruction);
+    cost = costs.base[opcode];
   }
-  auto end = std::chrono::system_clock::now();
-  auto mseconds = std::chrono::duration_cast<us>(end - start).count();
-  return std::make_optional(mseconds);
+  counted.memory += accessed != trace_record::no_address;
+  flight.record(m_cycles, instruction_pc, instruction, ctrl, written);
+  if (trace != nullptr) [[unlikely]]
+    trace->record(instruction_pc + (extended ? 4 : 0), opcode, extended,
+                  written, accessed);
+  if (heat != nullptr) [[unlikely]]
+    heat->record(instruction_pc + (extended ? 4 : 0), accessed, stored, sp);
+  // an instruction waiting for input will run again; charge it then
+  if (!waiting_for_input) [[likely]]
+    m_clock_cycles += cost;
 }
 
 void
-cpu::set_memory(byte const* bytes, u64 count, u64 addr_start) {
-  ram.check_addr(addr_start + count);
-  for (int i = 0; i < count; i++)
-    ram[addr_start + i] = bytes[i];
-  emulator::metaout << "Loaded " << count << " bytes into memory at "
-                    << addr_start << emulator::endl;
+cpu::service_events() {
+  events.run_due(m_clock_cycles);
+  next_event.store(events.next_cycle());
+  if (flight_dump_requested.exchange(false) && flight_output != nullptr)
+    flight.dump(*flight_output);
+  if (fault.pending) {
+    take_fault();
+    return;
+  }
+  u32 pending = pending_interrupts.load();
+  if (pending == 0 || !ctrl_get(ctrl_bits::CTRL_INT_ENABLE))
+    return;
+  if (ctrl_get(ctrl_bits::CTRL_EXT_FNC)) {
+    // do not split EXT_INSTR from its extended instruction
+    next_event.store(m_clock_cycles + 1);
+    return;
+  }
+  u32 ready = pending & (ctrl >> 8) & 0xff;
+  if (ready == 0)
+    return;
+
+  // the interrupt stays pending while the fault this raises is taken. The
+  // fault belongs to the instruction at pc, which has not run yet, and
+  // without room on the stack it stops the cpu before that instruction.
+  instruction_pc = pc;
+  if (!check_range(sp, 8)) {
+    take_fault();
+    return;
+  }
+  u32 line = std::countr_zero(ready);
+  pending_interrupts.fetch_and(~(1u << line));
+  metaout << "Taking interrupt " << line << endl;
+  enter_handler(pc, reg_load(interrupt_vectors + 4 * line));
 }
 
-// private functions
+void
+cpu::raise_fault(u32 cause, u32 address) noexcept {
+  if (fault.pending)
+    return;
+  fault = {cause, address, instruction_pc, true, false};
+  counted.faults++;
+  next_event.store(0);
+}
+
+void
+cpu::take_fault() {
+  fault.pending = false;
+  metaout << fault_description() << endl;
+  u32 handler = reg_load(trap_vector);
+  if (handler == 0 || !in_ram(sp, 8)) {
+    fault.stopped = true;
+    halted = true;
+    io->flush();
+    if (flight_output != nullptr) {
+      *flight_output << fault_description() << "\n";
+      flight.dump(*flight_output);
+    }
+    return;
+  }
+  enter_handler(fault.pc, handler);
+}
+
+void
+cpu::enter_handler(u32 return_pc, u32 handler) {
+  reg_store(return_pc, sp);
+  reg_store(ctrl, sp + 4);
+  sp += 8;
+  ctrl_clear(ctrl_bits::CTRL_INT_ENABLE | ctrl_bits::CTRL_EXT_FNC);
+  pc = handler;
+}
 
 void
 cpu::zero_check() const noexcept {
@@ -185,18 +599,267 @@ cpu::ctrl_clear(u32 setbits) {
   ctrl &= ~(setbits);
 }
 
+u32
+cpu::console_input() {
+  if (reexecuting())
+    return travel->replay_input(input_kind::getc, m_cycles);
+  u32 value;
+  if (inputs == nullptr) {
+    value = io->get_char();
+  } else if (inputs->get_mode() == input_log::mode::replay) {
+    value = inputs->replay(input_kind::getc, m_cycles);
+  } else {
+    value = io->get_char();
+    inputs->record(input_kind::getc, m_cycles, value);
+  }
+  if (travel != nullptr)
+    travel->remember_input(input_kind::getc, m_cycles, value);
+  return value;
+}
+
+u64
+cpu::host_time() {
+  u32 low, high;
+  if (reexecuting()) {
+    low = travel->replay_input(input_kind::time, m_cycles);
+    high = travel->replay_input(input_kind::time, m_cycles, 1);
+  } else if (inputs != nullptr &&
+             inputs->get_mode() == input_log::mode::replay) {
+    low = inputs->replay(input_kind::time, m_cycles);
+    high = inputs->replay(input_kind::time, m_cycles);
+  } else {
+    u64 now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now().time_since_epoch())
+                  .count();
+    low = static_cast<u32>(now);
+    high = static_cast<u32>(now >> 32);
+    if (inputs != nullptr) {
+      inputs->record(input_kind::time, m_cycles, low);
+      inputs->record(input_kind::time, m_cycles, high);
+    }
+  }
+  if (travel != nullptr && !reexecuting()) {
+    travel->remember_input(input_kind::time, m_cycles, low);
+    travel->remember_input(input_kind::time, m_cycles, high);
+  }
+  return (static_cast<u64>(high) << 32) | low;
+}
+
+bool
+cpu::cluster_send(u32 to, u32 message) {
+  u32 sent;
+  if (reexecuting()) {
+    sent = travel->replay_input(input_kind::send, m_cycles);
+  } else if (inputs != nullptr &&
+             inputs->get_mode() == input_log::mode::replay) {
+    sent = inputs->replay(input_kind::send, m_cycles);
+  } else {
+    sent = node != nullptr && node->send(to, message);
+    if (inputs != nullptr)
+      inputs->record(input_kind::send, m_cycles, sent);
+  }
+  if (travel != nullptr && !reexecuting())
+    travel->remember_input(input_kind::send, m_cycles, sent);
+  return sent != 0;
+}
+
+std::optional<u32>
+cpu::cluster_receive(u32 from) {
+  u32 received;
+  u32 message = 0;
+  if (reexecuting()) {
+    received = travel->replay_input(input_kind::recv, m_cycles);
+    if (received != 0)
+      message = travel->replay_input(input_kind::recv, m_cycles, 1);
+  } else if (inputs != nullptr &&
+             inputs->get_mode() == input_log::mode::replay) {
+    received = inputs->replay(input_kind::recv, m_cycles);
+    if (received != 0)
+      message = inputs->replay(input_kind::recv, m_cycles);
+  } else {
+    std::optional<u32> live;
+    if (node != nullptr)
+      live = node->receive(from);
+    received = live.has_value();
+    message = live.value_or(0);
+    if (inputs != nullptr) {
+      inputs->record(input_kind::recv, m_cycles, received);
+      if (received != 0)
+        inputs->record(input_kind::recv, m_cycles, message);
+    }
+  }
+  if (travel != nullptr && !reexecuting()) {
+    travel->remember_input(input_kind::recv, m_cycles, received);
+    if (received != 0)
+      travel->remember_input(input_kind::recv, m_cycles, message);
+  }
+  if (received == 0)
+    return std::nullopt;
+  return message;
+}
+
+void
+cpu::write_counter(u32 instruction, u64 value) {
+  // either half may go to z to drop it
+  auto [low, high] = register_decode_dsi<u32>(instruction);
+  if (byte_of<2>(instruction) != 0)
+    *writable(low) = static_cast<u32>(value);
+  if (byte_of<1>(instruction) != 0)
+    *writable(high) = static_cast<u32>(value >> 32);
+  written = static_cast<u32>(value);
+}
+
+u32
+cpu::console_puts(u32 addr) {
+  u32 length = 0;
+  while (true) {
+    if (!check_range(addr + length, 1))
+      return length;
+    auto run = ram.run_at(addr + length, ram.pageSize);
+    auto nul = std::find(run.begin(), run.end(), 0);
+    auto taken = static_cast<u32>(nul - run.begin());
+    if (!reexecuting())
+      io->write({reinterpret_cast<char const*>(run.data()), taken});
+    length += taken;
+    if (nul != run.end())
+      return length;
+  }
+}
+
+void
+cpu::console_write(u32 addr, u32 length) {
+  if (!check_range(addr, length))
+    return;
+  for (u32 done = 0; done < length;) {
+    auto run = ram.run_at(addr + done, length - done);
+    if (!reexecuting())
+      io->write({reinterpret_cast<char const*>(run.data()), run.size()});
+    done += static_cast<u32>(run.size());
+  }
+}
+
+u32
+cpu::console_read(u32 addr, u32 length) {
+  if (!check_range(addr, length))
+    return 0;
+  std::vector<char> bytes;
+  if (reexecuting()) {
+    bytes.resize(travel->replay_input(input_kind::read, m_cycles));
+    for (std::size_t i = 0; i < bytes.size(); i++)
+      bytes[i] = static_cast<char>(
+          travel->replay_input(input_kind::getc, m_cycles, i + 1));
+  } else if (inputs != nullptr &&
+             inputs->get_mode() == input_log::mode::replay) {
+    bytes.resize(inputs->replay(input_kind::read, m_cycles));
+    for (char& c : bytes)
+      c = static_cast<char>(inputs->replay(input_kind::getc, m_cycles));
+  } else {
+    bytes.resize(length);
+    bytes.resize(io->read(bytes));
+    if (inputs != nullptr) {
+      inputs->record(input_kind::read, m_cycles, bytes.size());
+      for (char c : bytes)
+        inputs->record(input_kind::getc, m_cycles,
+                       static_cast<unsigned char>(c));
+    }
+  }
+  if (bytes.size() > length)
+    throw std::runtime_error("Replayed read is longer than the guest buffer");
+  if (travel != nullptr && !reexecuting()) {
+    travel->remember_input(input_kind::read, m_cycles, bytes.size());
+    for (char c : bytes)
+      travel->remember_input(input_kind::getc, m_cycles,
+                             static_cast<unsigned char>(c));
+  }
+
+  auto count = static_cast<u32>(bytes.size());
+  note_write(addr, count);
+  for (u32 done = 0; done < count;) {
+    auto run = ram.run_at(addr + done, count - done);
+    std::copy_n(bytes.begin() + done, run.size(), run.begin());
+    done += static_cast<u32>(run.size());
+  }
+  return count;
+}
+
+bool
+cpu::in_ram(u32 addr, u32 length) const noexcept {
+  return static_cast<u64>(addr) + length <= ram.pageCount * ram.pageSize;
+}
+
+bool
+cpu::check_range(u32 addr, u32 length) noexcept {
+  accessed = addr;
+  if (in_ram(addr, length)) [[likely]]
+    return true;
+  raise_fault(fault_codes::BAD_ADDRESS, addr);
+  return false;
+}
+
+bool
+cpu::check_aligned(u32 addr) noexcept {
+  if (!check_range(addr, 4))
+    return false;
+  if (addr % 4 != 0) [[unlikely]] {
+    raise_fault(fault_codes::MISALIGNED, addr);
+    return false;
+  }
+  return true;
+}
+
+bool
+cpu::reexecuting() const noexcept {
+  return travel != nullptr && travel->replaying(m_cycles);
+}
+
+void
+cpu::note_write(u32 addr, u32 width) noexcept {
+  stored = true;
+  if (watch_address - addr < width)
+    watch_hit = m_cycles;
+}
+
 void
 cpu::reg_store(u32 reg, u32 start_addr) {
-  ram[start_addr + 3] = byte_of<0>(reg);
-  ram[start_addr + 2] = byte_of<1>(reg);
-  ram[start_addr + 1] = byte_of<2>(reg);
-  ram[start_addr + 0] = byte_of<3>(reg);
+  note_write(start_addr, 4);
+  ram.store(start_addr + 3, byte_of<0>(reg));
+  ram.store(start_addr + 2, byte_of<1>(reg));
+  ram.store(start_addr + 1, byte_of<2>(reg));
+  ram.store(start_addr + 0, byte_of<3>(reg));
+}
+
+u32
+cpu::reg_load(u32 start_addr) {
+  return (ram.load(start_addr) << 24) | (ram.load(start_addr + 1) << 16) |
+         (ram.load(start_addr + 2) << 8) | ram.load(start_addr + 3);
+}
+
+u8
+cpu::console_port::read(u32 offset) {
+  cpu& core = executing != nullptr ? *executing : owner;
+  if (offset == 0)
+    return static_cast<u8>(core.console_input());
+  return core.input_ready() ? 1 : 0;
+}
+
+void
+cpu::console_port::write(u32 offset, u8 value) {
+  cpu& core = executing != nullptr ? *executing : owner;
+  if (offset == 0 && !core.reexecuting())
+    core.io->put_char(static_cast<char>(value));
 }
 
 [[nodiscard]] u32
-cpu::fetch(u32 const& r) const {
-  u32 instr = (ram[r] << 24) | (ram[r + 1] << 16) | (ram[r + 2] << 8) |
-              (ram[r + 3] << 0);
+cpu::fetch(u32 const& r) {
+  if (!check_range(r, 4)) [[unlikely]]
+    return 0;
+  ram_type const& mem = ram;
+  if (!mem.is_allocated(r) || !mem.is_allocated(r + 3)) [[unlikely]] {
+    raise_fault(fault_codes::UNINITIALIZED_FETCH, r);
+    return 0;
+  }
+  u32 instr = (mem.load_ram(r) << 24) | (mem.load_ram(r + 1) << 16) |
+              (mem.load_ram(r + 2) << 8) | (mem.load_ram(r + 3) << 0);
   return instr;
 }
 
@@ -212,13 +875,13 @@ cpu::set_needed_ctrl(u32* regptr) {
     ctrl_clear(ctrl_bits::CTRL_NEG_BIT);
     ctrl_clear(ctrl_bits::CTRL_ZERO_BIT);
   }
+  written = *regptr;
 }
 
 [[noreturn]] void
-cpu::invalid_registers() {
-  throw no_such_register(
-      "The CPU attempted to execute a malformed instruction");
-};
+cpu::throw_fault() const {
+  throw guest_fault(fault_description());
+}
 
 fetch_result
 cpu::get_next_instruction() {
@@ -239,12 +902,11 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
           return a & b;
         else if (opcode == opcodes::OR_R)
           return a | b;
-        else if (opcode == opcodes::XOR_R)
-          return a ^ b;
         else
-          throw no_such_opcode("opcode does not exist in bit manip group");
+          return a ^ b;
       };
       auto [rd, rs, rr] = register_decode_dss<u32>(instruction);
+      rd = writable(rd);
       *rd = operation(*rs, *rr);
       set_needed_ctrl(rd);
     } break;
@@ -259,16 +921,16 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
           using signed_a = std::make_signed_t<decltype(a)>;
           auto result = static_cast<signed_a>(a) << b;
           return static_cast<decltype(a)>(result);
-        } else if (opcode == opcodes::LRSH_R)
+        } else if (opcode == opcodes::LRSH_R) {
           return a >> b;
-        else if (opcode == opcodes::ARSH_R) {
+        } else {
           using signed_a = std::make_signed_t<decltype(a)>;
           auto result = static_cast<signed_a>(a) >> b;
           return static_cast<decltype(a)>(result);
-        } else
-          throw no_such_opcode("opcode does not exist in bit manip group");
+        }
       };
       auto [rd, rs, rr] = register_decode_dss<u32>(instruction);
+      rd = writable(rd);
       *rd = operation(*rs, *rr);
       set_needed_ctrl(rd);
     } break;
@@ -276,16 +938,15 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
     case opcodes::OR_I:
     case opcodes::XOR_I: {
       auto operation = [&opcode](auto a, auto b) {
-        if (opcode == opcodes::AND_R)
+        if (opcode == opcodes::AND_I)
           return a & b;
-        else if (opcode == opcodes::OR_R)
+        else if (opcode == opcodes::OR_I)
           return a | b;
-        else if (opcode == opcodes::XOR_R)
-          return a ^ b;
         else
-          throw no_such_opcode("opcode does not exist in bit manip group");
+          return a ^ b;
       };
       auto [rd, rs] = register_decode_dsi<u32>(instruction);
+      rd = writable(rd);
       auto im = literal_decode<8>(instruction);
       *rd = operation(*rs, im);
       set_needed_ctrl(rd);
@@ -301,37 +962,44 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
           return a << b;  // TODO: fix this
         else if (opcode == opcodes::LRSH_I)
           return a >> b;
-        else if (opcode == opcodes::ARSH_I)
-          return a >> b;  // TODO: fix
         else
-          throw no_such_opcode("opcode does not exist in bit manip group");
+          return a >> b;  // TODO: fix
       };
       auto [rd, rs] = register_decode_dsi<u32>(instruction);
+      rd = writable(rd);
       auto lit = literal_decode<8>(instruction);
       *rd = operation(*rs, lit);
       set_needed_ctrl(rd);
     } break;
     case opcodes::MOVE: {
       auto [rd, rs] = register_decode_dsi<u32>(instruction);
+      rd = writable(rd);
       *rd = *rs;
       set_needed_ctrl(rd);
     } break;
     case opcodes::NOT_R: {
       auto [rd, rs] = register_decode_dsi<u32>(instruction);
+      rd = writable(rd);
       *rd = ~*rs;
       set_needed_ctrl(rd);
     } break;
     case opcodes::LOAD_AT_ADDR: {
       metaout << "Loading from address... " << endl;
       auto [rd, rs] = register_decode_dsi<u32>(instruction);
-      *rd = ram[*rs];
+      rd = writable(rd);
+      if (!check_range(*rs, 1))
+        break;
+      *rd = ram.load(*rs);
       metaout << " Loaded value at " << *rs << " is " << *rd << endl;
       set_needed_ctrl(rd);
     } break;
     case opcodes::STORE_AT_ADDR: {
       metaout << "Storing to address... " << endl;
       auto [rd, rs] = register_decode_dsi<u32>(instruction);
-      ram[*rd] = *rs;
+      if (!check_range(*rd, 1))
+        break;
+      ram.store(*rd, static_cast<u8>(*rs));
+      note_write(*rd, 1);
       metaout << " Stored value of " << *rs << " to " << *rd << endl;
       // set_needed_ctrl(rd);
     } break;
@@ -372,10 +1040,11 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
         metaout << "... not taken " << endl;
         break;
       }
+      counted.branches++;
     } /* break; */
     case opcodes::JMP: {
       u32 addr = literal_decode<24>(instruction);
-      std::cout << "Moving off by " << addr << " from " << pc << std::endl;
+      metaout << "Moving off by " << addr << " from " << pc << endl;
       pc = addr;
 
     } break;
@@ -387,6 +1056,7 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
         metaout << "... not taken " << endl;
         break;
       }
+      counted.branches++;
     } /* break; */
     // Do not separate the BNCH and JMP instructions
     // BNCH relies on JMP being the next case
@@ -395,10 +1065,11 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
       u32 base = literal_decode<24>(instruction);
       auto offset = get_jump_offset(base);
       pc += offset;  // will be negative if first bit is set
-      metaout << "pc is now at " << pc << " and is " << ram[pc] << endl;
+      metaout << "pc is now at " << pc << endl;
     } break;
     case opcodes::HALT: {
       halted = true;
+      io->flush();
       metaout << "Halting." << endl;
     } break;
     case opcodes::TEST_EQ:
@@ -406,10 +1077,8 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
       auto predicate = [&opcode](auto l, auto r) {
         if (opcode == opcodes::TEST_EQ)
           return l == r;
-        else if (opcode == opcodes::TEST_NEQ)
-          return l != r;
         else
-          throw no_such_opcode("compared true to TEST once");
+          return l != r;
       };
 
       metaout << "testing " << endl;
@@ -431,6 +1100,7 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
     case opcodes::POPCNT: {
       metaout << "CPU does have popcnt!" << endl;
       auto [result, src] = register_decode_dsi<u32>(instruction);
+      result = writable(result);
       // __builtin_popcount works on ARM64 Apple Silicon
       *result = __builtin_popcount(*src);
       // asm("movl %1, %%eax;"
@@ -443,21 +1113,25 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
     } break;
     case opcodes::PRINT_I_R: {
       auto reg = register_decode_first<u32>(instruction);
-      cpuout << *reg;
+      if (!reexecuting())
+        io->put_int(*reg);
     } break;
     case opcodes::PUTC_R: {
       auto* reg = register_decode_first<u32>(instruction);
-      cpuout << static_cast<char>(*reg);
+      if (!reexecuting())
+        io->put_char(static_cast<char>(*reg));
     } break;
     case opcodes::CALL_FN_I: {
       metaout << "Calling function";
       u32 addr = literal_decode<24>(instruction);
       metaout << "Function address is " << addr << endl;
+      published.call(addr, pc);
       ra = pc;
       pc = addr;
     } break;
     case opcodes::RET: {
       metaout << "Returning to address at " << ra << endl;
+      published.ret();
       pc = ra;
     } break;
     case opcodes::ADD_DSI:
@@ -468,12 +1142,11 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
           return a + b;
         else if (opcode == opcodes::SUB_DSI)
           return a - b;
-        else if (opcode == opcodes::MULT_DSI)
-          return a * b;
         else
-          throw no_such_opcode("missing opcode in lambda for DSI");
+          return a * b;
       };
       auto [dest, l] = register_decode_dsi<u32>(instruction);
+      dest = writable(dest);
       auto short_literal = literal_decode<8>(instruction);
       metaout << "Setting " << *dest << " to " << *l << " op " << short_literal
               << endl;
@@ -488,12 +1161,11 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
           return a + b;
         else if (opcode == opcodes::MULT_DSS)
           return a * b;
-        else if (opcode == opcodes::SUB_DSS)
-          return a - b;
         else
-          throw no_such_opcode("missing opcode in lambda for DSS");
+          return a - b;
       };
       auto [dest, l, r] = register_decode_dss<u32>(instruction);
+      dest = writable(dest);
       metaout << "operating " << *l << " op " << *r << endl;
       // *dest = *l * *r;
       *dest = operation(*l, *r);
@@ -501,43 +1173,54 @@ cpu::execute_instruction(u8 opcode, u32 instruction) {
     } break;
     case opcodes::REG_PUSH: {
       metaout << "pushing to addr " << sp << endl;
+      if (!check_range(sp, 4))
+        break;
       reg_store(*register_decode_first<u32>(instruction), sp);
       sp += 4;
     } break;
     case opcodes::REG_POP: {
-      auto reg = register_decode_first<u32>(instruction);
-      *reg = fetch(sp - 4);
+      if (!check_range(sp - 4, 4))
+        break;
+      auto reg = writable(register_decode_first<u32>(instruction));
+      *reg = reg_load(sp - 4);
       metaout << "popping got value " << *reg << " from addr " << (sp - 4)
               << endl;
       sp -= 4;
     } break;
     case opcodes::RND_SEED: {
       auto p = register_decode_first<u32>(instruction);
-      srand(*p);
+      random.seed(*p);
     } break;
     case opcodes::RND_NUM: {
-      auto* p = register_decode_first<u32>(instruction);
-      *p = rand();
+      auto* p = writable(register_decode_first<u32>(instruction));
+      *p = random.next();
       set_needed_ctrl(p);
     } break;
     case opcodes::GETC_R: {
+      if (cooperative && !input_ready()) {
+        // retry this instruction once the scheduler resumes the guest
+        pc -= 4;
+        m_cycles--;
+        waiting_for_input = true;
+        break;
+      }
       auto [destination, _] = register_decode_dsi<u32>(instruction);
-      *destination = getchar();
+      destination = writable(destination);
+      *destination = console_input();
       set_needed_ctrl(destination);
     } break;
     case opcodes::SQRT_R_I: {
       auto* s = register_decode_first<u32>(instruction);
-      *s = static_cast<u32>(std::sqrt(*s));
+      auto root = static_cast<u32>(std::sqrt(*s));
+      s = writable(s);
+      *s = root;
       set_needed_ctrl(s);
     } break;
     case opcodes::EXT_INSTR: {
       ctrl_set(ctrl_bits::CTRL_EXT_FNC);
     } break;
     default: {
-      std::stringstream msg;
-      msg << "No such opcode " << static_cast<int>(opcode) << " in instruction "
-          << instruction;
-      throw no_such_opcode(msg.str());
+      raise_fault(fault_codes::BAD_OPCODE, instruction);
     }
   }
 }
@@ -556,10 +1239,8 @@ cpu::execute_extended_instruction(u8 opcode, u32 instruction) {
           return a + b;
         else if (opcode == extended_opcodes::FSUB_DSI)
           return a - b;
-        else if (opcode == extended_opcodes::FMULT_DSI)
-          return a * b;
         else
-          throw no_such_opcode("missing opcode in lambda for DSI");
+          return a * b;
       };
       auto [dest, l] = register_decode_dsi<f64>(instruction);
       auto short_literal = literal_decode<8, f64>(instruction);
@@ -576,10 +1257,8 @@ cpu::execute_extended_instruction(u8 opcode, u32 instruction) {
           return a * b;
         else if (opcode == extended_opcodes::FSUB_DSS)
           return a - b;
-        else if (opcode == extended_opcodes::FADD_DSS)
-          return a + b;
         else
-          throw no_such_opcode("missing opcode in lambda for DSS");
+          return a + b;
       };
       auto [dest, l, r] = register_decode_dss<f64>(instruction);
       metaout << "operating " << *l << " op " << *r << endl;
@@ -598,6 +1277,117 @@ cpu::execute_extended_instruction(u8 opcode, u32 instruction) {
       fa = value;
       metaout << "loading fa=" << fa << " from " << instruction;
     } break;
+    case extended_opcodes::ATOMIC_CAS: {
+      auto [addr, expected, desired] = register_decode_dss<u32>(instruction);
+      if (!check_aligned(*addr))
+        break;
+      auto word = ram.atomic_word(*addr);
+      u32 seen = ram_type::guest_word(*expected);
+      if (word.compare_exchange_strong(seen,
+                                       ram_type::guest_word(*desired))) {
+        ctrl_set(ctrl_bits::CTRL_TEST_TRUE);
+        note_write(*addr, 4);
+      } else {
+        *writable(expected) = ram_type::guest_word(seen);
+        ctrl_clear(ctrl_bits::CTRL_TEST_TRUE);
+      }
+    } break;
+    case extended_opcodes::ATOMIC_FETCH_ADD: {
+      auto [dest, addr, addend] = register_decode_dss<u32>(instruction);
+      dest = writable(dest);
+      if (!check_aligned(*addr))
+        break;
+      auto word = ram.atomic_word(*addr);
+      // the word is big endian in guest memory so the host cannot add to it
+      // directly
+      u32 seen = word.load();
+      while (!word.compare_exchange_weak(
+          seen, ram_type::guest_word(ram_type::guest_word(seen) + *addend)))
+        ;
+      note_write(*addr, 4);
+      *dest = ram_type::guest_word(seen);
+    } break;
+    case extended_opcodes::FENCE: {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    } break;
+    case extended_opcodes::SEND: {
+      auto [to, message] = register_decode_dsi<u32>(instruction);
+      if (cluster_send(*to, *message))
+        ctrl_set(ctrl_bits::CTRL_TEST_TRUE);
+      else
+        ctrl_clear(ctrl_bits::CTRL_TEST_TRUE);
+    } break;
+    case extended_opcodes::RECV: {
+      auto [dest, from] = register_decode_dsi<u32>(instruction);
+      dest = writable(dest);
+      auto message = cluster_receive(*from);
+      if (message) {
+        *dest = *message;
+        ctrl_set(ctrl_bits::CTRL_TEST_TRUE);
+      } else {
+        ctrl_clear(ctrl_bits::CTRL_TEST_TRUE);
+      }
+    } break;
+    case extended_opcodes::NODE_ID: {
+      auto [id, count] = register_decode_dsi<u32>(instruction);
+      *writable(id) = node != nullptr ? node->node_id() : 0;
+      *writable(count) = node != nullptr ? node->node_count() : 1;
+    } break;
+    case extended_opcodes::PUTS: {
+      auto [count, addr] = register_decode_dsi<u32>(instruction);
+      *writable(count) = console_puts(*addr);
+    } break;
+    case extended_opcodes::WRITE_BYTES: {
+      auto [addr, length] = register_decode_dsi<u32>(instruction);
+      console_write(*addr, *length);
+    } break;
+    case extended_opcodes::READ_BYTES: {
+      if (cooperative && !input_ready()) {
+        // like GETC_R, retry from the EXT_INSTR prefix once the scheduler
+        // resumes the guest
+        pc -= 8;
+        m_cycles -= 2;
+        counted.prefixes--;
+        m_clock_cycles -= costs.base[opcodes::EXT_INSTR];
+        waiting_for_input = true;
+        break;
+      }
+      auto [count, addr, length] = register_decode_dss<u32>(instruction);
+      *writable(count) = console_read(*addr, *length);
+    } break;
+    case extended_opcodes::RDCYCLE: {
+      write_counter(instruction, m_cycles);
+    } break;
+    case extended_opcodes::RDINSTRET: {
+      write_counter(instruction, instructions());
+    } break;
+    case extended_opcodes::RDTIME: {
+      write_counter(instruction, host_time());
+    } break;
+    case extended_opcodes::RDBRANCH: {
+      write_counter(instruction, counted.branches);
+    } break;
+    case extended_opcodes::RDMEMOPS: {
+      write_counter(instruction, counted.memory);
+    } break;
+    case extended_opcodes::RETI: {
+      if (!check_range(sp - 8, 8))
+        break;
+      ctrl = reg_load(sp - 4);
+      pc = reg_load(sp - 8);
+      sp -= 8;
+      // an interrupt may have been waiting for the handler to finish
+      next_event.store(0);
+    } break;
+    case extended_opcodes::INT_MASK: {
+      u32 lines = *register_decode_first<u32>(instruction) & 0xff;
+      ctrl = (ctrl & ~ctrl_bits::CTRL_INT_MASK) | (lines << 8);
+      if (lines != 0)
+        ctrl_set(ctrl_bits::CTRL_INT_ENABLE);
+      else
+        ctrl_clear(ctrl_bits::CTRL_INT_ENABLE);
+      next_event.store(0);
+    } break;
     case extended_opcodes::LOAD_FIM_FB: {
       u32 bits = ((literal_decode<32, u32>(instruction) & ~0xff000000) << 8);
       f32 value = *(f32*)&bits;
@@ -605,7 +1395,7 @@ cpu::execute_extended_instruction(u8 opcode, u32 instruction) {
       metaout << "loading fb=" << fb << " from " << instruction;
     } break;
     default: {
-      throw no_such_opcode("The extended opcode does not exist");
+      raise_fault(fault_codes::BAD_OPCODE, instruction);
     }
   }
 }
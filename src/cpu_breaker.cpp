@@ -14,6 +14,11 @@ cpu_breaker::get_next_instruction() {
   return breakee.get_next_instruction();
 }
 
+void
+cpu_breaker::set_needed_ctrl(u32* regptr) {
+  breakee.set_needed_ctrl(regptr);
+}
+
 u32&
 cpu_breaker::ref_a() {
   return breakee.a;
@@ -0,0 +1,186 @@
+#include "dma_controller.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace emulator {
+
+namespace {
+constexpr u32 source_register = 0x00;
+constexpr u32 destination_register = 0x04;
+constexpr u32 length_register = 0x08;
+constexpr u32 command_register = 0x0C;
+constexpr u32 status_register = 0x0D;
+}  // namespace
+
+dma_controller::dma_controller(cpu& owner,
+                               block_device* disk,
+                               u32 line)
+    : owner(owner),
+      ram(owner.get_ram()),
+      disk(disk),
+      line(line),
+      worker([this] { work(); }) {}
+
+dma_controller::~dma_controller() {
+  {
+    std::lock_guard guard{lock};
+    stopping = true;
+  }
+  changed.notify_all();
+  worker.join();
+}
+
+u8
+dma_controller::read(u32 offset) {
+  return registers[offset];
+}
+
+void
+dma_controller::write(u32 offset, u8 value) {
+  if (offset == command_register) {
+    if (registers[status_register] != status_busy && !start(value))
+      registers[status_register] = status_error;
+  } else if (offset < command_register) {
+    registers[offset] = value;
+  }
+}
+
+std::any
+dma_controller::save_state() {
+  wait();
+  return registers;
+}
+
+void
+dma_controller::restore_state(std::any const& saved) {
+  wait();
+  registers = std::any_cast<decltype(registers) const&>(saved);
+}
+
+void
+dma_controller::wait() {
+  std::unique_lock guard{lock};
+  changed.wait(guard, [this] { return !copying; });
+}
+
+u32
+dma_controller::word_at(u32 offset) const noexcept {
+  return (registers[offset] << 24) | (registers[offset + 1] << 16) |
+         (registers[offset + 2] << 8) | registers[offset + 3];
+}
+
+// Check the transfer, fence its ram, hand it to the worker and schedule the
+// cycle the guest sees it finish. Runs on the guest's thread, so the fence is
+// up before the guest's next access.
+bool
+dma_controller::start(u8 command) {
+  transfer t{command, word_at(source_register),
+             word_at(destination_register), word_at(length_register)};
+  u64 ram_size = ram.pageCount * ram.pageSize;
+  auto fits_ram = [&](u64 addr) { return addr + t.length <= ram_size; };
+  auto fits_disk = [&](u64 sector) {
+    return disk != nullptr &&
+           sector * block_device::sector_size + t.length <=
+               disk->contents().size();
+  };
+
+  switch (command) {
+    case ram_to_ram:
+      if (!fits_ram(t.source) || !fits_ram(t.destination) ||
+          (t.source < t.destination + t.length &&
+           t.destination < t.source + t.length))
+        return false;
+      break;
+    case disk_to_ram:
+      if (!fits_disk(t.source) || !fits_ram(t.destination))
+        return false;
+      break;
+    case ram_to_disk:
+      if (!fits_ram(t.source) || !fits_disk(t.destination) ||
+          !disk->is_writable())
+        return false;
+      break;
+    default:
+      return false;
+  }
+
+  if (command != disk_to_ram)
+    ram.fence_pages(t.source, t.length);
+  if (command != ram_to_disk) {
+    ram.fence_pages(t.destination, t.length);
+    owner.device_wrote(t.destination, t.length);
+  }
+  registers[status_register] = status_busy;
+  {
+    std::lock_guard guard{lock};
+    pending = t;
+    copying = true;
+  }
+  changed.notify_all();
+
+  u64 finished = owner.clock_cycles() + t.length / bytes_per_cycle + 1;
+  owner.schedule(finished, [this] {
+    wait();
+    registers[status_register] = status_done;
+    owner.raise_interrupt(line);
+  });
+  return true;
+}
+
+void
+dma_controller::copy(transfer const& t) {
+  for (u32 done = 0; done < t.length;) {
+    u32 left = t.length - done;
+    u32 step;
+    switch (t.command) {
+      case ram_to_ram: {
+        auto from = ram.run_at(t.source + done, left);
+        auto to = ram.run_at(t.destination + done, from.size());
+        step = static_cast<u32>(to.size());
+        std::memcpy(to.data(), from.data(), step);
+      } break;
+      case disk_to_ram: {
+        auto to = ram.run_at(t.destination + done, left);
+        step = static_cast<u32>(to.size());
+        std::memcpy(to.data(),
+                    disk->contents().data() +
+                        u64{t.source} * block_device::sector_size + done,
+                    step);
+      } break;
+      default: {
+        auto from = ram.run_at(t.source + done, left);
+        step = static_cast<u32>(from.size());
+        std::memcpy(disk->contents().data() +
+                        u64{t.destination} * block_device::sector_size + done,
+                    from.data(), step);
+      }
+    }
+    done += step;
+  }
+}
+
+void
+dma_controller::work() {
+  std::unique_lock guard{lock};
+  while (true) {
+    changed.wait(guard, [this] { return pending.has_value() || stopping; });
+    if (!pending)
+      return;
+    transfer t = *pending;
+    pending.reset();
+    guard.unlock();
+
+    copy(t);
+    if (t.command != disk_to_ram)
+      ram.release_pages(t.source, t.length);
+    if (t.command != ram_to_disk)
+      ram.release_pages(t.destination, t.length);
+
+    guard.lock();
+    copying = false;
+    changed.notify_all();
+  }
+}
+
+}  // namespace emulator
@@ -0,0 +1,32 @@
+#include "event_queue.hpp"
+
+#include <utility>
+
+namespace emulator {
+
+void
+event_queue::schedule(u64 cycle, action what) {
+  // events due on the same cycle run in the order they were scheduled
+  events.push({cycle, scheduled++, std::move(what)});
+}
+
+u64
+event_queue::next_cycle() const noexcept {
+  return events.empty() ? never : events.top().cycle;
+}
+
+void
+event_queue::run_due(u64 now) {
+  while (!events.empty() && events.top().cycle <= now) {
+    action what = events.top().what;
+    events.pop();
+    what();
+  }
+}
+
+bool
+event_queue::empty() const noexcept {
+  return events.empty();
+}
+
+}  // namespace emulator
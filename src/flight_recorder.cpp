@@ -0,0 +1,52 @@
+#include "flight_recorder.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <iomanip>
+
+namespace emulator {
+
+flight_recorder::flight_recorder(std::size_t capacity)
+    : records(std::bit_ceil(std::max<std::size_t>(capacity, 1))),
+      mask(records.size() - 1) {}
+
+std::size_t
+flight_recorder::capacity() const noexcept {
+  return records.size();
+}
+
+std::vector<flight_record>
+flight_recorder::history() const {
+  u64 held = std::min<u64>(head, records.size());
+  std::vector<flight_record> out;
+  out.reserve(held);
+  for (u64 i = head - held; i < head; i++)
+    out.push_back(records[i & mask]);
+  return out;
+}
+
+void
+flight_recorder::dump(std::ostream& os) const {
+  auto held = history();
+  auto flags = os.flags();
+  os << std::dec << "Flight recorder: last " << held.size() << " of " << head
+     << " instructions, oldest first\n";
+  os << std::setw(14) << "cycle" << std::setw(8) << "pc" << std::setw(12)
+     << "instruction" << std::setw(12) << "ctrl" << std::setw(12) << "value"
+     << "\n";
+  for (auto const& r : held) {
+    os << std::dec << std::setfill(' ') << std::setw(14) << r.cycle
+       << std::hex << std::setfill('0') << "  0x" << std::setw(4) << r.pc
+       << "  0x" << std::setw(8) << r.instruction << "  0x" << std::setw(8)
+       << r.ctrl << "  0x" << std::setw(8) << r.value << "\n";
+  }
+  os << std::setfill(' ');
+  os.flags(flags);
+}
+
+void
+flight_recorder::clear() noexcept {
+  head = 0;
+}
+
+}  // namespace emulator
@@ -0,0 +1,384 @@
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bytedefs.hpp"
+#include "cpu.hpp"
+#include "rng.hpp"
+
+// Writes an a.out image with a controlled instruction mix, for stressing
+// particular paths of the interpreter.
+//
+// The image is the full 64 KiB of ram. The code at 0xF000 runs a generated
+// body of straight line code a fixed number of times, reached through a
+// chain of calls, and then halts, so every run executes exactly the same
+// instructions. The body draws its instructions from the classes below by
+// weight, and some of them are forward branches whose outcome is fixed when
+// the image is generated. Loads and stores use fixed addresses in a data
+// region after the code.
+//
+//   0x0100  stack
+//   0x1000  call chain, then the body
+//   ....    data region, from the next 512 byte page
+//   0xF000  main loop
+
+namespace {
+
+using emulator::byte;
+using emulator::u32;
+using emulator::u64;
+using ops = emulator::cpu::opcodes;
+using ext = emulator::cpu::extended_opcodes;
+
+enum kind { alu, mul, load, store, stack, fp, kind_count };
+constexpr char const* kind_names[kind_count] = {"alu",   "mul",   "load",
+                                                "store", "stack", "fp"};
+
+constexpr u32 stack_limit = 0x1000;
+constexpr u32 code_base = 0x1000;
+constexpr u32 main_base = 0xF000;
+constexpr u32 max_iterations = 0x7FFFFF;
+
+constexpr u32 reg_a = 1, reg_b = 2, reg_x = 3, reg_ra = 5;
+constexpr u32 reg_fa = 1, reg_fb = 2, reg_fx = 3;
+
+struct options {
+  u64 instructions = 1000000;
+  u32 body = 256;
+  std::array<u32, kind_count> mix = {6, 1, 2, 1, 1, 1};
+  double branches = 0.1;
+  u32 footprint = 0x4000;
+  double spread = 1.0;
+  u32 call_depth = 1;
+  u32 seed = 1;
+  std::string out = "a.out";
+};
+
+void
+usage() {
+  std::cerr
+      << "usage: emugen [--instructions N] [--body N] "
+         "[--mix alu=6,mul=1,load=2,store=1,stack=1,fp=1] [--branches F] "
+         "[--footprint BYTES] [--spread F] [--call-depth N] [--seed N] "
+         "[--out FILE]"
+      << std::endl;
+}
+
+constexpr u32
+encode(u32 opcode, u32 b2, u32 b1, u32 b0) {
+  return (opcode << 24) | ((b2 & 0xff) << 16) | ((b1 & 0xff) << 8) |
+         (b0 & 0xff);
+}
+
+constexpr u32
+encode24(u32 opcode, u32 immediate) {
+  return (opcode << 24) | (immediate & 0xffffff);
+}
+
+// Instructions generated together. Branches never land inside a unit.
+struct unit {
+  std::vector<u32> words;
+  // for a branch, how many of the following units it skips when taken
+  u32 skip = 0;
+  bool branch = false;
+  bool taken = false;
+};
+
+struct generator {
+  options const& opts;
+  emulator::rng random;
+  u32 data_base = 0;
+  u32 window = 0;
+
+  explicit generator(options const& opts) : opts(opts), random(opts.seed) {}
+
+  u32
+  pick(u32 n) {
+    return random.next() % n;
+  }
+
+  double
+  chance() {
+    return random.next() / static_cast<double>(1u << 31);
+  }
+
+  u32
+  data_reg() {
+    return reg_a + pick(3);
+  }
+
+  u32
+  address() {
+    return data_base + pick(window);
+  }
+
+  unit
+  make(kind k) {
+    u32 d = data_reg(), s = data_reg(), t = data_reg();
+    switch (k) {
+      case alu: {
+        static constexpr u32 dss[] = {ops::ADD_DSS, ops::SUB_DSS, ops::AND_R,
+                                      ops::OR_R, ops::XOR_R};
+        static constexpr u32 dsi[] = {ops::ADD_DSI, ops::SUB_DSI, ops::AND_I,
+                                      ops::OR_I, ops::XOR_I};
+        switch (pick(8)) {
+          case 0:
+          case 1:
+            return {{encode(dss[pick(5)], d, s, t)}};
+          case 2:
+          case 3:
+            return {{encode(dsi[pick(5)], d, s, pick(256))}};
+          case 4:
+            return {{encode(pick(2) ? ops::LLSH_I : ops::LRSH_I, d, s,
+                            1 + pick(7))}};
+          case 5:
+            return {{encode(pick(2) ? ops::MOVE : ops::NOT_R, d, s, 0)}};
+          case 6:
+            return {{encode24(ops::LD_IM_A + d - reg_a, pick(0x800000))}};
+          default:
+            return {{encode(pick(2) ? ops::TEST_EQ : ops::POPCNT, d, s, t)}};
+        }
+      }
+      case mul:
+        if (pick(4) == 0)
+          return {{encode(ops::SQRT_R_I, 0, 0, d)}};
+        return {{pick(2) ? encode(ops::MULT_DSS, d, s, t)
+                         : encode(ops::MULT_DSI, d, s, pick(256))}};
+      case load:
+        return {{encode24(ops::LD_IM_X, address()),
+                 encode(ops::LOAD_AT_ADDR, reg_a + pick(2), reg_x, 0)}};
+      case store:
+        return {{encode24(ops::LD_IM_X, address()),
+                 encode(ops::STORE_AT_ADDR, reg_x, reg_a + pick(2), 0)}};
+      case stack:
+        return {{encode(ops::REG_PUSH, 0, 0, s),
+                 encode(ops::REG_POP, 0, 0, d)}};
+      case fp: {
+        static constexpr u32 dss[] = {ext::FADD_DSS, ext::FSUB_DSS,
+                                      ext::FMULT_DSS};
+        u32 fd = reg_fa + pick(3), fs = reg_fa + pick(3), ft = reg_fa + pick(3);
+        u32 word = pick(4) == 0 ? encode(ext::FSQRT_R_I, 0, 0, fd)
+                                : encode(dss[pick(3)], fd, fs, ft);
+        return {{encode(ops::EXT_INSTR, 0, 0, 0), word}};
+      }
+      default:
+        return {};
+    }
+  }
+
+  kind
+  pick_kind(u32 total_weight) {
+    u32 w = pick(total_weight);
+    for (u32 k = 0; k < kind_count; k++) {
+      if (w < opts.mix[k])
+        return static_cast<kind>(k);
+      w -= opts.mix[k];
+    }
+    return alu;
+  }
+
+  std::vector<unit>
+  body() {
+    u32 total_weight = 0;
+    for (u32 w : opts.mix)
+      total_weight += w;
+    std::vector<unit> units;
+    for (u32 i = 0; i < opts.body; i++) {
+      if (chance() < opts.branches) {
+        // TEST_EQ z z always holds and TEST_NEQ z z never does
+        unit u;
+        u.branch = true;
+        u.taken = pick(2) == 0;
+        u.skip = 1 + pick(4);
+        u.words = {encode(u.taken ? ops::TEST_EQ : ops::TEST_NEQ, 0, 0, 0),
+                   encode24(ops::BNCH, 0)};
+        units.push_back(std::move(u));
+      } else {
+        units.push_back(make(pick_kind(total_weight)));
+      }
+    }
+    return units;
+  }
+};
+
+// Cycles to run the body once, following its branches
+u64
+body_cycles(std::vector<unit> const& units) {
+  u64 cycles = 0;
+  for (std::size_t i = 0; i < units.size();) {
+    cycles += units[i].words.size();
+    i += units[i].branch && units[i].taken ? 1 + units[i].skip : 1;
+  }
+  return cycles;
+}
+
+void
+put_word(std::vector<byte>& image, u32 addr, u32 word) {
+  image[addr] = static_cast<byte>(word >> 24);
+  image[addr + 1] = static_cast<byte>(word >> 16);
+  image[addr + 2] = static_cast<byte>(word >> 8);
+  image[addr + 3] = static_cast<byte>(word);
+}
+
+bool
+parse_mix(std::string const& spec, std::array<u32, kind_count>& mix) {
+  mix.fill(0);
+  std::stringstream ss{spec};
+  for (std::string item; std::getline(ss, item, ',');) {
+    auto eq = item.find('=');
+    if (eq == std::string::npos)
+      return false;
+    auto name = item.substr(0, eq);
+    auto k = std::find(std::begin(kind_names), std::end(kind_names), name);
+    if (k == std::end(kind_names))
+      return false;
+    mix[k - std::begin(kind_names)] =
+        std::strtoul(item.c_str() + eq + 1, nullptr, 10);
+  }
+  return std::any_of(mix.begin(), mix.end(), [](u32 w) { return w > 0; });
+}
+
+}  // namespace
+
+int
+main(int argc, char const** argv) {
+  options opts;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    char const* value = argv[++i];
+    if (arg == "--instructions") {
+      opts.instructions = std::strtoull(value, nullptr, 0);
+    } else if (arg == "--body") {
+      opts.body = std::max(1ul, std::strtoul(value, nullptr, 0));
+    } else if (arg == "--mix") {
+      if (!parse_mix(value, opts.mix)) {
+        std::cerr << "Bad instruction mix " << value << std::endl;
+        return 1;
+      }
+    } else if (arg == "--branches") {
+      opts.branches = std::clamp(std::strtod(value, nullptr), 0.0, 1.0);
+    } else if (arg == "--footprint") {
+      opts.footprint = std::max(1ul, std::strtoul(value, nullptr, 0));
+    } else if (arg == "--spread") {
+      opts.spread = std::clamp(std::strtod(value, nullptr), 0.0, 1.0);
+    } else if (arg == "--call-depth") {
+      opts.call_depth = std::max(1ul, std::strtoul(value, nullptr, 0));
+    } else if (arg == "--seed") {
+      opts.seed = std::strtoul(value, nullptr, 0);
+    } else if (arg == "--out") {
+      opts.out = value;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  // one saved ra per level of the chain and the loop counter of main
+  if (0x0100 + 4 * (opts.call_depth + 1) > stack_limit) {
+    std::cerr << "Call depth " << opts.call_depth << " overflows the stack"
+              << std::endl;
+    return 1;
+  }
+
+  generator gen{opts};
+  u32 body_base = code_base + 16 * (opts.call_depth - 1);
+  // the body's size depends on the units drawn, so lay out the data region
+  // after the largest possible body: every unit two words long
+  u64 body_end = body_base + 8ull * opts.body + 4;
+  gen.data_base = static_cast<u32>((body_end + 511) / 512 * 512);
+  if (static_cast<u64>(gen.data_base) + opts.footprint > main_base) {
+    std::cerr << "A footprint of " << opts.footprint << " bytes does not fit "
+              << "between the code and 0xF000; use a smaller --body or "
+              << "--footprint" << std::endl;
+    return 1;
+  }
+  // the working set is the first spread of the footprint
+  gen.window = std::max<u32>(
+      1, static_cast<u32>(opts.spread * static_cast<double>(opts.footprint)));
+
+  auto units = gen.body();
+  std::vector<byte> image(0x10000);
+
+  // call chain: every level saves ra around the call to the next
+  for (u32 level = 0; level + 1 < opts.call_depth; level++) {
+    u32 at = code_base + 16 * level;
+    put_word(image, at, encode(ops::REG_PUSH, 0, 0, reg_ra));
+    put_word(image, at + 4, encode24(ops::CALL_FN_I, at + 16));
+    put_word(image, at + 8, encode(ops::REG_POP, 0, 0, reg_ra));
+    put_word(image, at + 12, encode(ops::RET, 0, 0, 0));
+  }
+
+  std::vector<u32> starts;
+  u32 at = body_base;
+  for (auto const& u : units) {
+    starts.push_back(at);
+    at += 4 * static_cast<u32>(u.words.size());
+  }
+  starts.push_back(at);
+  for (std::size_t i = 0; i < units.size(); i++) {
+    auto words = units[i].words;
+    if (units[i].branch) {
+      auto target = std::min(i + 1 + units[i].skip, units.size());
+      words.back() = encode24(ops::BNCH, starts[target]);
+    }
+    for (std::size_t w = 0; w < words.size(); w++)
+      put_word(image, starts[i] + 4 * static_cast<u32>(w), words[w]);
+  }
+  put_word(image, at, encode(ops::RET, 0, 0, 0));
+
+  u64 chain = 4ull * (opts.call_depth - 1) + body_cycles(units) + 1;
+  // per iteration: PUSH, CALL, the chain, POP, SUB, TEST, BNCH and JMP
+  u64 per_iteration = 7 + chain;
+  u64 iterations = opts.instructions > 5 + per_iteration
+                       ? (opts.instructions - 5) / per_iteration
+                       : 1;
+  if (iterations > max_iterations) {
+    std::cerr << "Too many iterations of the body; use a larger --body"
+              << std::endl;
+    return 1;
+  }
+
+  // 1.5 and 0.75 in the top 24 bits of a float
+  u32 loop = main_base + 20;
+  u32 done = loop + 28;
+  std::vector<u32> main_code = {
+      encode(ops::EXT_INSTR, 0, 0, 0),
+      encode24(ext::LOAD_FIM_FA, 0x3FC000),
+      encode(ops::EXT_INSTR, 0, 0, 0),
+      encode24(ext::LOAD_FIM_FB, 0x3F4000),
+      encode24(ops::LD_IM_B, static_cast<u32>(iterations)),
+      encode(ops::REG_PUSH, 0, 0, reg_b),
+      encode24(ops::CALL_FN_I, code_base),
+      encode(ops::REG_POP, 0, 0, reg_b),
+      encode(ops::SUB_DSI, reg_b, reg_b, 1),
+      encode(ops::TEST_EQ, 0, 0, reg_b),
+      encode24(ops::BNCH, done),
+      encode24(ops::JMP, loop),
+      encode(ops::HALT, 0, 0, 0)};
+  for (std::size_t i = 0; i < main_code.size(); i++)
+    put_word(image, main_base + 4 * static_cast<u32>(i), main_code[i]);
+
+  std::ofstream f{opts.out, std::ios::binary};
+  f.write(reinterpret_cast<char const*>(image.data()),
+          static_cast<std::streamsize>(image.size()));
+  if (!f) {
+    std::cerr << "Failed to write " << opts.out << std::endl;
+    return 1;
+  }
+
+  u64 total = iterations * per_iteration + 5;
+  std::cout << opts.out << ": " << units.size() << " unit body, "
+            << body_cycles(units) << " instructions per pass, "
+            << "call depth " << opts.call_depth << ", " << iterations
+            << " iterations, " << total << " instructions" << std::endl;
+  return 0;
+}
@@ -0,0 +1,114 @@
+#include "input_log.hpp"
+
+#include <cstring>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+namespace emulator {
+
+input_log::input_log(mode m) : m_mode(m) {}
+
+input_log
+input_log::record_to(std::string const& filename) {
+  input_log log{mode::record};
+  log.out.open(filename, std::ios::binary | std::ios::trunc);
+  if (!log.out)
+    throw std::runtime_error("Failed to open input log " + filename);
+  log.out.write(magic, sizeof(magic));
+  log.out.put(static_cast<char>(version));
+  log.buffer.reserve(buffer_size);
+  return log;
+}
+
+input_log
+input_log::replay_from(std::string const& filename) {
+  input_log log{mode::replay};
+  std::ifstream f{filename, std::ios::binary};
+  if (!f)
+    throw std::runtime_error("Failed to open input log " + filename);
+  log.buffer.assign(std::istreambuf_iterator<char>(f),
+                    std::istreambuf_iterator<char>());
+  if (log.buffer.size() < sizeof(magic) + 1 ||
+      std::memcmp(log.buffer.data(), magic, sizeof(magic)) != 0)
+    throw std::runtime_error(filename + " is not an input log");
+  if (log.buffer[sizeof(magic)] != version)
+    throw std::runtime_error(filename + " has an unsupported log version");
+  log.position = sizeof(magic) + 1;
+  return log;
+}
+
+input_log::~input_log() {
+  flush();
+}
+
+input_log::mode
+input_log::get_mode() const noexcept {
+  return m_mode;
+}
+
+void
+input_log::record(input_kind kind, u64 cycle, u32 value) {
+  // worst case entry is two 10 byte varints and the kind
+  if (buffer.size() + 21 > buffer_size)
+    flush();
+  put_varint(cycle - last_cycle);
+  buffer.push_back(static_cast<u8>(kind));
+  put_varint(value);
+  last_cycle = cycle;
+}
+
+u32
+input_log::replay(input_kind kind, u64 cycle) {
+  if (position >= buffer.size()) {
+    std::stringstream msg;
+    msg << "Replay diverged: input log exhausted at cycle " << cycle;
+    throw std::runtime_error(msg.str());
+  }
+  u64 logged_cycle = last_cycle + get_varint();
+  auto logged_kind = static_cast<input_kind>(buffer.at(position++));
+  u32 value = static_cast<u32>(get_varint());
+  if (logged_cycle != cycle || logged_kind != kind) {
+    std::stringstream msg;
+    msg << "Replay diverged: log has input kind "
+        << static_cast<int>(logged_kind) << " at cycle " << logged_cycle
+        << " but cpu requested kind " << static_cast<int>(kind)
+        << " at cycle " << cycle;
+    throw std::runtime_error(msg.str());
+  }
+  last_cycle = logged_cycle;
+  return value;
+}
+
+void
+input_log::flush() {
+  if (m_mode != mode::record || !out.is_open())
+    return;
+  out.write(reinterpret_cast<char const*>(buffer.data()),
+            static_cast<std::streamsize>(buffer.size()));
+  out.flush();
+  buffer.clear();
+}
+
+void
+input_log::put_varint(u64 value) {
+  while (value >= 0x80) {
+    buffer.push_back(static_cast<u8>(value | 0x80));
+    value >>= 7;
+  }
+  buffer.push_back(static_cast<u8>(value));
+}
+
+u64
+input_log::get_varint() {
+  u64 value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    u8 b = buffer.at(position++);
+    value |= static_cast<u64>(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return value;
+  }
+  throw std::runtime_error("Malformed varint in input log");
+}
+
+}  // namespace emulator
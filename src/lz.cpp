@@ -0,0 +1,136 @@
+#include "lz.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace emulator {
+
+namespace {
+
+constexpr std::size_t min_match = 4;
+constexpr std::size_t max_offset = 0xffff;
+constexpr unsigned hash_bits = 14;
+
+u32
+read32(u8 const* p) {
+  u32 v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+u32
+hash(u32 v) {
+  return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+void
+put_length(std::vector<u8>& out, std::size_t n) {
+  for (; n >= 255; n -= 255)
+    out.push_back(255);
+  out.push_back(static_cast<u8>(n));
+}
+
+void
+put_sequence(std::vector<u8>& out,
+             u8 const* literals,
+             std::size_t literal_count,
+             std::size_t offset,
+             std::size_t match_length) {
+  std::size_t extra = match_length - min_match;
+  u8 token = static_cast<u8>((std::min<std::size_t>(literal_count, 15) << 4) |
+                             std::min<std::size_t>(extra, 15));
+  out.push_back(token);
+  if (literal_count >= 15)
+    put_length(out, literal_count - 15);
+  out.insert(out.end(), literals, literals + literal_count);
+  if (match_length == 0)
+    return;
+  out.push_back(static_cast<u8>(offset));
+  out.push_back(static_cast<u8>(offset >> 8));
+  if (extra >= 15)
+    put_length(out, extra - 15);
+}
+
+}  // namespace
+
+void
+lz_compress(std::span<u8 const> in, std::vector<u8>& out) {
+  std::vector<u32> table(std::size_t{1} << hash_bits, 0);
+  u8 const* base = in.data();
+  std::size_t size = in.size();
+  std::size_t anchor = 0;
+  std::size_t i = 0;
+  while (size >= min_match && i + min_match <= size) {
+    u32 v = read32(base + i);
+    u32 h = hash(v);
+    std::size_t candidate = table[h];
+    table[h] = static_cast<u32>(i);
+    if (candidate >= i || i - candidate > max_offset ||
+        read32(base + candidate) != v) {
+      i++;
+      continue;
+    }
+    std::size_t length = min_match;
+    while (i + length < size && base[candidate + length] == base[i + length])
+      length++;
+    put_sequence(out, base + anchor, i - anchor, i - candidate, length);
+    i += length;
+    anchor = i;
+  }
+  // the last sequence is all literals; its match nibble is 0
+  u8 token = static_cast<u8>(std::min<std::size_t>(size - anchor, 15) << 4);
+  out.push_back(token);
+  if (size - anchor >= 15)
+    put_length(out, size - anchor - 15);
+  out.insert(out.end(), base + anchor, base + size);
+}
+
+void
+lz_decompress(std::span<u8 const> in,
+              std::size_t raw_size,
+              std::vector<u8>& out) {
+  std::size_t start = out.size();
+  out.reserve(start + raw_size);
+  std::size_t i = 0;
+  auto malformed = [] {
+    throw std::runtime_error("Malformed compressed trace block");
+  };
+  auto get_length = [&](std::size_t n) {
+    if (n != 15)
+      return n;
+    u8 b;
+    do {
+      if (i >= in.size())
+        malformed();
+      b = in[i++];
+      n += b;
+    } while (b == 255);
+    return n;
+  };
+  while (i < in.size()) {
+    u8 token = in[i++];
+    std::size_t literals = get_length(token >> 4);
+    if (literals > in.size() - i)
+      malformed();
+    out.insert(out.end(), in.begin() + i, in.begin() + i + literals);
+    i += literals;
+    if (i == in.size())
+      break;
+    if (in.size() - i < 2)
+      malformed();
+    std::size_t offset = in[i] | (in[i + 1] << 8);
+    i += 2;
+    std::size_t length = get_length(token & 0xf) + min_match;
+    if (offset == 0 || offset > out.size() - start)
+      malformed();
+    // byte by byte, since a match may overlap what it copies
+    std::size_t from = out.size() - offset;
+    for (std::size_t k = 0; k < length; k++)
+      out.push_back(out[from + k]);
+  }
+  if (out.size() - start != raw_size)
+    malformed();
+}
+
+}  // namespace emulator
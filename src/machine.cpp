@@ -0,0 +1,44 @@
+#include "machine.hpp"
+
+#include <exception>
+#include <thread>
+
+namespace emulator {
+
+machine::machine(unsigned core_count, u32 stack_stride)
+    : ram(std::make_shared<cpu::ram_type>()) {
+  for (unsigned id = 0; id < core_count; id++)
+    cores.push_back(std::make_unique<cpu>(ram, id, 0x0100 + id * stack_stride));
+}
+
+unsigned
+machine::core_count() const noexcept {
+  return static_cast<unsigned>(cores.size());
+}
+
+cpu&
+machine::core(unsigned id) {
+  return *cores.at(id);
+}
+
+void
+machine::run() {
+  std::vector<std::exception_ptr> errors(cores.size());
+  std::vector<std::thread> threads;
+  for (std::size_t i = 0; i < cores.size(); i++) {
+    threads.emplace_back([this, &errors, i] {
+      try {
+        cores[i]->run();
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  for (auto& e : errors)
+    if (e)
+      std::rethrow_exception(e);
+}
+
+}  // namespace emulator
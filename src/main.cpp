@@ -1,21 +1,78 @@
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <cassert>
+#include <csignal>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <ios>
 #include <map>
+#include <optional>
 #include <stdexcept>
 #include <vector>
 
 #include "backwards.hpp"
 #include "bytedefs.hpp"
+#include "cost_table.hpp"
 #include "cpu.hpp"
 #include "emulator.hpp"
+#include "exceptions.hpp"
+#include "cluster.hpp"
+#include "input_log.hpp"
+#include "machine.hpp"
+#include "memory_profile.hpp"
+#include "time_machine.hpp"
+#include "trace.hpp"
 #include "printer.hpp"
+#include "profiler.hpp"
+#include "stats_segment.hpp"
 #include "utils.hpp"
 
+namespace {
+
+// cpus whose flight recorders SIGUSR1 dumps; not changed once it is handled
+std::vector<emulator::cpu*> flight_targets;
+
+void
+dump_flight_recorders(int) {
+  for (auto* proc : flight_targets)
+    proc->request_flight_dump();
+}
+
+void
+watch_flight_recorders(std::vector<emulator::cpu*> targets) {
+  if (auto records_env = getenv("FLIGHT_RECORDS"); records_env != nullptr) {
+    for (auto* proc : targets)
+      proc->recorder() =
+          emulator::flight_recorder{std::strtoul(records_env, nullptr, 10)};
+  }
+  flight_targets = std::move(targets);
+  std::signal(SIGUSR1, dump_flight_recorders);
+}
+
+// the stats segment's name; its destructor only runs on a normal exit, so
+// SIGINT and SIGTERM remove it before ending the process
+char stats_name[256];
+
+void
+remove_stats_segment(int signal) {
+  shm_unlink(stats_name);
+  std::signal(signal, SIG_DFL);
+  std::raise(signal);
+}
+
+void
+remove_stats_segment_on_signals(std::string const& name) {
+  name.copy(stats_name, sizeof(stats_name) - 1);
+  std::signal(SIGINT, remove_stats_segment);
+  std::signal(SIGTERM, remove_stats_segment);
+}
+
+}  // namespace
+
 int
 main(int argc, char const** argv) {
   if (argc < 2) {
@@ -23,31 +80,173 @@ main(int argc, char const** argv) {
     return 1;
   }
 
+  if (auto cores_env = getenv("CORES"); cores_env != nullptr) {
+    if (auto cores = std::strtoul(cores_env, nullptr, 10); cores > 1) {
+      emulator::machine smp{static_cast<unsigned>(cores)};
+      std::vector<emulator::cpu*> targets;
+      for (unsigned i = 0; i < smp.core_count(); i++)
+        targets.push_back(&smp.core(i));
+      watch_flight_recorders(std::move(targets));
+      load_program(argv[1], smp.core(0));
+      try {
+        smp.run();
+      } catch (emulator::guest_fault const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+      }
+      return 0;
+    }
+  }
+
   emulator::cpu proc;
+  proc.metaout = emulator::metaout;
+  watch_flight_recorders({&proc});
 
   auto debugging_env = getenv("DEBUGGING");
   if (debugging_env != nullptr && !std::strcmp(debugging_env, "true")) {
-    emulator::cpu::debugging = true;
+    proc.debugging = true;
+  }
+
+  std::optional<emulator::input_log> inputs;
+  if (auto record_env = getenv("RECORD_INPUTS"); record_env != nullptr) {
+    inputs.emplace(emulator::input_log::record_to(record_env));
+  } else if (auto replay_env = getenv("REPLAY_INPUTS"); replay_env != nullptr) {
+    inputs.emplace(emulator::input_log::replay_from(replay_env));
   }
+  if (inputs)
+    proc.attach_input_log(&*inputs);
 
+  // the trace takes the place of the text log, which is far slower
+  std::optional<emulator::trace_writer> trace;
+  if (auto trace_env = getenv("TRACE"); trace_env != nullptr) {
+    trace.emplace(trace_env);
+    proc.attach_trace(&*trace);
+    emulator::metaout = emulator::printer::nullprinter;
+    proc.metaout = emulator::printer::nullprinter;
+  }
+
+  std::optional<emulator::time_machine> travel;
+  auto snapshot_env = getenv("SNAPSHOT_INTERVAL");
+  if (snapshot_env != nullptr) {
+    travel.emplace(proc, std::strtoull(snapshot_env, nullptr, 10));
+  } else if (proc.debugging) {
+    travel.emplace(proc);
+  }
+  if (travel)
+    proc.attach_time_machine(&*travel);
+
+  if (auto costs_env = getenv("CPU_COSTS"); costs_env != nullptr) {
+    auto costs = emulator::cost_table::defaults();
+    costs.load(costs_env);
+    proc.set_costs(costs);
+  }
+  if (auto mhz_env = getenv("CPU_MHZ"); mhz_env != nullptr)
+    proc.set_frequency(std::strtod(mhz_env, nullptr));
+
+  std::optional<emulator::cluster> node;
+  if (auto cluster_env = getenv("CLUSTER"); cluster_env != nullptr) {
+    auto id_env = getenv("NODE_ID");
+    auto count_env = getenv("NODE_COUNT");
+    if (id_env == nullptr || count_env == nullptr) {
+      std::cerr << "CLUSTER needs NODE_ID and NODE_COUNT" << std::endl;
+      return 1;
+    }
+    node.emplace(cluster_env, std::strtoul(id_env, nullptr, 10),
+                 std::strtoul(count_env, nullptr, 10));
+    proc.attach_cluster(*node);
+  }
+
+  std::optional<emulator::sampling_profiler> profiler;
+  auto profile_env = getenv("PROFILE");
+  if (profile_env != nullptr) {
+    // like a trace, a profile would only measure the text log
+    emulator::metaout = emulator::printer::nullprinter;
+    proc.metaout = emulator::printer::nullprinter;
+    auto hz_env = getenv("PROFILE_HZ");
+    profiler.emplace(emulator::load_map::of_program(argv[1]),
+                     hz_env ? std::strtod(hz_env, nullptr)
+                            : emulator::sampling_profiler::default_hz);
+    profiler->watch(proc);
+    profiler->start();
+  }
+
+  std::optional<emulator::memory_profile> heat;
+  auto heat_report_env = getenv("MEMORY_PROFILE");
+  auto heatmap_env = getenv("MEMORY_HEATMAP");
+  if (heat_report_env != nullptr || heatmap_env != nullptr) {
+    auto window_env = getenv("WORKING_SET_WINDOW");
+    heat.emplace(window_env != nullptr
+                     ? std::strtoull(window_env, nullptr, 10)
+                     : emulator::memory_profile::default_window);
+    proc.attach_memory_profile(&*heat);
+  }
+
+  // live counters for emustat, unless STATS=off
+  std::optional<emulator::counting_console> counted_io;
+  std::optional<emulator::stats_segment> stats;
+  std::optional<emulator::stats_publisher> publisher;
+  auto stats_env = getenv("STATS");
+  if (stats_env == nullptr || std::strcmp(stats_env, "off") != 0) {
+    try {
+      stats.emplace(emulator::stats_segment::create(
+          stats_env != nullptr
+              ? stats_env
+              : emulator::stats_segment::default_name(getpid()),
+          argv[1]));
+      remove_stats_segment_on_signals(stats->name());
+      counted_io.emplace(emulator::standard_console());
+      proc.attach_console(*counted_io);
+      publisher.emplace(*stats, proc, &*counted_io);
+      publisher->start();
+    } catch (std::runtime_error const& e) {
+      std::cerr << "Not publishing stats: " << e.what() << std::endl;
+    }
+  }
+
+  // a fault stops the guest, but its trace, profiles and stats are still
+  // written out
+  int status = 0;
   std::string name = argv[1];
-  auto ext = string_section(name, name.size() - 5, name.size());
-  if (ext == ".prog") {
-    emulator::metaout << "Running .prog file" << emulator::endl;
-    run_program_file(name, proc);
-  } else if (ext == "a.out") {
-    emulator::metaout << "Running assembler output" << emulator::endl;
-    auto data = load_binary_file(static_cast<std::string>(name));
-    proc.set_memory(data.data(), data.size(), 0x0000);
-    proc.run();
-  } else if (ext == ".spec") {
-    emulator::metaout << "Running .spec container" << emulator::endl;
-    run_program_spec(name, proc);
-  } else {
-    emulator::metaout << "Unknown file type: " << ext
-                      << " specify an a.out file a *.spec or a *.prog file"
-                      << emulator::endl;
-    std::terminate();
+  try {
+    auto ext = string_section(name, name.size() - 5, name.size());
+    if (ext == ".prog") {
+      emulator::metaout << "Running .prog file" << emulator::endl;
+      run_program_file(name, proc);
+    } else if (ext == "a.out") {
+      emulator::metaout << "Running assembler output" << emulator::endl;
+      auto data = load_binary_file(static_cast<std::string>(name));
+      proc.set_memory(data.data(), data.size(), 0x0000);
+      proc.run();
+    } else if (ext == ".spec") {
+      emulator::metaout << "Running .spec container" << emulator::endl;
+      run_program_spec(name, proc);
+    } else {
+      emulator::metaout << "Unknown file type: " << ext
+                        << " specify an a.out file a *.spec or a *.prog file"
+                        << emulator::endl;
+      std::terminate();
+    }
+  } catch (emulator::guest_fault const& e) {
+    std::cerr << e.what() << std::endl;
+    status = 1;
+  }
+
+  if (publisher)
+    publisher->publish();
+  if (heat_report_env != nullptr) {
+    auto map = emulator::load_map::of_program(argv[1]);
+    std::ofstream f{heat_report_env};
+    heat->write_report(f, &map);
+  }
+  if (heatmap_env != nullptr) {
+    std::ofstream f{heatmap_env};
+    heat->write_csv(f);
+  }
+  if (profiler) {
+    profiler->stop();
+    std::ofstream f{profile_env};
+    profiler->write_folded(f);
   }
   // run_program_file("jamaica.prog", proc);
+  return status;
 }
@@ -0,0 +1,161 @@
+#include "memory_profile.hpp"
+
+#include <cstdio>
+#include <string>
+
+#include "profiler.hpp"
+
+namespace emulator {
+
+namespace {
+
+// A line of at most 160 characters, printf style
+template <typename... Args>
+std::string
+line(char const* format, Args... args) {
+  char buffer[160];
+  std::snprintf(buffer, sizeof(buffer), format, args...);
+  return buffer;
+}
+
+unsigned long long
+ull(u64 n) {
+  return static_cast<unsigned long long>(n);
+}
+
+}  // namespace
+
+memory_profile::memory_profile(u64 window)
+    : window(std::max<u64>(window, 1)) {}
+
+memory_profile::block_counts const&
+memory_profile::block(u32 index) const noexcept {
+  return counts[index % block_count];
+}
+
+std::vector<memory_profile::window_sample>
+memory_profile::windows() const {
+  auto all = closed;
+  if (instructions % window != 0)
+    all.push_back({instructions - instructions % window, window_blocks,
+                   window_pages});
+  return all;
+}
+
+std::pair<u32, u32>
+memory_profile::sp_range() const noexcept {
+  if (instructions == 0)
+    return {0, 0};
+  return {lowest_sp, highest_sp};
+}
+
+u64
+memory_profile::instruction_count() const noexcept {
+  return instructions;
+}
+
+void
+memory_profile::close_window() {
+  closed.push_back({instructions - window, window_blocks, window_pages});
+  current++;
+  window_blocks = 0;
+  window_pages = 0;
+}
+
+void
+memory_profile::write_report(std::ostream& os, load_map const* map) const {
+  block_counts total;
+  std::array<block_counts, page_count> pages{};
+  u32 blocks_used = 0;
+  for (u32 b = 0; b < block_count; b++) {
+    auto const& c = counts[b];
+    auto& page = pages[b * block_size / page_size];
+    page.fetches += c.fetches;
+    page.reads += c.reads;
+    page.writes += c.writes;
+    total.fetches += c.fetches;
+    total.reads += c.reads;
+    total.writes += c.writes;
+    blocks_used += c.fetches + c.reads + c.writes > 0;
+  }
+  std::vector<u32> used_pages;
+  for (u32 p = 0; p < page_count; p++)
+    if (pages[p].fetches + pages[p].reads + pages[p].writes > 0)
+      used_pages.push_back(p);
+
+  os << line("Memory profile of %llu instructions\n", ull(instructions));
+  os << line("  %llu fetches, %llu reads, %llu writes\n", ull(total.fetches),
+             ull(total.reads), ull(total.writes));
+  os << line("  %zu of %u pages used (%zu bytes), %u of %u blocks (%u "
+             "bytes)\n",
+             used_pages.size(), page_count, used_pages.size() * page_size,
+             blocks_used, block_count, blocks_used * block_size);
+
+  auto samples = windows();
+  if (!samples.empty()) {
+    auto sizes = [&](auto field) {
+      std::vector<u32> v;
+      for (auto const& s : samples)
+        v.push_back(s.*field);
+      std::sort(v.begin(), v.end());
+      return std::array<u32, 3>{v.front(), v[v.size() / 2], v.back()};
+    };
+    auto blocks = sizes(&window_sample::blocks);
+    auto pages_touched = sizes(&window_sample::pages);
+    os << line("Working set over %zu windows of %llu instructions\n",
+               samples.size(), ull(window));
+    os << line("  %-8s %10s %10s %10s\n", "", "min", "median", "max");
+    os << line("  %-8s %10u %10u %10u\n", "pages", pages_touched[0],
+               pages_touched[1], pages_touched[2]);
+    os << line("  %-8s %10u %10u %10u\n", "blocks", blocks[0], blocks[1],
+               blocks[2]);
+    os << line("  %-8s %10u %10u %10u\n", "bytes", blocks[0] * block_size,
+               blocks[1] * block_size, blocks[2] * block_size);
+  }
+
+  auto [low, high] = sp_range();
+  os << line("Stack: sp between 0x%04x and 0x%04x, high-water mark %u bytes "
+             "above its lowest\n",
+             low, high, high - low);
+
+  // the hottest pages first
+  std::sort(used_pages.begin(), used_pages.end(), [&](u32 l, u32 r) {
+    auto sum = [](block_counts const& c) {
+      return c.fetches + c.reads + c.writes;
+    };
+    return sum(pages[l]) > sum(pages[r]);
+  });
+  used_pages.resize(std::min<std::size_t>(used_pages.size(), 16));
+  os << line("Hottest pages\n  %-8s %-20s %12s %12s %12s\n", "page",
+             "segment", "fetches", "reads", "writes");
+  for (u32 p : used_pages) {
+    std::string segment = "-";
+    if (map != nullptr) {
+      auto overlaps = [p](load_map::segment const& s) {
+        return s.start < (p + 1) * page_size && p * page_size < s.end;
+      };
+      auto it = std::find_if(map->segments.begin(), map->segments.end(),
+                             overlaps);
+      if (it != map->segments.end())
+        segment = it->name;
+    }
+    os << line("  0x%04x   %-20s %12llu %12llu %12llu\n", p * page_size,
+               segment.c_str(), ull(pages[p].fetches), ull(pages[p].reads),
+               ull(pages[p].writes));
+  }
+}
+
+void
+memory_profile::write_csv(std::ostream& os) const {
+  os << "address,page,fetches,reads,writes\n";
+  for (u32 b = 0; b < block_count; b++) {
+    auto const& c = counts[b];
+    if (c.fetches + c.reads + c.writes == 0)
+      continue;
+    u32 address = b * block_size;
+    os << address << "," << address / page_size * page_size << ","
+       << c.fetches << "," << c.reads << "," << c.writes << "\n";
+  }
+}
+
+}  // namespace emulator
@@ -0,0 +1,122 @@
+#include "perf_baseline.hpp"
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <stdexcept>
+
+namespace emulator {
+
+namespace {
+
+struct parser {
+  std::string const& text;
+  std::string const& filename;
+  std::size_t at = 0;
+
+  [[noreturn]] void
+  fail() const {
+    throw std::runtime_error("Malformed baseline " + filename + " at byte " +
+                             std::to_string(at));
+  }
+
+  char
+  next() {
+    while (at < text.size() &&
+           std::isspace(static_cast<unsigned char>(text[at])))
+      at++;
+    if (at == text.size())
+      fail();
+    return text[at];
+  }
+
+  void
+  expect(char c) {
+    if (next() != c)
+      fail();
+    at++;
+  }
+
+  std::string
+  string() {
+    expect('"');
+    std::string s;
+    while (at < text.size() && text[at] != '"') {
+      if (text[at] == '\\' && at + 1 < text.size())
+        at++;
+      s += text[at++];
+    }
+    expect('"');
+    return s;
+  }
+
+  double
+  number() {
+    next();
+    char const* start = text.c_str() + at;
+    char* end;
+    double value = std::strtod(start, &end);
+    if (end == start)
+      fail();
+    at += end - start;
+    return value;
+  }
+};
+
+}  // namespace
+
+perf_baseline
+perf_baseline::read(std::string const& filename) {
+  perf_baseline baseline;
+  std::ifstream f{filename};
+  if (!f)
+    return baseline;
+  std::string text{std::istreambuf_iterator<char>(f),
+                   std::istreambuf_iterator<char>()};
+
+  parser p{text, filename};
+  p.expect('{');
+  if (p.next() == '}')
+    return baseline;
+  while (true) {
+    auto name = p.string();
+    p.expect(':');
+    baseline.values[name] = p.number();
+    if (p.next() == '}')
+      break;
+    p.expect(',');
+  }
+  return baseline;
+}
+
+void
+perf_baseline::write(std::string const& filename) const {
+  std::ofstream f{filename};
+  if (!f)
+    throw std::runtime_error("Failed to write baseline " + filename);
+  f << "{";
+  char const* separator = "\n";
+  for (auto const& [name, value] : values) {
+    f << separator << "  \"";
+    for (char c : name) {
+      if (c == '"' || c == '\\')
+        f << '\\';
+      f << c;
+    }
+    f << "\": " << std::setprecision(6) << value;
+    separator = ",\n";
+  }
+  f << "\n}\n";
+}
+
+std::optional<double>
+perf_baseline::find(std::string const& name) const {
+  auto it = values.find(name);
+  if (it == values.end())
+    return std::nullopt;
+  return it->second;
+}
+
+}  // namespace emulator
@@ -0,0 +1,156 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <sstream>
+
+#include "utils.hpp"
+
+namespace emulator {
+
+namespace {
+
+// marks a stack deeper than guest_position keeps
+constexpr u32 truncated = ~0u;
+
+std::string
+hex(u32 value) {
+  std::stringstream ss;
+  ss << std::hex << std::showbase << value;
+  return ss.str();
+}
+
+}  // namespace
+
+load_map
+load_map::of_program(std::string const& name) {
+  namespace fs = std::filesystem;
+  load_map map;
+  auto add = [&map](std::string const& file, u64 start) {
+    auto size = fs::file_size(file);
+    map.segments.push_back({static_cast<u32>(start),
+                            static_cast<u32>(start + size),
+                            fs::path{file}.filename().string()});
+  };
+  if (name.ends_with(".spec")) {
+    for (auto const& [file, addr] : parse_program_spec(name)) {
+      if (file.starts_with("disk:") || file == "dma" || file == "timer")
+        continue;
+      add(file, addr);
+    }
+  } else if (name.ends_with(".prog")) {
+    add(name, 0x3000);
+    map.segments.push_back({0xF000, 0xF004, "bootstrap"});
+  }
+  std::sort(map.segments.begin(), map.segments.end(),
+            [](auto const& l, auto const& r) { return l.start < r.start; });
+  return map;
+}
+
+load_map::segment const*
+load_map::find(u32 addr) const {
+  auto it = std::upper_bound(
+      segments.begin(), segments.end(), addr,
+      [](u32 a, segment const& s) { return a < s.start; });
+  if (it == segments.begin() || addr >= std::prev(it)->end)
+    return nullptr;
+  return &*std::prev(it);
+}
+
+std::string
+load_map::label(u32 addr) const {
+  auto s = find(addr);
+  if (s == nullptr)
+    return hex(addr);
+  return addr == s->start ? s->name : s->name + "+" + hex(addr - s->start);
+}
+
+std::string
+load_map::segment_of(u32 addr) const {
+  auto s = find(addr);
+  return s == nullptr ? hex(addr) : s->name;
+}
+
+sampling_profiler::sampling_profiler(load_map map, double hz)
+    : map(std::move(map)),
+      period(static_cast<long long>(1e9 / std::max(hz, 1.0))) {}
+
+sampling_profiler::~sampling_profiler() {
+  stop();
+}
+
+void
+sampling_profiler::watch(cpu const& proc) {
+  cpus.push_back(&proc);
+}
+
+void
+sampling_profiler::start() {
+  if (running.exchange(true))
+    return;
+  sampler = std::thread{[this] {
+    auto next = std::chrono::steady_clock::now();
+    while (running.load(std::memory_order_relaxed)) {
+      next += period;
+      std::this_thread::sleep_until(next);
+      for (std::size_t i = 0; i < cpus.size(); i++)
+        sample(i, cpus[i]->position());
+    }
+  }};
+}
+
+void
+sampling_profiler::stop() {
+  running = false;
+  if (sampler.joinable())
+    sampler.join();
+}
+
+void
+sampling_profiler::sample(std::size_t index, guest_position const& position) {
+  u32 depth = position.depth.load(std::memory_order_acquire);
+  u32 kept = std::min(depth, guest_position::max_depth);
+  std::vector<u32> stack;
+  stack.reserve(kept + 3);
+  stack.push_back(static_cast<u32>(index));
+  // the outermost code is the caller of the first call that is still open
+  stack.push_back(kept == 0
+                      ? position.pc.load(std::memory_order_relaxed)
+                      : position.returns[0].load(std::memory_order_relaxed) -
+                            4);
+  for (u32 i = 0; i < kept; i++)
+    stack.push_back(position.targets[i].load(std::memory_order_relaxed));
+  if (depth > kept)
+    stack.push_back(truncated);
+
+  std::lock_guard lock{mutex};
+  stacks[stack]++;
+  total++;
+}
+
+u64
+sampling_profiler::samples() const {
+  std::lock_guard lock{mutex};
+  return total;
+}
+
+void
+sampling_profiler::write_folded(std::ostream& os) const {
+  std::map<std::string, u64> folded;
+  {
+    std::lock_guard lock{mutex};
+    for (auto const& [stack, count] : stacks) {
+      std::string line;
+      if (cpus.size() > 1)
+        line = "core" + std::to_string(stack[0]) + ";";
+      line += map.segment_of(stack[1]);
+      for (std::size_t i = 2; i < stack.size(); i++)
+        line += ";" + (stack[i] == truncated ? "..." : map.label(stack[i]));
+      folded[line] += count;
+    }
+  }
+  for (auto const& [line, count] : folded)
+    os << line << " " << count << "\n";
+}
+
+}  // namespace emulator
@@ -0,0 +1,29 @@
+#include "sample_stats.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace emulator {
+
+sample_stats
+sample_stats::of(std::span<double const> samples) {
+  sample_stats s;
+  s.count = samples.size();
+  if (samples.empty())
+    return s;
+  for (double v : samples)
+    s.mean += v;
+  s.mean /= static_cast<double>(s.count);
+  if (s.count > 1) {
+    double squares = 0;
+    for (double v : samples)
+      squares += (v - s.mean) * (v - s.mean);
+    s.stddev = std::sqrt(squares / static_cast<double>(s.count - 1));
+  }
+  auto [lo, hi] = std::minmax_element(samples.begin(), samples.end());
+  s.min = *lo;
+  s.max = *hi;
+  return s;
+}
+
+}  // namespace emulator
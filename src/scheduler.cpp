@@ -0,0 +1,105 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <thread>
+
+namespace emulator {
+
+scheduler::scheduler(unsigned threads)
+    : threads(threads == 0 ? std::max(1u, std::thread::hardware_concurrency())
+                           : threads) {}
+
+void
+scheduler::spawn(cpu& guest, u64 quantum) {
+  entries.push_back({&guest, guest.run_task(quantum)});
+}
+
+void
+scheduler::wake() {
+  {
+    std::lock_guard guard{lock};
+    woken = true;
+  }
+  changed.notify_all();
+}
+
+void
+scheduler::run() {
+  {
+    std::lock_guard guard{lock};
+    ready.clear();
+    parked.clear();
+    error = nullptr;
+    unfinished = 0;
+    for (std::size_t i = 0; i < entries.size(); i++) {
+      if (!entries[i].task.done()) {
+        ready.push_back(i);
+        unfinished++;
+      }
+    }
+  }
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < threads; i++)
+    workers.emplace_back(&scheduler::work, this);
+  for (auto& w : workers)
+    w.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+void
+scheduler::work() {
+  std::unique_lock guard{lock};
+  while (unfinished > 0) {
+    if (woken) {
+      woken = false;
+      auto unblocked = std::stable_partition(
+          parked.begin(), parked.end(),
+          [this](std::size_t id) { return !entries[id].guest->input_ready(); });
+      ready.insert(ready.begin(), unblocked, parked.end());
+      parked.erase(unblocked, parked.end());
+    }
+    if (ready.empty()) {
+      changed.wait(guard);
+      continue;
+    }
+
+    std::size_t id = ready.front();
+    ready.pop_front();
+    guard.unlock();
+    task_state state;
+    try {
+      state = entries[id].task.resume();
+    } catch (...) {
+      state = task_state::halted;
+      guard.lock();
+      if (!error)
+        error = std::current_exception();
+      guard.unlock();
+    }
+    guard.lock();
+
+    switch (state) {
+      case task_state::ready:
+        ready.push_back(id);
+        changed.notify_one();
+        break;
+      case task_state::blocked:
+        // input fed before this guest was parked woke nobody, so look once
+        // more now that a later wake() is sure to see it
+        if (entries[id].guest->input_ready()) {
+          ready.push_back(id);
+          changed.notify_one();
+        } else {
+          parked.push_back(id);
+        }
+        break;
+      case task_state::halted:
+        unfinished--;
+        break;
+    }
+  }
+  changed.notify_all();
+}
+
+}  // namespace emulator
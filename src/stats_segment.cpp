@@ -0,0 +1,224 @@
+#include "stats_segment.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "console.hpp"
+#include "cpu.hpp"
+
+namespace emulator {
+
+namespace {
+
+std::runtime_error
+system_error(std::string const& what, std::string const& segment) {
+  return std::runtime_error(what + " " + segment + ": " +
+                            std::strerror(errno));
+}
+
+}  // namespace
+
+stats_segment
+stats_segment::create(std::string const& name, std::string const& program) {
+  // a segment left behind by a crashed process of the same pid is replaced
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    throw system_error("shm_open", name);
+  if (ftruncate(fd, sizeof(layout)) != 0) {
+    close(fd);
+    shm_unlink(name.c_str());
+    throw system_error("ftruncate", name);
+  }
+  void* mapped = mmap(nullptr, sizeof(layout), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    throw system_error("mmap", name);
+  }
+
+  // the segment starts zero filled, which is a valid sequence and counters
+  auto* shared = static_cast<layout*>(mapped);
+  shared->version = version;
+  shared->pid = static_cast<u64>(getpid());
+  program.copy(shared->program, sizeof(shared->program) - 1);
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(shared->magic, magic, sizeof(magic));
+  return {name, shared, true};
+}
+
+stats_segment
+stats_segment::open(std::string const& name) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    throw system_error("shm_open", name);
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      static_cast<std::size_t>(info.st_size) < sizeof(layout)) {
+    close(fd);
+    throw std::runtime_error(name + " is not an emulator stats segment");
+  }
+  void* mapped =
+      mmap(nullptr, sizeof(layout), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    throw system_error("mmap", name);
+
+  auto* shared = static_cast<layout*>(mapped);
+  if (std::memcmp(shared->magic, magic, sizeof(magic)) != 0 ||
+      shared->version != version) {
+    munmap(mapped, sizeof(layout));
+    throw std::runtime_error(name + " is not a version " +
+                             std::to_string(version) + " stats segment");
+  }
+  return {name, shared, false};
+}
+
+std::string
+stats_segment::default_name(u64 pid) {
+  return name_prefix + std::to_string(pid);
+}
+
+void
+stats_segment::remove(std::string const& name) noexcept {
+  shm_unlink(name.c_str());
+}
+
+std::vector<std::string>
+stats_segment::list() {
+  std::vector<std::string> names;
+  std::string prefix = name_prefix + 1;
+  std::error_code ignored;
+  for (auto const& entry :
+       std::filesystem::directory_iterator("/dev/shm", ignored)) {
+    auto file = entry.path().filename().string();
+    if (file.starts_with(prefix))
+      names.push_back("/" + file);
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+stats_segment::stats_segment(std::string name, layout* shared, bool owner)
+    : segment(std::move(name)), shared(shared), owner(owner) {}
+
+stats_segment::stats_segment(stats_segment&& other) noexcept
+    : segment(std::move(other.segment)),
+      shared(std::exchange(other.shared, nullptr)),
+      owner(other.owner) {}
+
+stats_segment::~stats_segment() {
+  if (shared == nullptr)
+    return;
+  munmap(shared, sizeof(layout));
+  if (owner)
+    shm_unlink(segment.c_str());
+}
+
+std::string const&
+stats_segment::name() const noexcept {
+  return segment;
+}
+
+u64
+stats_segment::pid() const noexcept {
+  return shared->pid;
+}
+
+std::string
+stats_segment::program() const {
+  return {shared->program,
+          strnlen(shared->program, sizeof(shared->program))};
+}
+
+void
+stats_segment::publish(stats_snapshot const& snapshot) noexcept {
+  auto values = std::bit_cast<std::array<u64, field_count>>(snapshot);
+  u64 sequence = shared->sequence.load(std::memory_order_relaxed);
+  shared->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (std::size_t i = 0; i < field_count; i++)
+    shared->fields[i].store(values[i], std::memory_order_relaxed);
+  shared->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+std::optional<stats_snapshot>
+stats_segment::read() const noexcept {
+  std::array<u64, field_count> values;
+  for (int attempt = 0; attempt < read_attempts; attempt++) {
+    if (attempt > 0)
+      std::this_thread::yield();
+    u64 before = shared->sequence.load(std::memory_order_acquire);
+    if (before % 2 != 0)
+      continue;
+    for (std::size_t i = 0; i < field_count; i++)
+      values[i] = shared->fields[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (shared->sequence.load(std::memory_order_relaxed) == before)
+      return std::bit_cast<stats_snapshot>(values);
+  }
+  return std::nullopt;
+}
+
+stats_publisher::stats_publisher(stats_segment& segment,
+                                 cpu& proc,
+                                 counting_console const* io)
+    : segment(segment),
+      proc(proc),
+      io(io),
+      last_publish(std::chrono::steady_clock::now()) {}
+
+void
+stats_publisher::start() {
+  publish();
+  proc.schedule(proc.clock_cycles() + check_interval, [this] { check(); });
+}
+
+void
+stats_publisher::check() {
+  if (std::chrono::steady_clock::now() - last_publish >= publish_period)
+    publish();
+  proc.schedule(proc.clock_cycles() + check_interval, [this] { check(); });
+}
+
+void
+stats_publisher::publish() {
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - last_publish;
+  stats_snapshot s;
+  s.cycles = proc.cycles();
+  s.clock_cycles = proc.clock_cycles();
+  s.instructions = proc.instructions();
+  if (elapsed.count() > 0)
+    s.instructions_per_second =
+        static_cast<double>(s.instructions - last_instructions) /
+        elapsed.count();
+  s.allocated_pages = proc.get_ram().allocated_pages();
+  if (io != nullptr) {
+    s.io_bytes_in = io->bytes_in();
+    s.io_bytes_out = io->bytes_out();
+  }
+  s.faults = proc.faults();
+  s.pc = proc.position().pc.load(std::memory_order_relaxed);
+  s.halted = proc.is_halted();
+  s.published_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       now.time_since_epoch())
+                       .count();
+  segment.publish(s);
+  last_instructions = s.instructions;
+  last_publish = now;
+}
+
+}  // namespace emulator
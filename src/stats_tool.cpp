@@ -0,0 +1,136 @@
+#include <signal.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bytedefs.hpp"
+#include "stats_segment.hpp"
+
+// Live view of the emulators publishing stats segments on this host.
+//
+//   emustat [--once] [--interval MS] [PID | SEGMENT]...
+//
+// Shows one line per emulator, every /dev/shm/emustat-* segment unless
+// processes or segments are named, and refreshes it every --interval
+// milliseconds (1000 by default) until interrupted. --once prints the table
+// one time without clearing the screen. The segment of an emulator that is
+// gone, e.g. because it was killed, is shown once and then removed.
+
+namespace {
+
+using emulator::stats_segment;
+using emulator::u64;
+
+void
+usage() {
+  std::cerr << "usage: emustat [--once] [--interval MS] [PID | SEGMENT]..."
+            << std::endl;
+}
+
+std::string
+segment_name(std::string const& arg) {
+  if (!arg.empty() &&
+      arg.find_first_not_of("0123456789") == std::string::npos)
+    return stats_segment::default_name(std::stoull(arg));
+  return arg.starts_with("/") ? arg : "/" + arg;
+}
+
+constexpr char const* gone = "gone";
+
+bool
+alive(stats_segment const& segment) {
+  return kill(static_cast<pid_t>(segment.pid()), 0) == 0 || errno != ESRCH;
+}
+
+void
+show(std::vector<std::string> const& names) {
+  auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now().time_since_epoch())
+                 .count();
+  std::printf("%-8s %-24s %-8s %14s %9s %6s %10s %10s %7s %-6s %7s\n", "pid",
+              "program", "state", "cycles", "MIPS", "pages", "in", "out",
+              "faults", "pc", "age");
+  for (auto const& name : names) {
+    try {
+      auto segment = stats_segment::open(name);
+      auto program = segment.program();
+      if (program.size() > 24)
+        program = "..." + program.substr(program.size() - 21);
+      // look at the process first: one that died in the middle of an update
+      // leaves a snapshot that can never be read
+      bool running = alive(segment);
+      auto s = segment.read();
+      char const* shown = gone;
+      if (running && !s)
+        shown = "updating";
+      else if (running)
+        shown = s->halted ? "halted" : "running";
+      if (!s) {
+        std::printf("%-8llu %-24s %-8s\n",
+                    static_cast<unsigned long long>(segment.pid()),
+                    program.c_str(), shown);
+      } else {
+        double age =
+            static_cast<double>(static_cast<u64>(now) - s->published_ns) /
+            1e9;
+        std::printf(
+            "%-8llu %-24s %-8s %14llu %9.2f %6llu %10llu %10llu %7llu "
+            "0x%04llx %6.1fs\n",
+            static_cast<unsigned long long>(segment.pid()), program.c_str(),
+            shown, static_cast<unsigned long long>(s->cycles),
+            s->instructions_per_second / 1e6,
+            static_cast<unsigned long long>(s->allocated_pages),
+            static_cast<unsigned long long>(s->io_bytes_in),
+            static_cast<unsigned long long>(s->io_bytes_out),
+            static_cast<unsigned long long>(s->faults),
+            static_cast<unsigned long long>(s->pc), age);
+      }
+      if (!running)
+        stats_segment::remove(name);
+    } catch (std::exception const& e) {
+      // the emulator may have exited since the segments were listed
+      std::printf("%s\n", e.what());
+    }
+  }
+  std::fflush(stdout);
+}
+
+}  // namespace
+
+int
+main(int argc, char const** argv) {
+  bool once = false;
+  unsigned long interval = 1000;
+  std::vector<std::string> named;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--once") {
+      once = true;
+    } else if (arg == "--interval" && has_value) {
+      interval = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    } else if (!arg.starts_with("--")) {
+      named.push_back(segment_name(arg));
+    } else {
+      usage();
+      return 2;
+    }
+  }
+
+  while (true) {
+    auto names = named.empty() ? stats_segment::list() : named;
+    if (!once)
+      std::printf("\x1b[H\x1b[2J");
+    show(names);
+    if (once)
+      return names.empty() ? 1 : 0;
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+  }
+}
@@ -0,0 +1,99 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+namespace emulator {
+
+thread_pool::thread_pool(unsigned threads) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned i = 0; i < threads; i++)
+    queues.push_back(std::make_unique<worker_queue>());
+  for (unsigned i = 0; i < threads; i++)
+    workers.emplace_back(&thread_pool::work, this, i);
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::lock_guard guard{state_lock};
+    stopping = true;
+  }
+  work_available.notify_all();
+  for (auto& w : workers)
+    w.join();
+}
+
+void
+thread_pool::submit(task t) {
+  auto& q = *queues[next_queue++ % queues.size()];
+  {
+    std::lock_guard guard{q.lock};
+    q.tasks.push_back(std::move(t));
+  }
+  {
+    std::lock_guard guard{state_lock};
+    queued++;
+    unfinished++;
+  }
+  work_available.notify_one();
+}
+
+void
+thread_pool::wait_idle() {
+  std::unique_lock guard{state_lock};
+  all_done.wait(guard, [this] { return unfinished == 0; });
+}
+
+unsigned
+thread_pool::size() const noexcept {
+  return static_cast<unsigned>(workers.size());
+}
+
+bool
+thread_pool::try_take(unsigned self, task& out) {
+  {
+    auto& own = *queues[self];
+    std::lock_guard guard{own.lock};
+    if (!own.tasks.empty()) {
+      out = std::move(own.tasks.front());
+      own.tasks.pop_front();
+      return true;
+    }
+  }
+  for (std::size_t i = 1; i < queues.size(); i++) {
+    auto& victim = *queues[(self + i) % queues.size()];
+    std::lock_guard guard{victim.lock};
+    if (!victim.tasks.empty()) {
+      out = std::move(victim.tasks.back());
+      victim.tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+thread_pool::work(unsigned self) {
+  while (true) {
+    {
+      std::unique_lock guard{state_lock};
+      work_available.wait(guard, [this] { return queued > 0 || stopping; });
+      if (queued == 0 && stopping)
+        return;
+      // claim a task before looking for it so two workers never chase the
+      // same one
+      queued--;
+    }
+    task t;
+    while (!try_take(self, t))
+      std::this_thread::yield();
+    t();
+    {
+      std::lock_guard guard{state_lock};
+      if (--unfinished == 0)
+        all_done.notify_all();
+    }
+  }
+}
+
+}  // namespace emulator
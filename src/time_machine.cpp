@@ -0,0 +1,225 @@
+#include "time_machine.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include "printer.hpp"
+
+namespace emulator {
+
+time_machine::time_machine(cpu& target, u64 interval, std::size_t capacity)
+    : target(target),
+      interval(std::max<u64>(interval, 1)),
+      capacity(std::max<std::size_t>(capacity, 2)) {}
+
+u64
+time_machine::next_snapshot_cycle() const noexcept {
+  return next_snapshot;
+}
+
+std::size_t
+time_machine::snapshot_count() const noexcept {
+  return snapshots.size();
+}
+
+void
+time_machine::take_snapshot() {
+  u64 now = target.m_cycles;
+  next_snapshot = now + interval;
+  if (!snapshots.empty() && snapshots.back().cycle >= now)
+    return;
+  if (snapshots.size() == capacity)
+    thin_snapshots();
+  // devices first: saving one may wait for it to finish writing ram
+  std::vector<std::any> devices;
+  for (auto& device : target.devices)
+    devices.push_back(device->save_state());
+  snapshots.push_back({now, target.m_clock_cycles, target.halted, target.a,
+                       target.b, target.x, target.fa, target.fb, target.fx,
+                       target.sp, target.ra, target.pc, target.ctrl,
+                       target.fault, target.counted, target.random,
+                       target.events, target.next_event.load(),
+                       target.pending_interrupts.load(), std::move(devices),
+                       target.ram});
+}
+
+bool
+time_machine::replaying(u64 cycle) const noexcept {
+  return cycle <= high_water;
+}
+
+void
+time_machine::remember_input(input_kind kind, u64 cycle, u32 value) {
+  history.push_back({cycle, kind, value});
+  if (history.size() > history_limit)
+    prune_history();
+}
+
+u32
+time_machine::replay_input(input_kind kind, u64 cycle, std::size_t nth) {
+  auto it = std::lower_bound(
+      history.begin(), history.end(), cycle,
+      [](remembered_input const& in, u64 c) { return in.cycle < c; });
+  auto later = static_cast<std::size_t>(history.end() - it);
+  it += static_cast<std::ptrdiff_t>(std::min(nth, later));
+  if (it == history.end() || it->cycle != cycle || it->kind != kind) {
+    std::stringstream msg;
+    msg << "Re-execution diverged: no remembered input at cycle " << cycle;
+    throw std::runtime_error(msg.str());
+  }
+  return it->value;
+}
+
+bool
+time_machine::seek(u64 cycle) {
+  high_water = std::max(high_water, target.m_cycles);
+  if (snapshots.empty() || cycle < snapshots.front().cycle ||
+      cycle > high_water)
+    return false;
+  auto nearest = std::prev(
+      std::upper_bound(snapshots.begin(), snapshots.end(), cycle,
+                       [](u64 c, snapshot const& s) { return c < s.cycle; }));
+  // Going forward from the current state is cheaper unless a snapshot is
+  // closer to the target
+  if (cycle < target.m_cycles || target.m_cycles < nearest->cycle)
+    restore(*nearest);
+  run_until(cycle);
+  return true;
+}
+
+bool
+time_machine::step_back() {
+  if (target.m_cycles == 0)
+    return false;
+  return seek(target.m_cycles - 1);
+}
+
+std::optional<u64>
+time_machine::reverse_continue(std::set<u32> const& breakpoints) {
+  u64 now = target.m_cycles;
+  if (now == 0)
+    return std::nullopt;
+  auto found = search_backwards(now - 1, [&] {
+    return breakpoints.contains(target.pc);
+  });
+  if (!found && !snapshots.empty())
+    seek(snapshots.front().cycle);
+  return found;
+}
+
+std::optional<u64>
+time_machine::last_write_to(u32 address) {
+  u64 now = target.m_cycles;
+  target.watch_address = address;
+  target.watch_hit = 0;
+  auto found = search_backwards(
+      now, [&] { return target.watch_hit == target.m_cycles; });
+  target.watch_address = cpu::no_watch;
+  if (!found)
+    seek(now);
+  return found;
+}
+
+// Look for the latest cycle no later than limit after which hit() holds,
+// one snapshot window at a time starting with the newest
+template <typename Predicate>
+std::optional<u64>
+time_machine::search_backwards(u64 limit, Predicate hit) {
+  high_water = std::max(high_water, target.m_cycles);
+  for (auto s = snapshots.rbegin(); s != snapshots.rend(); ++s) {
+    if (s->cycle >= limit)
+      continue;
+    u64 window_end = limit;
+    if (s != snapshots.rbegin())
+      window_end = std::min(window_end, std::prev(s)->cycle);
+
+    restore(*s);
+    std::optional<u64> latest;
+    printer saved = target.metaout;
+    target.metaout = printer::nullprinter;
+    while (target.m_cycles < window_end && !target.halted) {
+      target.tick();
+      if (hit())
+        latest = target.m_cycles;
+    }
+    target.metaout = saved;
+
+    if (latest) {
+      seek(*latest);
+      return latest;
+    }
+  }
+  return std::nullopt;
+}
+
+void
+time_machine::restore(snapshot const& snap) {
+  target.m_cycles = snap.cycle;
+  target.m_clock_cycles = snap.clock_cycles;
+  target.halted = snap.halted;
+  target.a = snap.a;
+  target.b = snap.b;
+  target.x = snap.x;
+  target.fa = snap.fa;
+  target.fb = snap.fb;
+  target.fx = snap.fx;
+  target.sp = snap.sp;
+  target.ra = snap.ra;
+  target.pc = snap.pc;
+  target.ctrl = snap.ctrl;
+  target.fault = snap.fault;
+  target.counted = snap.counted;
+  target.random = snap.random;
+  target.events = snap.events;
+  target.next_event.store(snap.next_event);
+  target.pending_interrupts.store(snap.pending_interrupts);
+  for (std::size_t i = 0; i < snap.devices.size(); i++)
+    target.devices[i]->restore_state(snap.devices[i]);
+  target.ram = snap.ram;
+  // Records past the snapshot belong to a future that is being abandoned;
+  // re-executing from here refills the recorder
+  target.flight.clear();
+}
+
+void
+time_machine::run_until(u64 cycle) {
+  printer saved = target.metaout;
+  target.metaout = printer::nullprinter;
+  while (target.m_cycles < cycle && !target.halted)
+    target.tick();
+  target.metaout = saved;
+}
+
+void
+time_machine::thin_snapshots() {
+  // Keep the oldest snapshot and the newer half untouched, drop every other
+  // snapshot in between
+  std::size_t older_half = snapshots.size() / 2;
+  std::deque<snapshot> kept;
+  for (std::size_t i = 0; i < snapshots.size(); i++) {
+    if (i >= older_half || i % 2 == 0)
+      kept.push_back(std::move(snapshots[i]));
+  }
+  snapshots = std::move(kept);
+}
+
+void
+time_machine::prune_history() {
+  // Forget the older half of the remembered inputs. Snapshots from before
+  // the last forgotten input can no longer be re-executed exactly, so they
+  // go too. If none survive the next snapshot is taken as soon as possible.
+  std::size_t half = history.size() / 2;
+  u64 forgotten = history[half - 1].cycle;
+  // inputs consumed by one instruction go together
+  while (half < history.size() && history[half].cycle == forgotten)
+    half++;
+  history.erase(history.begin(), history.begin() + half);
+  while (!snapshots.empty() && snapshots.front().cycle < forgotten)
+    snapshots.pop_front();
+  if (snapshots.empty())
+    next_snapshot = 0;
+}
+
+}  // namespace emulator
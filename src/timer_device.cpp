@@ -0,0 +1,67 @@
+#include "timer_device.hpp"
+
+namespace emulator {
+
+namespace {
+constexpr u32 interval_register = 0x00;
+constexpr u32 control_register = 0x04;
+constexpr u32 count_register = 0x08;
+}  // namespace
+
+timer_device::timer_device(cpu& owner, u32 line) : owner(owner), line(line) {}
+
+u8
+timer_device::read(u32 offset) {
+  if (offset >= count_register)
+    return static_cast<u8>(expirations >> (8 * (count_register + 3 - offset)));
+  return registers[offset];
+}
+
+void
+timer_device::write(u32 offset, u8 value) {
+  if (offset >= count_register)
+    return;
+  registers[offset] = value;
+  if (offset == control_register) {
+    generation++;
+    if (value & 1)
+      arm();
+  }
+}
+
+// The event of a running timer is saved with the cpu's queue and checks the
+// generation, so restoring it brings the timer back as it was
+std::any
+timer_device::save_state() {
+  return state{registers, expirations, generation};
+}
+
+void
+timer_device::restore_state(std::any const& saved) {
+  auto const& s = std::any_cast<state const&>(saved);
+  registers = s.registers;
+  expirations = s.expirations;
+  generation = s.generation;
+}
+
+u32
+timer_device::word_at(u32 offset) const noexcept {
+  return (registers[offset] << 24) | (registers[offset + 1] << 16) |
+         (registers[offset + 2] << 8) | registers[offset + 3];
+}
+
+void
+timer_device::arm() {
+  u32 interval = word_at(interval_register);
+  if (interval == 0)
+    return;
+  owner.schedule(owner.clock_cycles() + interval, [this, armed = generation] {
+    if (armed != generation)
+      return;
+    expirations++;
+    owner.raise_interrupt(line);
+    arm();
+  });
+}
+
+}  // namespace emulator
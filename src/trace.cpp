@@ -0,0 +1,210 @@
+#include "trace.hpp"
+
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+#include "lz.hpp"
+
+namespace emulator {
+
+namespace {
+
+void
+put_u32(std::vector<u8>& out, u32 value) {
+  for (int i = 0; i < 4; i++)
+    out.push_back(static_cast<u8>(value >> (8 * i)));
+}
+
+u32
+get_u32(u8 const* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<u32>(p[3]) << 24);
+}
+
+}  // namespace
+
+trace_writer::trace_writer(std::string const& filename)
+    : filling(trace_format::block_size), pending(trace_format::block_size) {
+  out.open(filename, std::ios::binary | std::ios::trunc);
+  if (!out)
+    throw std::runtime_error("Failed to open trace " + filename);
+  out.write(trace_format::magic, sizeof(trace_format::magic));
+  out.put(static_cast<char>(trace_format::version));
+  writer = std::thread{[this] { write_loop(); }};
+}
+
+trace_writer::~trace_writer() {
+  try {
+    finish();
+  } catch (std::exception const&) {
+  }
+}
+
+u64
+trace_writer::records() const noexcept {
+  return total_records;
+}
+
+void
+trace_writer::finish() {
+  if (!writer.joinable())
+    return;
+  if (used > 0)
+    hand_off();
+  {
+    std::lock_guard lock{mutex};
+    stopping = true;
+  }
+  changed.notify_all();
+  writer.join();
+  out.flush();
+  if (failed || !out)
+    throw std::runtime_error("Failed to write the trace");
+}
+
+void
+trace_writer::hand_off() {
+  std::unique_lock lock{mutex};
+  changed.wait(lock, [this] { return !pending_ready; });
+  std::swap(filling, pending);
+  pending_used = used;
+  pending_records = block_records;
+  pending_ready = true;
+  lock.unlock();
+  changed.notify_all();
+
+  used = 0;
+  block_records = 0;
+  last_pc = last_value = last_address = 0;
+}
+
+void
+trace_writer::write_loop() {
+  std::vector<u8> block;
+  std::unique_lock lock{mutex};
+  while (true) {
+    changed.wait(lock, [this] { return pending_ready || stopping; });
+    if (!pending_ready)
+      return;
+    lock.unlock();
+
+    std::span<u8 const> raw{pending.data(), pending_used};
+    block.clear();
+    put_u32(block, static_cast<u32>(raw.size()));
+    put_u32(block, 0);
+    put_u32(block, pending_records);
+    lz_compress(raw, block);
+    u32 stored = static_cast<u32>(block.size() - 12);
+    if (stored >= raw.size()) {
+      block.resize(12);
+      block.insert(block.end(), raw.begin(), raw.end());
+      stored = static_cast<u32>(raw.size());
+    }
+    for (int i = 0; i < 4; i++)
+      block[4 + i] = static_cast<u8>(stored >> (8 * i));
+    out.write(reinterpret_cast<char const*>(block.data()),
+              static_cast<std::streamsize>(block.size()));
+
+    lock.lock();
+    failed = failed || !out;
+    pending_ready = false;
+    changed.notify_all();
+  }
+}
+
+trace_reader::trace_reader(std::string const& filename)
+    : in(filename, std::ios::binary), filename(filename) {
+  char header[sizeof(trace_format::magic) + 1];
+  if (!in)
+    throw std::runtime_error("Failed to open trace " + filename);
+  if (!in.read(header, sizeof(header)) ||
+      std::memcmp(header, trace_format::magic, sizeof(trace_format::magic)))
+    throw std::runtime_error(filename + " is not a trace");
+  if (static_cast<u8>(header[sizeof(trace_format::magic)]) !=
+      trace_format::version)
+    throw std::runtime_error(filename + " has an unsupported trace version");
+  stored_total = sizeof(header);
+}
+
+bool
+trace_reader::read_block() {
+  u8 header[12];
+  if (!in.read(reinterpret_cast<char*>(header), sizeof(header))) {
+    if (in.gcount() == 0)
+      return false;
+    throw std::runtime_error(filename + " ends in the middle of a block");
+  }
+  u32 raw_size = get_u32(header);
+  u32 stored_size = get_u32(header + 4);
+  block_records = get_u32(header + 8);
+  stored.resize(stored_size);
+  if (!in.read(reinterpret_cast<char*>(stored.data()), stored_size))
+    throw std::runtime_error(filename + " ends in the middle of a block");
+
+  block.clear();
+  if (stored_size == raw_size)
+    block = stored;
+  else
+    lz_decompress(stored, raw_size, block);
+  position = 0;
+  last_pc = last_value = last_address = 0;
+  stored_total += sizeof(header) + stored_size;
+  raw_total += raw_size;
+  return true;
+}
+
+u32
+trace_reader::get_varint() {
+  u32 value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (position >= block.size())
+      break;
+    u8 b = block[position++];
+    value |= static_cast<u32>(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return value;
+  }
+  throw std::runtime_error("Malformed varint in trace " + filename);
+}
+
+bool
+trace_reader::next(trace_record& r) {
+  while (block_records == 0) {
+    if (!read_block())
+      return false;
+  }
+  if (block.size() - position < 2)
+    throw std::runtime_error("Malformed record in trace " + filename);
+  u8 flags = block[position];
+  auto unzigzag = [](u32 v) { return (v >> 1) ^ (0u - (v & 1)); };
+  r.opcode = block[position + 1];
+  position += 2;
+  r.extended = flags & trace_format::extended;
+  r.pc = last_pc + 4;
+  if (flags & trace_format::pc_jump)
+    r.pc += unzigzag(get_varint());
+  r.value = last_value;
+  if (flags & trace_format::value_changed)
+    r.value = get_varint();
+  r.address = trace_record::no_address;
+  if (flags & trace_format::has_address) {
+    r.address = last_address + unzigzag(get_varint());
+    last_address = r.address;
+  }
+  last_pc = r.pc;
+  last_value = r.value;
+  block_records--;
+  return true;
+}
+
+u64
+trace_reader::stored_bytes() const noexcept {
+  return stored_total;
+}
+
+u64
+trace_reader::raw_bytes() const noexcept {
+  return raw_total;
+}
+
+}  // namespace emulator
@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "bytedefs.hpp"
+#include "cpu.hpp"
+#include "trace.hpp"
+
+// Offline analysis of the traces written with TRACE=<file>.
+//
+//   emutrace stats TRACE               record count and compression
+//   emutrace hist TRACE [--top N]      executions of each opcode
+//   emutrace heatmap TRACE [--block BYTES] [--csv]
+//                                      executions and data accesses per block
+//                                      of the address space
+//   emutrace diff TRACE TRACE [--context N]
+//                                      the first record where two runs differ
+
+namespace {
+
+using emulator::u32;
+using emulator::u64;
+using emulator::trace_reader;
+using emulator::trace_record;
+
+void
+usage() {
+  std::cerr << "usage: emutrace stats TRACE\n"
+               "       emutrace hist TRACE [--top N]\n"
+               "       emutrace heatmap TRACE [--block BYTES] [--csv]\n"
+               "       emutrace diff TRACE TRACE [--context N]"
+            << std::endl;
+}
+
+std::string
+opcode_name(emulator::u8 opcode, bool extended) {
+#define BASE(name) {emulator::cpu::opcodes::name, #name}
+#define EXTENDED(name) {emulator::cpu::extended_opcodes::name, #name}
+  static std::map<emulator::u8, std::string> const base = {
+      BASE(MOVE), BASE(AND_R), BASE(OR_R), BASE(NOT_R), BASE(XOR_R),
+      BASE(LLSH_R), BASE(ALSH_R), BASE(LRSH_R), BASE(ARSH_R), BASE(HALT),
+      BASE(AND_I), BASE(OR_I), BASE(NOT_I), BASE(XOR_I), BASE(LLSH_I),
+      BASE(ALSH_I), BASE(LRSH_I), BASE(ARSH_I), BASE(LOAD_AT_ADDR),
+      BASE(STORE_AT_ADDR), BASE(RET), BASE(CALL_FN_I), BASE(INC_A), BASE(INC_B),
+      BASE(INC_X), BASE(ADD_DSS), BASE(SUB_DSS), BASE(MULT_DSS), BASE(ADD_DSI),
+      BASE(SUB_DSI), BASE(MULT_DSI), BASE(SQRT_R_I), BASE(LD_IM_A),
+      BASE(LD_IM_B), BASE(LD_IM_X), BASE(TEST_EQ), BASE(TEST_NEQ),
+      BASE(TEST_CTRL_NEG), BASE(PRINT_I_R), BASE(PUTC_R), BASE(GETC_R),
+      BASE(REG_PUSH), BASE(REG_POP), BASE(POPCNT), BASE(JMP_WITH_OFFSET),
+      BASE(JMP), BASE(BNCH_WITH_OFFSET), BASE(RND_SEED), BASE(RND_NUM),
+      BASE(BNCH), BASE(EXT_INSTR)};
+  static std::map<emulator::u8, std::string> const ext = {
+      EXTENDED(LOAD_FIM_FA), EXTENDED(LOAD_FIM_FB), EXTENDED(FADD_DSS),
+      EXTENDED(FSUB_DSS), EXTENDED(FMULT_DSS), EXTENDED(FADD_DSI),
+      EXTENDED(FSUB_DSI), EXTENDED(FMULT_DSI), EXTENDED(FSQRT_R_I),
+      EXTENDED(RDCYCLE), EXTENDED(RDINSTRET), EXTENDED(RDTIME),
+      EXTENDED(RDBRANCH), EXTENDED(RDMEMOPS),
+      EXTENDED(ATOMIC_CAS), EXTENDED(ATOMIC_FETCH_ADD), EXTENDED(FENCE),
+      EXTENDED(SEND), EXTENDED(RECV), EXTENDED(NODE_ID), EXTENDED(PUTS),
+      EXTENDED(WRITE_BYTES), EXTENDED(READ_BYTES), EXTENDED(RETI),
+      EXTENDED(INT_MASK)};
+#undef BASE
+#undef EXTENDED
+  auto const& names = extended ? ext : base;
+  if (auto it = names.find(opcode); it != names.end())
+    return it->second;
+  char unknown[16];
+  std::snprintf(unknown, sizeof(unknown), "%s0x%02x", extended ? "EXT " : "",
+                opcode);
+  return unknown;
+}
+
+std::string
+describe(trace_record const& r) {
+  char line[96];
+  std::snprintf(line, sizeof(line), "pc 0x%04x  %-18s value 0x%08x", r.pc,
+                opcode_name(r.opcode, r.extended).c_str(), r.value);
+  std::string text = line;
+  if (r.address != trace_record::no_address) {
+    std::snprintf(line, sizeof(line), "  address 0x%04x", r.address);
+    text += line;
+  }
+  return text;
+}
+
+int
+stats(std::string const& file) {
+  trace_reader reader{file};
+  trace_record r;
+  u64 records = 0;
+  while (reader.next(r))
+    records++;
+  double stored = static_cast<double>(reader.stored_bytes());
+  std::printf("%llu records, %llu bytes (%.2f per record), %.1fx compression\n",
+              static_cast<unsigned long long>(records),
+              static_cast<unsigned long long>(reader.stored_bytes()),
+              records ? stored / static_cast<double>(records) : 0.0,
+              stored ? static_cast<double>(reader.raw_bytes()) / stored : 0.0);
+  return 0;
+}
+
+int
+hist(std::string const& file, std::size_t top) {
+  trace_reader reader{file};
+  trace_record r;
+  // extended opcodes count in the upper half
+  std::vector<u64> counts(512);
+  u64 total = 0;
+  while (reader.next(r)) {
+    counts[r.opcode + (r.extended ? 256 : 0)]++;
+    total++;
+  }
+  std::vector<std::size_t> order;
+  for (std::size_t i = 0; i < counts.size(); i++)
+    if (counts[i] > 0)
+      order.push_back(i);
+  std::sort(order.begin(), order.end(),
+            [&](auto l, auto r) { return counts[l] > counts[r]; });
+  if (order.size() > top)
+    order.resize(top);
+
+  std::printf("%-22s %14s %8s\n", "opcode", "count", "share");
+  for (auto i : order) {
+    auto name = opcode_name(static_cast<emulator::u8>(i % 256), i >= 256);
+    std::printf("%-22s %14llu %7.2f%%\n", name.c_str(),
+                static_cast<unsigned long long>(counts[i]),
+                100.0 * static_cast<double>(counts[i]) /
+                    static_cast<double>(total));
+  }
+  std::printf("%-22s %14llu\n", "total",
+              static_cast<unsigned long long>(total));
+  return 0;
+}
+
+int
+heatmap(std::string const& file, u32 block, bool csv) {
+  trace_reader reader{file};
+  trace_record r;
+  std::map<u32, std::pair<u64, u64>> blocks;
+  while (reader.next(r)) {
+    blocks[r.pc / block].first++;
+    if (r.address != trace_record::no_address)
+      blocks[r.address / block].second++;
+  }
+
+  if (csv) {
+    std::printf("address,executed,accessed\n");
+    for (auto const& [index, counts] : blocks)
+      std::printf("%u,%llu,%llu\n", index * block,
+                  static_cast<unsigned long long>(counts.first),
+                  static_cast<unsigned long long>(counts.second));
+    return 0;
+  }
+
+  u64 most = 1;
+  for (auto const& [index, counts] : blocks)
+    most = std::max({most, counts.first, counts.second});
+  // bars scale logarithmically, as a hot loop dwarfs everything else
+  auto bar = [most](u64 n) {
+    if (n == 0)
+      return std::string{};
+    double scale = std::log(static_cast<double>(n)) /
+                   std::log(static_cast<double>(most) + 1);
+    return std::string(1 + static_cast<std::size_t>(23 * scale), '#');
+  };
+  std::printf("%-8s %12s %-24s %12s\n", "block", "executed", "",
+              "accessed");
+  for (auto const& [index, counts] : blocks)
+    std::printf("0x%04x   %12llu %-24s %12llu %s\n", index * block,
+                static_cast<unsigned long long>(counts.first),
+                bar(counts.first).c_str(),
+                static_cast<unsigned long long>(counts.second),
+                bar(counts.second).c_str());
+  return 0;
+}
+
+bool
+same(trace_record const& l, trace_record const& r) {
+  return l.pc == r.pc && l.opcode == r.opcode && l.extended == r.extended &&
+         l.value == r.value && l.address == r.address;
+}
+
+int
+diff(std::string const& left_file,
+     std::string const& right_file,
+     std::size_t context) {
+  trace_reader left{left_file}, right{right_file};
+  trace_record l, r;
+  // the last context records both traces agree on
+  std::vector<trace_record> recent;
+  u64 index = 0;
+  while (true) {
+    bool more_left = left.next(l);
+    bool more_right = right.next(r);
+    if (!more_left && !more_right) {
+      std::printf("The traces are identical, %llu records\n",
+                  static_cast<unsigned long long>(index));
+      return 0;
+    }
+    if (more_left && more_right && same(l, r)) {
+      if (context > 0) {
+        if (recent.size() == context)
+          recent.erase(recent.begin());
+        recent.push_back(l);
+      }
+      index++;
+      continue;
+    }
+
+    std::printf("The traces differ at record %llu\n",
+                static_cast<unsigned long long>(index));
+    u64 first = index - recent.size();
+    for (std::size_t i = 0; i < recent.size(); i++)
+      std::printf("  %10llu  %s\n", static_cast<unsigned long long>(first + i),
+                  describe(recent[i]).c_str());
+    std::printf("< %10llu  %s\n", static_cast<unsigned long long>(index),
+                more_left ? describe(l).c_str() : "(end of trace)");
+    std::printf("> %10llu  %s\n", static_cast<unsigned long long>(index),
+                more_right ? describe(r).c_str() : "(end of trace)");
+    return 1;
+  }
+}
+
+}  // namespace
+
+int
+main(int argc, char const** argv) {
+  if (argc < 3) {
+    usage();
+    return 2;
+  }
+  std::string command = argv[1];
+  std::vector<std::string> files;
+  std::size_t top = 40;
+  std::size_t context = 5;
+  u32 block = 256;
+  bool csv = false;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--top" && has_value) {
+      top = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--context" && has_value) {
+      context = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--block" && has_value) {
+      block = std::max(1ul, std::strtoul(argv[++i], nullptr, 0));
+    } else if (arg == "--csv") {
+      csv = true;
+    } else if (!arg.starts_with("--")) {
+      files.push_back(arg);
+    } else {
+      usage();
+      return 2;
+    }
+  }
+
+  try {
+    if (command == "stats" && files.size() == 1)
+      return stats(files[0]);
+    if (command == "hist" && files.size() == 1)
+      return hist(files[0], top);
+    if (command == "heatmap" && files.size() == 1)
+      return heatmap(files[0], block, csv);
+    if (command == "diff" && files.size() == 2)
+      return diff(files[0], files[1], context);
+  } catch (std::exception const& e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+  usage();
+  return 2;
+}
@@ -9,6 +9,10 @@
 #include <string_view>
 #include <unordered_map>
 
+#include "block_device.hpp"
+#include "dma_controller.hpp"
+#include "timer_device.hpp"
+
 static std::vector<std::string> formats = {{"hex", "oct", "dec", "bin"}};
 static std::unordered_map<std::string, byte_format> format_map = {
     {std::make_pair("hex", byte_format::hex),
@@ -190,19 +194,37 @@ parse_program_spec(std::string const& config_name) {
 }
 
 void
-run_program_spec(std::string_view config_name, emulator::cpu& oncpu) {
+load_program_spec(std::string_view config_name, emulator::cpu& oncpu) {
   auto datae = parse_program_spec(static_cast<std::string>(config_name));
 
+  // "disk:..." sorts before "dma", so a dma controller can reach the disk
+  emulator::block_device* disk = nullptr;
   for (auto const& [file, addr] : datae) {
+    if (file.starts_with("disk:")) {
+      auto device =
+          std::make_unique<emulator::block_device>(file.substr(5), oncpu);
+      disk = device.get();
+      oncpu.add_device(std::move(device), addr,
+                       emulator::block_device::register_count);
+      continue;
+    }
+    if (file == "dma") {
+      oncpu.add_device(std::make_unique<emulator::dma_controller>(oncpu, disk),
+                       addr, emulator::dma_controller::register_count);
+      continue;
+    }
+    if (file == "timer") {
+      oncpu.add_device(std::make_unique<emulator::timer_device>(oncpu), addr,
+                       emulator::timer_device::register_count);
+      continue;
+    }
     auto data = load_binary_file(file);
     oncpu.set_memory(data.data(), data.size(), addr);
   }
-
-  return oncpu.run();
 }
 
 void
-run_program_file(std::string_view filename, emulator::cpu& oncpu) {
+load_program_file(std::string_view filename, emulator::cpu& oncpu) {
   auto data = load_binary_file(static_cast<std::string>(filename));
 
   std::vector<emulator::byte> bootstrap = {{0xE1, 0x00, 0xC0, 0x04}};
@@ -210,5 +232,31 @@ run_program_file(std::string_view filename, emulator::cpu& oncpu) {
   oncpu.set_memory(bootstrap.data(), bootstrap.size(), 0xF000);
 
   oncpu.set_memory(data.data(), data.size(), 0x3000);
+}
+
+void
+load_program(std::string const& name, emulator::cpu& oncpu) {
+  if (name.ends_with(".spec")) {
+    load_program_spec(name, oncpu);
+  } else if (name.ends_with(".prog")) {
+    load_program_file(name, oncpu);
+  } else if (name.ends_with("a.out")) {
+    auto data = load_binary_file(name);
+    oncpu.set_memory(data.data(), data.size(), 0x0000);
+  } else {
+    throw std::invalid_argument("Unknown file type for " + name +
+                                ", specify an a.out, *.spec or *.prog file");
+  }
+}
+
+void
+run_program_spec(std::string_view config_name, emulator::cpu& oncpu) {
+  load_program_spec(config_name, oncpu);
+  return oncpu.run();
+}
+
+void
+run_program_file(std::string_view filename, emulator::cpu& oncpu) {
+  load_program_file(filename, oncpu);
   return oncpu.run();
 }
@@ -1,11 +1,43 @@
 #include <catch2/catch_test_macros.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
-
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "block_device.hpp"
 #include "bytedefs.hpp"
+#include "cluster.hpp"
+#include "console.hpp"
+#include "cost_table.hpp"
 #include "cpu.hpp"
 #include "cpu_breaker.hpp"
+#include "dma_controller.hpp"
+#include "emulator.hpp"
+#include "input_log.hpp"
+#include "lz.hpp"
+#include "machine.hpp"
 #include "memory.hpp"
+#include "memory_profile.hpp"
+#include "perf_baseline.hpp"
 #include "printer.hpp"
+#include "profiler.hpp"
+#include "scheduler.hpp"
+#include "stats_segment.hpp"
+#include "thread_pool.hpp"
+#include "time_machine.hpp"
+#include "timer_device.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 TEST_CASE("byte_of function", "[byte_of]") {
@@ -353,3 +385,1246 @@ TEST_CASE("getting correct memory address", "[memory-offset-calculation]") {
     REQUIRE(offset == 405);
   }
 }
+
+TEST_CASE("Replaying recorded console input", "[input-log]") {
+  std::string const log_file = "test_input_log.bin";
+
+  emulator::byte program[] = {emulator::cpu::opcodes::GETC_R, 0x01, 0x00, 0x00,
+                              emulator::cpu::opcodes::GETC_R, 0x02, 0x00, 0x00,
+                              emulator::cpu::opcodes::HALT,   0x00, 0x00, 0x00};
+
+  {
+    auto log = emulator::input_log::record_to(log_file);
+    emulator::buffer_console io{"hi"};
+    emulator::cpu proc;
+    proc.attach_console(io);
+    proc.attach_input_log(&log);
+    proc.set_memory(program, sizeof(program), 0xF000);
+    proc.run();
+  }
+
+  SECTION("same input without a console") {
+    auto log = emulator::input_log::replay_from(log_file);
+    emulator::buffer_console io;
+    emulator::cpu proc;
+    emulator::cpu_breaker breaker{proc};
+    proc.attach_console(io);
+    proc.attach_input_log(&log);
+    proc.set_memory(program, sizeof(program), 0xF000);
+    proc.run();
+    REQUIRE(breaker.a() == 'h');
+    REQUIRE(breaker.b() == 'i');
+  }
+
+  SECTION("divergence is detected") {
+    auto log = emulator::input_log::replay_from(log_file);
+    REQUIRE_THROWS(log.replay(emulator::input_kind::getc, 2));
+  }
+
+  std::remove(log_file.c_str());
+}
+
+TEST_CASE("Stepping backwards with the time machine", "[time-machine]") {
+  emulator::cpu proc;
+  emulator::cpu_breaker breaker{proc};
+  emulator::time_machine travel{proc, 2};
+  proc.attach_time_machine(&travel);
+
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A,       0x00, 0x00, 0x10,
+      emulator::cpu::opcodes::LD_IM_B,       0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::STORE_AT_ADDR, 0x01, 0x02, 0x00,
+      emulator::cpu::opcodes::INC_B,         0x00, 0x00, 0x00,
+      emulator::cpu::opcodes::STORE_AT_ADDR, 0x01, 0x02, 0x00,
+      emulator::cpu::opcodes::INC_B,         0x00, 0x00, 0x00,
+      emulator::cpu::opcodes::RND_NUM,       0x00, 0x00, 0x03,
+      emulator::cpu::opcodes::HALT,          0x00, 0x00, 0x00};
+  proc.set_memory(program, sizeof(program), 0xF000);
+  proc.run();
+  REQUIRE(proc.cycles() == 8);
+  auto random = breaker.x();
+
+  SECTION("reverse step and replay") {
+    REQUIRE(travel.step_back());
+    REQUIRE(proc.cycles() == 7);
+    REQUIRE_FALSE(proc.is_halted());
+    REQUIRE(breaker.x() == random);
+    REQUIRE(travel.step_back());
+    REQUIRE(breaker.x() == 0);
+    REQUIRE(breaker.b() == 3);
+    REQUIRE(travel.seek(7));
+    REQUIRE(breaker.x() == random);
+  }
+
+  SECTION("flight recorder forgets the abandoned future") {
+    REQUIRE(travel.step_back());
+    auto history = proc.recorder().history();
+    REQUIRE_FALSE(history.empty());
+    REQUIRE(history.back().cycle == proc.cycles());
+    for (std::size_t i = 1; i < history.size(); i++)
+      REQUIRE(history[i - 1].cycle < history[i].cycle);
+  }
+
+  SECTION("last write to an address") {
+    auto found = travel.last_write_to(0x10);
+    REQUIRE(found.has_value());
+    REQUIRE(*found == 5);
+    REQUIRE(breaker.b() == 2);
+    REQUIRE(breaker.pc() == 0xF014);
+  }
+
+  SECTION("reverse continue to a breakpoint") {
+    auto found = travel.reverse_continue({0xF008});
+    REQUIRE(found.has_value());
+    REQUIRE(*found == 2);
+    REQUIRE(breaker.pc() == 0xF008);
+  }
+}
+
+TEST_CASE("Independent cpus on separate threads", "[reentrancy]") {
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::RND_SEED,  0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::RND_NUM,   0x00, 0x00, 0x02,
+      emulator::cpu::opcodes::PRINT_I_R, 0x00, 0x00, 0x02,
+      emulator::cpu::opcodes::GETC_R,    0x03, 0x00, 0x00,
+      emulator::cpu::opcodes::PUTC_R,    0x00, 0x00, 0x03,
+      emulator::cpu::opcodes::HALT,      0x00, 0x00, 0x00};
+
+  auto run = [&](emulator::buffer_console& io) {
+    emulator::cpu proc;
+    proc.metaout = emulator::printer::nullprinter;
+    proc.attach_console(io);
+    proc.set_memory(program, sizeof(program), 0xF000);
+    proc.run();
+  };
+
+  emulator::buffer_console first{"!"}, second{"!"};
+  std::thread t1{run, std::ref(first)};
+  std::thread t2{run, std::ref(second)};
+  t1.join();
+  t2.join();
+
+  REQUIRE(!first.output().empty());
+  REQUIRE(first.output().back() == '!');
+  REQUIRE(first.output() == second.output());
+}
+
+TEST_CASE("Buffered console output", "[console]") {
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A,   0x00, 0x00, 0xff,
+      emulator::cpu::opcodes::PRINT_I_R, 0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::LD_IM_A,   0x00, 0x00, 0x0a,
+      emulator::cpu::opcodes::PUTC_R,    0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::HALT,      0x00, 0x00, 0x00};
+
+  std::stringstream out;
+  std::stringstream in;
+  out << std::hex;
+  emulator::stream_console io{out, in};
+  emulator::cpu proc;
+  proc.attach_console(io);
+  proc.set_memory(program, sizeof(program), 0xF000);
+
+  proc.run_for(3);
+  REQUIRE(out.str().empty());
+  proc.run();
+  REQUIRE(out.str() == "255\n");
+
+  for (std::size_t i = 0; i < emulator::stream_console::buffer_size; i++)
+    io.put_char('x');
+  REQUIRE(out.str() == "255\n");
+  io.put_int(4294967295u);
+  REQUIRE(out.str().size() == 4 + emulator::stream_console::buffer_size);
+  in.str("y");
+  REQUIRE(io.get_char() == 'y');
+  REQUIRE(out.str().ends_with("4294967295"));
+}
+
+TEST_CASE("Bulk console instructions", "[console]") {
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A, 0x00, 0x20, 0x00,
+      EXT_INSTR(PUTS, 0x02, 0x01, 0x00),
+      emulator::cpu::opcodes::LD_IM_X, 0x00, 0x00, 0x03,
+      EXT_INSTR(WRITE_BYTES, 0x01, 0x03, 0x00),
+      emulator::cpu::opcodes::LD_IM_A, 0x00, 0x30, 0x00,
+      emulator::cpu::opcodes::LD_IM_X, 0x00, 0x00, 0x10,
+      EXT_INSTR(READ_BYTES, 0x02, 0x01, 0x03),
+      EXT_INSTR(PUTS, 0x03, 0x01, 0x00),
+      emulator::cpu::opcodes::HALT,    0x00, 0x00, 0x00};
+  std::string const text = "hello";
+
+  auto run = [&](emulator::console& io, emulator::input_log* log) {
+    emulator::cpu proc;
+    emulator::cpu_breaker breaker{proc};
+    proc.attach_console(io);
+    proc.attach_input_log(log);
+    proc.set_memory(text.begin(), text.end(), 0x2000);
+    proc.set_memory(program, sizeof(program), 0xF000);
+    proc.run();
+    REQUIRE(breaker.b() == 3);
+    REQUIRE(breaker.x() == 3);
+  };
+
+  std::string const log_file = "test_bulk_input_log.bin";
+  {
+    auto log = emulator::input_log::record_to(log_file);
+    emulator::buffer_console io{"ab\ncd"};
+    run(io, &log);
+    REQUIRE(io.output() == "hellohelab\n");
+  }
+
+  auto log = emulator::input_log::replay_from(log_file);
+  emulator::buffer_console io;
+  run(io, &log);
+  REQUIRE(io.output() == "hellohelab\n");
+}
+
+TEST_CASE("Memory mapped devices", "[mmio]") {
+  SECTION("console registers") {
+    emulator::byte program[] = {
+        emulator::cpu::opcodes::LD_IM_A,       0x00, 0xfe, 0x00,
+        emulator::cpu::opcodes::LD_IM_B,       0x00, 0x00, 0x41,
+        emulator::cpu::opcodes::STORE_AT_ADDR, 0x01, 0x02, 0x00,
+        emulator::cpu::opcodes::LD_IM_X,       0x00, 0xfe, 0x01,
+        emulator::cpu::opcodes::LOAD_AT_ADDR,  0x03, 0x03, 0x00,
+        emulator::cpu::opcodes::LOAD_AT_ADDR,  0x02, 0x01, 0x00,
+        emulator::cpu::opcodes::HALT,          0x00, 0x00, 0x00};
+    emulator::buffer_console io{"z"};
+    emulator::cpu proc;
+    emulator::cpu_breaker breaker{proc};
+    proc.attach_console(io);
+    proc.set_memory(program, sizeof(program), 0xF000);
+    proc.run();
+    REQUIRE(io.output() == "A");
+    REQUIRE(breaker.x() == 1);
+    REQUIRE(breaker.b() == 'z');
+  }
+
+  SECTION("device ranges") {
+    struct latch : emulator::cpu::ram_type::device_type {
+      emulator::u8
+      read(emulator::u32 offset) override {
+        return static_cast<emulator::u8>(offset + value);
+      }
+      void
+      write(emulator::u32, emulator::u8 v) override {
+        value = v;
+      }
+      emulator::u8 value = 0;
+    } dev;
+
+    emulator::cpu::ram_type ram;
+    ram.map_device(0x1010, 4, dev);
+    REQUIRE_THROWS(ram.map_device(0x1000, 0x11, dev));
+    ram.store(0x1012, 7);
+    ram.store(0x1014, 9);
+    REQUIRE(dev.value == 7);
+    REQUIRE(ram.load(0x1013) == 10);
+    REQUIRE(ram.load(0x1014) == 9);
+    REQUIRE(ram.device_at(0x1010) == &dev);
+
+    ram.unmap_device(dev);
+    REQUIRE(ram.device_at(0x1010) == nullptr);
+    REQUIRE(ram.load(0x1012) == 0);
+  }
+}
+
+TEST_CASE("Block device backed by a file", "[disk]") {
+  std::string const disk_file = "test_disk.img";
+  {
+    std::ofstream f{disk_file, std::ios::binary | std::ios::trunc};
+    std::string sectors(2 * emulator::block_device::sector_size, 'a');
+    sectors[emulator::block_device::sector_size] = 'b';
+    f << sectors;
+  }
+
+  emulator::cpu proc;
+  auto& ram = proc.get_ram();
+  proc.add_device(std::make_unique<emulator::block_device>(disk_file, proc),
+                  0xFE40, emulator::block_device::register_count);
+  auto set_word = [&](emulator::u32 addr, emulator::u32 value) {
+    for (emulator::u32 i = 0; i < 4; i++)
+      ram.store(addr + i, static_cast<emulator::u8>(value >> (24 - 8 * i)));
+  };
+  REQUIRE(ram.load(0xFE40 + 0x13) == 2);
+
+  set_word(0xFE40, 1);
+  set_word(0xFE44, 0x2000);
+  set_word(0xFE48, 1);
+  ram.store(0xFE4C, emulator::block_device::read_command);
+  REQUIRE(ram.load(0xFE4D) == emulator::block_device::status_ok);
+  REQUIRE(ram[0x2000] == 'b');
+  REQUIRE(ram[0x2001] == 'a');
+
+  ram[0x2001] = 'c';
+  set_word(0xFE40, 0);
+  ram.store(0xFE4C, emulator::block_device::write_command);
+  REQUIRE(ram.load(0xFE4D) == emulator::block_device::status_ok);
+
+  set_word(0xFE48, 3);
+  ram.store(0xFE4C, emulator::block_device::read_command);
+  REQUIRE(ram.load(0xFE4D) == emulator::block_device::status_error);
+
+  std::ifstream f{disk_file, std::ios::binary};
+  std::string contents{std::istreambuf_iterator<char>(f), {}};
+  REQUIRE(contents.substr(0, 3) == "bca");
+}
+
+TEST_CASE("Disk reads seen by the time machine", "[disk][time-machine]") {
+  std::string const disk_file = "test_disk_watch.img";
+  {
+    std::ofstream f{disk_file, std::ios::binary | std::ios::trunc};
+    f << std::string(emulator::block_device::sector_size, 'd');
+  }
+
+  emulator::cpu proc;
+  emulator::time_machine travel{proc, 2};
+  proc.attach_time_machine(&travel);
+  auto& ram = proc.get_ram();
+  proc.add_device(std::make_unique<emulator::block_device>(disk_file, proc),
+                  0xFE40, emulator::block_device::register_count);
+  ram.store(0xFE46, 0x20);
+  ram.store(0xFE4B, 1);
+
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A,       0x00, 0xfe, 0x4c,
+      emulator::cpu::opcodes::LD_IM_B,       0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::STORE_AT_ADDR, 0x01, 0x02, 0x00,
+      emulator::cpu::opcodes::INC_B,         0x00, 0x00, 0x00,
+      emulator::cpu::opcodes::HALT,          0x00, 0x00, 0x00};
+  proc.set_memory(program, sizeof(program), 0xF000);
+  proc.run();
+  REQUIRE(ram[0x2000] == 'd');
+
+  auto found = travel.last_write_to(0x21ff);
+  REQUIRE(found.has_value());
+  REQUIRE(*found == 3);
+
+  std::remove(disk_file.c_str());
+}
+
+TEST_CASE("DMA transfers alongside the guest", "[dma]") {
+  emulator::cpu proc;
+  auto& ram = proc.get_ram();
+  emulator::dma_controller dma{proc};
+  ram.map_device(0xFE60, emulator::dma_controller::register_count, dma);
+  auto set_word = [&](emulator::u32 addr, emulator::u32 value) {
+    for (emulator::u32 i = 0; i < 4; i++)
+      ram.store(addr + i, static_cast<emulator::u8>(value >> (24 - 8 * i)));
+  };
+
+  for (emulator::u32 i = 0; i < 0x1000; i++)
+    ram[0x1000 + i] = static_cast<emulator::u8>(i * 7);
+  set_word(0xFE60, 0x1000);
+  set_word(0xFE64, 0x4100);
+  set_word(0xFE68, 0x1000);
+  ram.store(0xFE6C, emulator::dma_controller::ram_to_ram);
+  // fenced pages wait for the copy instead of showing it half done
+  REQUIRE(ram.load(0x50ff) == static_cast<emulator::u8>(0xfff * 7));
+  dma.wait();
+  // the guest sees the transfer finish at a set cycle, not when the copy does
+  REQUIRE(ram.load(0xFE6D) == emulator::dma_controller::status_busy);
+  emulator::byte spin[] = {emulator::cpu::opcodes::JMP, 0x00, 0xf0, 0x00};
+  proc.set_memory(spin, sizeof(spin), 0xF000);
+  proc.run_for(0x1000 / emulator::dma_controller::bytes_per_cycle / 4);
+  REQUIRE(ram.load(0xFE6D) == emulator::dma_controller::status_busy);
+  proc.run_for(0x1000 / emulator::dma_controller::bytes_per_cycle + 1);
+  REQUIRE(ram.load(0xFE6D) == emulator::dma_controller::status_done);
+  for (emulator::u32 i = 0; i < 0x1000; i++)
+    REQUIRE(ram[0x4100 + i] == static_cast<emulator::u8>(i * 7));
+
+  set_word(0xFE64, 0x1800);
+  ram.store(0xFE6C, emulator::dma_controller::ram_to_ram);
+  REQUIRE(ram.load(0xFE6D) == emulator::dma_controller::status_error);
+  ram.store(0xFE6C, emulator::dma_controller::disk_to_ram);
+  REQUIRE(ram.load(0xFE6D) == emulator::dma_controller::status_error);
+}
+
+TEST_CASE("Timer interrupts", "[interrupts]") {
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A,       0x00, 0xfe, 0x23,
+      emulator::cpu::opcodes::LD_IM_B,       0x00, 0x00, 0x32,
+      emulator::cpu::opcodes::STORE_AT_ADDR, 0x01, 0x02, 0x00,
+      emulator::cpu::opcodes::LD_IM_A,       0x00, 0xfe, 0x24,
+      emulator::cpu::opcodes::LD_IM_B,       0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::STORE_AT_ADDR, 0x01, 0x02, 0x00,
+      EXT_INSTR(INT_MASK, 0x00, 0x00, 0x02),
+      emulator::cpu::opcodes::LD_IM_B,       0x00, 0x00, 0x03,
+      emulator::cpu::opcodes::TEST_EQ,       0x00, 0x03, 0x02,
+      emulator::cpu::opcodes::BNCH,          0x00, 0xf0, 0x30,
+      emulator::cpu::opcodes::JMP,           0x00, 0xf0, 0x24,
+      emulator::cpu::opcodes::HALT,          0x00, 0x00, 0x00};
+  emulator::byte handler[] = {
+      emulator::cpu::opcodes::ADD_DSI, 0x03, 0x03, 0x01,
+      EXT_INSTR(RETI, 0x00, 0x00, 0x00)};
+  emulator::byte vector[] = {0x00, 0x00, 0x20, 0x00};
+
+  emulator::cpu proc;
+  emulator::cpu_breaker breaker{proc};
+  proc.add_device(std::make_unique<emulator::timer_device>(proc), 0xFE20,
+                  emulator::timer_device::register_count);
+  proc.set_memory(vector, sizeof(vector), emulator::cpu::interrupt_vectors);
+  proc.set_memory(handler, sizeof(handler), 0x2000);
+  proc.set_memory(program, sizeof(program), 0xF000);
+
+  SECTION("handled while unmasked") {
+    REQUIRE(proc.run_for(10000) == emulator::cpu::stop_reason::halted);
+    REQUIRE(breaker.x() == 3);
+    REQUIRE(proc.cycles() > 150);
+    REQUIRE(breaker.sp() == 0x0100);
+    REQUIRE(proc.get_ram().load(0xFE2B) == 3);
+  }
+
+  SECTION("re-executed the same after going back") {
+    emulator::time_machine travel{proc, 16};
+    proc.attach_time_machine(&travel);
+    proc.run();
+    auto end = proc.cycles();
+    REQUIRE(travel.seek(end / 2));
+    REQUIRE(breaker.x() < 3);
+    proc.run();
+    REQUIRE(proc.cycles() == end);
+    REQUIRE(breaker.x() == 3);
+    REQUIRE(proc.get_ram().load(0xFE2B) == 3);
+  }
+
+  SECTION("other lines stay masked") {
+    // line 3 has no handler, taking it would jump to address 0
+    proc.raise_interrupt(3);
+    REQUIRE(proc.run_for(10000) == emulator::cpu::stop_reason::halted);
+    REQUIRE(breaker.x() == 3);
+  }
+}
+
+TEST_CASE("Interrupt without room on the stack", "[interrupts]") {
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_B, 0x00, 0x00, 0x01,
+      EXT_INSTR(INT_MASK, 0x00, 0x00, 0x02),
+      emulator::cpu::opcodes::LD_IM_A, 0x00, 0xff, 0xfc,
+      emulator::cpu::opcodes::MOVE,    0x04, 0x01, 0x00,
+      emulator::cpu::opcodes::INC_B,   0x00, 0x00, 0x00,
+      emulator::cpu::opcodes::HALT,    0x00, 0x00, 0x00};
+
+  emulator::cpu proc;
+  emulator::cpu_breaker breaker{proc};
+  proc.flight_output = nullptr;
+  proc.set_memory(program, sizeof(program), 0xF000);
+  REQUIRE(proc.run_for(5) == emulator::cpu::stop_reason::cycle_budget);
+  proc.raise_interrupt(0);
+
+  // the fault is reported at INC_B, which never ran
+  REQUIRE(proc.run_for(100) == emulator::cpu::stop_reason::fault);
+  REQUIRE(proc.fault_cause() == emulator::cpu::fault_codes::BAD_ADDRESS);
+  REQUIRE(proc.fault_description().find("pc 0xf014") != std::string::npos);
+  REQUIRE(breaker.b() == 1);
+}
+
+TEST_CASE("Instruction costs and pacing", "[costs]") {
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A,  0x00, 0x00, 0x03,
+      emulator::cpu::opcodes::MULT_DSS, 0x01, 0x01, 0x01,
+      EXT_INSTR(FENCE, 0x00, 0x00, 0x00),
+      emulator::cpu::opcodes::HALT,     0x00, 0x00, 0x00};
+  auto costs = emulator::cost_table::defaults();
+  emulator::cpu proc;
+  proc.set_memory(program, sizeof(program), 0xF000);
+
+  SECTION("default costs") {
+    proc.set_costs(costs);
+    proc.run();
+    REQUIRE(proc.cycles() == 5);
+    REQUIRE(proc.clock_cycles() ==
+            1 + costs.base[emulator::cpu::opcodes::MULT_DSS] + 1 +
+                costs.extended[emulator::cpu::extended_opcodes::FENCE] + 1);
+  }
+
+  SECTION("costs from a file") {
+    std::string const cost_file = "test_costs.spec";
+    {
+      std::ofstream f{cost_file};
+      f << "# hexadecimal like .spec addresses\n"
+           "0x84 = 10\n"
+           "ext:0xCF = 2\n";
+    }
+    costs.load(cost_file);
+    std::remove(cost_file.c_str());
+    proc.set_costs(costs);
+    proc.run();
+    REQUIRE(proc.clock_cycles() == 1 + 16 + 1 + 2 + 1);
+  }
+
+  SECTION("paced") {
+    emulator::byte loop[] = {emulator::cpu::opcodes::JMP_WITH_OFFSET, 0x00,
+                             0x00, 0x04};
+    proc.set_memory(loop, sizeof(loop), 0xF000);
+    proc.set_frequency(1);
+    auto start = std::chrono::steady_clock::now();
+    proc.run_for(20000);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    REQUIRE(elapsed >= std::chrono::milliseconds(19));
+  }
+}
+
+TEST_CASE("Guest faults", "[faults]") {
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A,      0x01, 0x00, 0x00,
+      emulator::cpu::opcodes::LOAD_AT_ADDR, 0x02, 0x01, 0x00,
+      0x37,                                 0x00, 0x00, 0x00,
+      emulator::cpu::opcodes::MOVE,         0x09, 0x01, 0x00,
+      emulator::cpu::opcodes::HALT,         0x00, 0x00, 0x00};
+  // skip the faulting instruction and count the faults in x
+  emulator::byte handler[] = {
+      emulator::cpu::opcodes::ADD_DSI,  0x03, 0x03, 0x01,
+      emulator::cpu::opcodes::REG_POP,  0x00, 0x00, 0x02,
+      emulator::cpu::opcodes::REG_POP,  0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::ADD_DSI,  0x01, 0x01, 0x04,
+      emulator::cpu::opcodes::REG_PUSH, 0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::REG_PUSH, 0x00, 0x00, 0x02,
+      EXT_INSTR(RETI, 0x00, 0x00, 0x00)};
+  emulator::byte vector[] = {0x00, 0x00, 0x20, 0x00};
+
+  emulator::cpu proc;
+  emulator::cpu_breaker breaker{proc};
+  proc.set_memory(program, sizeof(program), 0xF000);
+
+  SECTION("recovered by the trap handler") {
+    proc.set_memory(vector, sizeof(vector), emulator::cpu::trap_vector);
+    proc.set_memory(handler, sizeof(handler), 0x2000);
+    REQUIRE(proc.run_for(1000) == emulator::cpu::stop_reason::halted);
+    REQUIRE(breaker.x() == 3);
+    REQUIRE(breaker.sp() == 0x0100);
+    REQUIRE(proc.fault_cause() ==
+            emulator::cpu::fault_codes::BAD_REGISTER);
+  }
+
+  SECTION("stop the cpu without a handler") {
+    REQUIRE(proc.run_for(1000) == emulator::cpu::stop_reason::fault);
+    REQUIRE(proc.fault_cause() == emulator::cpu::fault_codes::BAD_ADDRESS);
+    REQUIRE(proc.cycles() == 2);
+    REQUIRE(proc.fault_description().find("0xf004") != std::string::npos);
+  }
+
+  SECTION("reported by run") {
+    REQUIRE_THROWS_AS(proc.run(), emulator::guest_fault);
+  }
+}
+
+TEST_CASE("Writing read-only registers", "[faults]") {
+  // copy fault and faddr to b and ra, then skip the faulting instruction
+  emulator::byte handler[] = {
+      emulator::cpu::opcodes::MOVE,     0x02, 0x07, 0x00,
+      emulator::cpu::opcodes::MOVE,     0x05, 0x08, 0x00,
+      emulator::cpu::opcodes::REG_POP,  0x00, 0x00, 0x03,
+      emulator::cpu::opcodes::REG_POP,  0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::ADD_DSI,  0x01, 0x01, 0x04,
+      emulator::cpu::opcodes::REG_PUSH, 0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::REG_PUSH, 0x00, 0x00, 0x03,
+      EXT_INSTR(RETI, 0x00, 0x00, 0x00)};
+  emulator::byte vector[] = {0x00, 0x00, 0x20, 0x00};
+
+  for (emulator::byte reg : {0x06, 0x07, 0x08}) {
+    emulator::byte program[] = {
+        emulator::cpu::opcodes::LD_IM_A, 0x00, 0x00, 0x05,
+        emulator::cpu::opcodes::MOVE,    reg,  0x01, 0x00,
+        emulator::cpu::opcodes::MOVE,    0x03, 0x06, 0x00,
+        emulator::cpu::opcodes::HALT,    0x00, 0x00, 0x00};
+
+    emulator::cpu proc;
+    emulator::cpu_breaker breaker{proc};
+    proc.set_memory(vector, sizeof(vector), emulator::cpu::trap_vector);
+    proc.set_memory(handler, sizeof(handler), 0x2000);
+    proc.set_memory(program, sizeof(program), 0xF000);
+    REQUIRE(proc.run_for(1000) == emulator::cpu::stop_reason::halted);
+    REQUIRE(breaker.b() == emulator::cpu::fault_codes::BAD_REGISTER);
+    REQUIRE(breaker.ra() == reg);
+    REQUIRE(breaker.x() == 0);
+    REQUIRE(breaker.sp() == 0x0100);
+  }
+}
+
+TEST_CASE("Flight recorder", "[flight-recorder]") {
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A,      0x00, 0x00, 0x05,
+      emulator::cpu::opcodes::ADD_DSI,      0x01, 0x01, 0x02,
+      emulator::cpu::opcodes::LD_IM_X,      0x01, 0x00, 0x00,
+      emulator::cpu::opcodes::LOAD_AT_ADDR, 0x02, 0x03, 0x00,
+      emulator::cpu::opcodes::HALT,         0x00, 0x00, 0x00};
+
+  emulator::cpu proc;
+  std::stringstream dump;
+  proc.flight_output = &dump;
+  proc.recorder() = emulator::flight_recorder{3};
+  REQUIRE(proc.recorder().capacity() == 4);
+  proc.set_memory(program, sizeof(program), 0xF000);
+  REQUIRE(proc.run_for(1000) == emulator::cpu::stop_reason::fault);
+
+  // the faulting load is the last of the four records the ring keeps
+  auto history = proc.recorder().history();
+  REQUIRE(history.size() == 4);
+  REQUIRE(history[0].pc == 0xF000);
+  REQUIRE(history[0].value == 5);
+  REQUIRE(history[1].value == 7);
+  REQUIRE(history[3].cycle == 4);
+  REQUIRE(history[3].pc == 0xF00C);
+  REQUIRE(history[3].instruction == 0x21020300);
+  REQUIRE(dump.str().find("bad address") != std::string::npos);
+  REQUIRE(dump.str().find("0xf00c  0x21020300") != std::string::npos);
+
+  dump.str("");
+  proc.request_flight_dump();
+  proc.reset();
+  proc.run_for(1);
+  REQUIRE(dump.str().find("last 0 of 0") != std::string::npos);
+}
+
+TEST_CASE("Execution traces", "[trace]") {
+  std::string const trace_file = "test_trace.emtr";
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A,       0x00, 0x00, 0x05,
+      emulator::cpu::opcodes::LD_IM_X,       0x00, 0x20, 0x00,
+      emulator::cpu::opcodes::STORE_AT_ADDR, 0x03, 0x01, 0x00,
+      emulator::cpu::opcodes::LOAD_AT_ADDR,  0x02, 0x03, 0x00,
+      EXT_INSTR(FENCE, 0x00, 0x00, 0x00),
+      emulator::cpu::opcodes::JMP,           0x00, 0xF0, 0x20,
+      emulator::cpu::opcodes::HALT,          0x00, 0x00, 0x00,
+      emulator::cpu::opcodes::HALT,          0x00, 0x00, 0x00,
+      emulator::cpu::opcodes::HALT,          0x00, 0x00, 0x00};
+
+  {
+    emulator::trace_writer trace{trace_file};
+    emulator::cpu proc;
+    proc.attach_trace(&trace);
+    proc.set_memory(program, sizeof(program), 0xF000);
+    REQUIRE(proc.run_for(1000) == emulator::cpu::stop_reason::halted);
+    REQUIRE(trace.records() == 8);
+  }
+
+  emulator::trace_reader reader{trace_file};
+  std::vector<emulator::trace_record> records;
+  for (emulator::trace_record r; reader.next(r);)
+    records.push_back(r);
+  REQUIRE(records.size() == 8);
+  REQUIRE(records[0].pc == 0xF000);
+  REQUIRE(records[0].value == 5);
+  REQUIRE(records[0].address == emulator::trace_record::no_address);
+  REQUIRE(records[2].opcode == emulator::cpu::opcodes::STORE_AT_ADDR);
+  REQUIRE(records[2].address == 0x2000);
+  REQUIRE(records[3].value == 5);
+  REQUIRE(records[3].address == 0x2000);
+  REQUIRE(records[5].extended);
+  REQUIRE(records[5].opcode == emulator::cpu::extended_opcodes::FENCE);
+  REQUIRE(records[5].pc == 0xF014);
+  REQUIRE(records[7].pc == 0xF020);
+
+  // long runs compress to matches, noise stays literal
+  std::vector<emulator::u8> raw;
+  emulator::rng random{3};
+  for (int i = 0; i < 5000; i++)
+    raw.push_back(i < 2000 ? static_cast<emulator::u8>(i % 7)
+                           : static_cast<emulator::u8>(random.next()));
+  std::vector<emulator::u8> packed, unpacked;
+  emulator::lz_compress(raw, packed);
+  REQUIRE(packed.size() < raw.size());
+  emulator::lz_decompress(packed, raw.size(), unpacked);
+  REQUIRE(unpacked == raw);
+  REQUIRE_THROWS(emulator::lz_decompress(packed, raw.size() + 1, unpacked));
+}
+
+TEST_CASE("Performance counters", "[perf-counters]") {
+  emulator::cpu proc;
+  emulator::cpu_breaker breaker{proc};
+
+  SECTION("cycles, instructions, branches and memory accesses") {
+    // three rounds of a push and a pop; the branch out is taken once
+    emulator::byte program[] = {
+        emulator::cpu::opcodes::LD_IM_X,          0x00, 0x00, 0x03,
+        emulator::cpu::opcodes::REG_PUSH,         0x00, 0x00, 0x03,
+        emulator::cpu::opcodes::REG_POP,          0x00, 0x00, 0x03,
+        emulator::cpu::opcodes::SUB_DSI,          0x03, 0x03, 0x01,
+        emulator::cpu::opcodes::TEST_EQ,          0x00, 0x03, 0x00,
+        emulator::cpu::opcodes::BNCH_WITH_OFFSET, 0x80, 0x00, 0x04,
+        emulator::cpu::opcodes::JMP_WITH_OFFSET,  0x00, 0x00, 0x18,
+        EXT_INSTR(RDCYCLE, 0x01, 0x00, 0x00),
+        EXT_INSTR(RDINSTRET, 0x02, 0x00, 0x00),
+        EXT_INSTR(RDBRANCH, 0x03, 0x00, 0x00),
+        EXT_INSTR(RDMEMOPS, 0x01, 0x02, 0x00),
+        emulator::cpu::opcodes::HALT,             0x00, 0x00, 0x00};
+    proc.set_memory(program, sizeof(program), 0xF000);
+
+    REQUIRE(proc.run_for(24) == emulator::cpu::stop_reason::cycle_budget);
+    REQUIRE(breaker.a() == 20);
+    REQUIRE(breaker.b() == 20);
+    REQUIRE(breaker.x() == 1);
+    REQUIRE(proc.run_for(100) == emulator::cpu::stop_reason::halted);
+    REQUIRE(breaker.a() == 6);
+    REQUIRE(breaker.b() == 0);
+  }
+
+  SECTION("host time is replayed") {
+    emulator::byte program[] = {EXT_INSTR(RDTIME, 0x01, 0x02, 0x00),
+                                EXT_INSTR(RDTIME, 0x03, 0x00, 0x00),
+                                emulator::cpu::opcodes::HALT, 0x00, 0x00,
+                                0x00};
+    std::string const log_file = "test_time_log.bin";
+    {
+      auto log = emulator::input_log::record_to(log_file);
+      proc.attach_input_log(&log);
+      proc.set_memory(program, sizeof(program), 0xF000);
+      proc.run();
+      proc.attach_input_log(nullptr);
+    }
+    emulator::u32 low = breaker.a(), high = breaker.b(), later = breaker.x();
+    REQUIRE((static_cast<emulator::u64>(high) << 32 | low) > 0);
+
+    auto log = emulator::input_log::replay_from(log_file);
+    proc.reset();
+    proc.attach_input_log(&log);
+    proc.run();
+    REQUIRE(breaker.a() == low);
+    REQUIRE(breaker.b() == high);
+    REQUIRE(breaker.x() == later);
+    proc.attach_input_log(nullptr);
+    std::remove(log_file.c_str());
+  }
+}
+
+TEST_CASE("Stats segment", "[stats]") {
+  // prints 1234 and an 'A', reads a character and faults on a bad load
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A,      0x00, 0x04, 0xd2,
+      emulator::cpu::opcodes::PRINT_I_R,    0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::LD_IM_A,      0x00, 0x00, 0x41,
+      emulator::cpu::opcodes::PUTC_R,       0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::GETC_R,       0x02, 0x00, 0x00,
+      emulator::cpu::opcodes::LD_IM_X,      0x01, 0x00, 0x00,
+      emulator::cpu::opcodes::LOAD_AT_ADDR, 0x02, 0x03, 0x00};
+
+  std::string const name = "/emustat-test-" + std::to_string(getpid());
+  {
+    auto segment = emulator::stats_segment::create(name, "test.spec");
+    auto reader = emulator::stats_segment::open(name);
+    REQUIRE(reader.pid() == static_cast<emulator::u64>(getpid()));
+    REQUIRE(reader.program() == "test.spec");
+    REQUIRE(reader.read()->cycles == 0);
+
+    emulator::buffer_console io{"xy"};
+    emulator::counting_console counted{io};
+    emulator::cpu proc;
+    proc.flight_output = nullptr;
+    proc.attach_console(counted);
+    proc.set_memory(program, sizeof(program), 0xF000);
+    emulator::stats_publisher publisher{segment, proc, &counted};
+    publisher.start();
+    REQUIRE(proc.run_for(100) == emulator::cpu::stop_reason::fault);
+    publisher.publish();
+
+    auto s = *reader.read();
+    REQUIRE(io.output() == "1234A");
+    REQUIRE(s.cycles == 7);
+    REQUIRE(s.instructions == 7);
+    REQUIRE(s.io_bytes_out == 5);
+    REQUIRE(s.io_bytes_in == 1);
+    REQUIRE(s.faults == 1);
+    REQUIRE(s.pc == 0xF018);
+    REQUIRE(s.halted == 1);
+    // the program's page and the one the trap vector was looked up in
+    REQUIRE(s.allocated_pages == 2);
+    REQUIRE(s.published_ns > 0);
+  }
+  REQUIRE_THROWS(emulator::stats_segment::open(name));
+
+  // a segment whose owner never cleaned it up
+  {
+    auto segment = emulator::stats_segment::create(name, "test.spec");
+    emulator::stats_segment::remove(name);
+    REQUIRE_THROWS(emulator::stats_segment::open(name));
+  }
+}
+
+TEST_CASE("Memory profile", "[memory-profile]") {
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_X,       0x00, 0x20, 0x00,
+      emulator::cpu::opcodes::STORE_AT_ADDR, 0x03, 0x01, 0x00,
+      emulator::cpu::opcodes::LOAD_AT_ADDR,  0x02, 0x03, 0x00,
+      emulator::cpu::opcodes::REG_PUSH,      0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::REG_PUSH,      0x00, 0x00, 0x02,
+      emulator::cpu::opcodes::REG_POP,       0x00, 0x00, 0x02,
+      emulator::cpu::opcodes::HALT,          0x00, 0x00, 0x00};
+
+  emulator::memory_profile profile{4};
+  emulator::cpu proc;
+  proc.attach_memory_profile(&profile);
+  proc.set_memory(program, sizeof(program), 0xF000);
+  proc.run();
+  REQUIRE(profile.instruction_count() == 7);
+
+  auto const& code = profile.block(0xF000 / 64);
+  REQUIRE(code.fetches == 7);
+  REQUIRE(code.reads + code.writes == 0);
+  REQUIRE(profile.block(0x2000 / 64).reads == 1);
+  REQUIRE(profile.block(0x2000 / 64).writes == 1);
+  REQUIRE(profile.block(0x0100 / 64).reads == 1);
+  REQUIRE(profile.block(0x0100 / 64).writes == 2);
+  REQUIRE(profile.sp_range().first == 0x0100);
+  REQUIRE(profile.sp_range().second == 0x0108);
+
+  // the code, the data and the stack, then the code and the stack
+  auto windows = profile.windows();
+  REQUIRE(windows.size() == 2);
+  REQUIRE(windows[0].first_instruction == 0);
+  REQUIRE(windows[0].blocks == 3);
+  REQUIRE(windows[0].pages == 3);
+  REQUIRE(windows[1].first_instruction == 4);
+  REQUIRE(windows[1].blocks == 2);
+
+  emulator::load_map map;
+  map.segments = {{0xF000, 0xF01C, "main.fn"}};
+  std::stringstream report;
+  profile.write_report(report, &map);
+  REQUIRE(report.str().find("3 of 128 pages used") != std::string::npos);
+  REQUIRE(report.str().find("high-water mark 8 bytes") != std::string::npos);
+  REQUIRE(report.str().find("0xf000   main.fn") != std::string::npos);
+
+  std::stringstream csv;
+  profile.write_csv(csv);
+  REQUIRE(csv.str() ==
+          "address,page,fetches,reads,writes\n"
+          "256,0,0,1,2\n"
+          "8192,8192,0,1,1\n"
+          "61440,61440,7,0,0\n");
+}
+
+TEST_CASE("Sampling profiler", "[profiler]") {
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::CALL_FN_I, 0x00, 0x20, 0x00,
+      emulator::cpu::opcodes::HALT,      0x00, 0x00, 0x00};
+  emulator::byte function[] = {
+      emulator::cpu::opcodes::INC_A, 0x00, 0x00, 0x00,
+      emulator::cpu::opcodes::JMP,   0x00, 0x20, 0x00};
+
+  emulator::load_map map;
+  map.segments = {{0x2000, 0x2008, "spin.fn"}, {0xF000, 0xF008, "main.fn"}};
+  REQUIRE(map.label(0x2000) == "spin.fn");
+  REQUIRE(map.label(0x2004) == "spin.fn+0x4");
+  REQUIRE(map.label(0x3000) == "0x3000");
+  REQUIRE(map.segment_of(0xF004) == "main.fn");
+
+  emulator::cpu proc;
+  proc.set_memory(program, sizeof(program), 0xF000);
+  proc.set_memory(function, sizeof(function), 0x2000);
+  emulator::sampling_profiler profiler{map, 5000};
+  profiler.watch(proc);
+  profiler.start();
+  proc.run_for(~0llu, std::chrono::milliseconds(50));
+  profiler.stop();
+  REQUIRE(proc.position().depth == 1);
+  REQUIRE(profiler.samples() > 0);
+
+  std::stringstream folded;
+  profiler.write_folded(folded);
+  REQUIRE(folded.str().starts_with("main.fn;spin.fn "));
+}
+
+TEST_CASE("Perf baselines", "[perf]") {
+  std::string const baseline_file = "test_baseline.json";
+  std::remove(baseline_file.c_str());
+  REQUIRE(emulator::perf_baseline::read(baseline_file).values.empty());
+
+  emulator::perf_baseline baseline;
+  baseline.values["dispatch/ADD_DSS"] = 2.5;
+  baseline.values["loader/\"quoted\""] = 1e5;
+  baseline.write(baseline_file);
+
+  auto read = emulator::perf_baseline::read(baseline_file);
+  REQUIRE(read.values == baseline.values);
+  REQUIRE(read.find("dispatch/ADD_DSS") == 2.5);
+  REQUIRE(!read.find("dispatch/SUB_DSS"));
+
+  std::ofstream{baseline_file} << "{\"a\": 1,";
+  REQUIRE_THROWS_AS(emulator::perf_baseline::read(baseline_file),
+                    std::runtime_error);
+}
+
+TEST_CASE("Thread pool runs every task", "[thread-pool]") {
+  std::atomic<int> done = 0;
+  emulator::thread_pool pool{4};
+  for (int i = 0; i < 1000; i++)
+    pool.submit([&] { done++; });
+  pool.wait_idle();
+  REQUIRE(done == 1000);
+
+  pool.submit([&] { done++; });
+  pool.wait_idle();
+  REQUIRE(done == 1001);
+}
+
+TEST_CASE("Running with a cycle budget", "[run-for]") {
+  emulator::cpu proc;
+  emulator::byte loop[] = {emulator::cpu::opcodes::JMP_WITH_OFFSET, 0x00, 0x00,
+                           0x04};
+  proc.set_memory(loop, sizeof(loop), 0xF000);
+  REQUIRE(proc.run_for(500) == emulator::cpu::stop_reason::cycle_budget);
+  REQUIRE(proc.cycles() == 500);
+  REQUIRE_FALSE(proc.is_halted());
+}
+
+TEST_CASE("Cores sharing memory with atomic increments", "[smp]") {
+  emulator::metaout = emulator::printer::nullprinter;
+  emulator::machine smp{4};
+
+  // each core adds 1 to the word at 0x2000 a thousand times, then copies
+  // its core id into b
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A, 0x00, 0x20, 0x00,
+      emulator::cpu::opcodes::LD_IM_B, 0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::LD_IM_X, 0x00, 0x03, 0xe8,
+      EXT_INSTR(ATOMIC_FETCH_ADD, 0x05, 0x01, 0x02),
+      emulator::cpu::opcodes::SUB_DSI, 0x03, 0x03, 0x01,
+      emulator::cpu::opcodes::TEST_EQ, 0x00, 0x03, 0x00,
+      emulator::cpu::opcodes::BNCH_WITH_OFFSET, 0x80, 0x00, 0x04,
+      emulator::cpu::opcodes::JMP_WITH_OFFSET, 0x00, 0x00, 0x18,
+      emulator::cpu::opcodes::MOVE, 0x02, 0x06, 0x00,
+      emulator::cpu::opcodes::HALT, 0x00, 0x00, 0x00};
+  emulator::byte counter[4] = {0, 0, 0, 0};
+
+  for (unsigned i = 0; i < smp.core_count(); i++)
+    smp.core(i).metaout = emulator::printer::nullprinter;
+  smp.core(0).set_memory(program, sizeof(program), 0xF000);
+  smp.core(0).set_memory(counter, sizeof(counter), 0x2000);
+  smp.run();
+
+  emulator::cpu_breaker first{smp.core(0)};
+  REQUIRE(first.fetch(0x2000) == 4000);
+  for (unsigned i = 0; i < smp.core_count(); i++) {
+    emulator::cpu_breaker core{smp.core(i)};
+    REQUIRE(core.b() == i);
+    REQUIRE(core.sp() == 0x0100 + i * emulator::machine::default_stack_stride);
+  }
+}
+
+TEST_CASE("Cores printing to one stream console", "[smp]") {
+  emulator::metaout = emulator::printer::nullprinter;
+  emulator::machine smp{4};
+
+  // each core prints 'a' plus its core id two thousand times
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_X, 0x00, 0x07, 0xd0,
+      emulator::cpu::opcodes::LD_IM_A, 0x00, 0x00, 'a',
+      emulator::cpu::opcodes::ADD_DSS, 0x01, 0x01, 0x06,
+      emulator::cpu::opcodes::PUTC_R, 0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::SUB_DSI, 0x03, 0x03, 0x01,
+      emulator::cpu::opcodes::TEST_EQ, 0x00, 0x03, 0x00,
+      emulator::cpu::opcodes::BNCH_WITH_OFFSET, 0x80, 0x00, 0x04,
+      emulator::cpu::opcodes::JMP_WITH_OFFSET, 0x00, 0x00, 0x14,
+      emulator::cpu::opcodes::HALT, 0x00, 0x00, 0x00};
+
+  std::ostringstream out;
+  std::istringstream in;
+  {
+    emulator::stream_console shared{out, in};
+    for (unsigned i = 0; i < smp.core_count(); i++) {
+      smp.core(i).metaout = emulator::printer::nullprinter;
+      smp.core(i).attach_console(shared);
+    }
+    smp.core(0).set_memory(program, sizeof(program), 0xF000);
+    smp.run();
+  }
+
+  auto printed = out.str();
+  REQUIRE(printed.size() == 4 * 2000);
+  for (char c : {'a', 'b', 'c', 'd'})
+    REQUIRE(std::count(printed.begin(), printed.end(), c) == 2000);
+}
+
+TEST_CASE("Output while another cpu waits for input", "[smp]") {
+  emulator::metaout = emulator::printer::nullprinter;
+
+  // input that blocks until the test opens it
+  struct gated_input : std::streambuf {
+    int
+    underflow() override {
+      std::unique_lock guard{lock};
+      waiting = true;
+      opened.wait(guard, [this] { return open; });
+      setg(&next, &next, &next + 1);
+      return next;
+    }
+
+    std::mutex lock;
+    std::condition_variable opened;
+    bool open = false;
+    std::atomic<bool> waiting = false;
+    char next = 'x';
+  };
+
+  emulator::byte reader[] = {emulator::cpu::opcodes::GETC_R, 0x01, 0x00, 0x00,
+                             emulator::cpu::opcodes::HALT, 0x00, 0x00, 0x00};
+  emulator::byte writer[] = {
+      emulator::cpu::opcodes::LD_IM_A, 0x00, 0x00, 'k',
+      emulator::cpu::opcodes::PUTC_R,  0x00, 0x00, 0x01,
+      emulator::cpu::opcodes::HALT,    0x00, 0x00, 0x00};
+
+  gated_input gate;
+  std::istream in{&gate};
+  std::ostringstream out;
+  emulator::stream_console shared{out, in};
+  emulator::cpu waiting, printing;
+  waiting.attach_console(shared);
+  printing.attach_console(shared);
+  waiting.set_memory(reader, sizeof(reader), 0xF000);
+  printing.set_memory(writer, sizeof(writer), 0xF000);
+
+  std::thread first{[&] { waiting.run(); }};
+  while (!gate.waiting)
+    std::this_thread::yield();
+  std::atomic<bool> printed = false;
+  std::thread second{[&] {
+    printing.run();
+    printed = true;
+  }};
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (!printed && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::yield();
+  bool finished = printed;
+
+  {
+    std::lock_guard guard{gate.lock};
+    gate.open = true;
+  }
+  gate.opened.notify_all();
+  first.join();
+  second.join();
+  REQUIRE(finished);
+  REQUIRE(out.str() == "k");
+}
+
+TEST_CASE("Cores using the console registers", "[smp]") {
+  emulator::metaout = emulator::printer::nullprinter;
+  emulator::machine smp{2};
+
+  // echo one byte through the memory mapped console
+  emulator::byte program[] = {
+      emulator::cpu::opcodes::LD_IM_A, 0x00, 0xfe, 0x00,
+      emulator::cpu::opcodes::LOAD_AT_ADDR, 0x02, 0x01, 0x00,
+      emulator::cpu::opcodes::STORE_AT_ADDR, 0x01, 0x02, 0x00,
+      emulator::cpu::opcodes::HALT, 0x00, 0x00, 0x00};
+
+  emulator::buffer_console first{"x"};
+  emulator::buffer_console second{"y"};
+  smp.core(0).attach_console(first);
+  smp.core(1).attach_console(second);
+  for (unsigned i = 0; i < smp.core_count(); i++)
+    smp.core(i).metaout = emulator::printer::nullprinter;
+  smp.core(0).set_memory(program, sizeof(program), 0xF000);
+  smp.run();
+
+  REQUIRE(first.output() == "x");
+  REQUIRE(second.output() == "y");
+}
+
+TEST_CASE("Scheduling many guests waiting on input", "[scheduler]") {
+  emulator::metaout = emulator::printer::nullprinter;
+  constexpr int guests = 100;
+
+  emulator::byte echo[] = {emulator::cpu::opcodes::GETC_R, 0x01, 0x00, 0x00,
+                           emulator::cpu::opcodes::PUTC_R, 0x00, 0x00, 0x01,
+                           emulator::cpu::opcodes::HALT,   0x00, 0x00, 0x00};
+
+  std::vector<std::unique_ptr<emulator::queue_console>> consoles;
+  std::vector<std::unique_ptr<emulator::cpu>> cpus;
+  emulator::scheduler sched{2};
+  for (int i = 0; i < guests; i++) {
+    consoles.push_back(std::make_unique<emulator::queue_console>());
+    cpus.push_back(std::make_unique<emulator::cpu>());
+    cpus.back()->metaout = emulator::printer::nullprinter;
+    cpus.back()->attach_console(*consoles.back());
+    cpus.back()->set_memory(echo, sizeof(echo), 0xF000);
+    sched.spawn(*cpus.back(), 1);
+  }
+
+  std::thread runner{[&] { sched.run(); }};
+  for (int i = 0; i < guests; i++) {
+    consoles[i]->feed(std::string(1, static_cast<char>('a' + i % 26)));
+    sched.wake();
+  }
+  runner.join();
+
+  for (int i = 0; i < guests; i++) {
+    REQUIRE(cpus[i]->is_halted());
+    REQUIRE(consoles[i]->output() ==
+            std::string(1, static_cast<char>('a' + i % 26)));
+  }
+}
+
+TEST_CASE("Waking a guest while another one is busy", "[scheduler]") {
+  emulator::metaout = emulator::printer::nullprinter;
+  // spins on the console status register until its console has input
+  emulator::byte busy[] = {
+      emulator::cpu::opcodes::LD_IM_A,      0x00, 0xfe, 0x01,
+      emulator::cpu::opcodes::LOAD_AT_ADDR, 0x02, 0x01, 0x00,
+      emulator::cpu::opcodes::TEST_EQ,      0x00, 0x02, 0x00,
+      emulator::cpu::opcodes::BNCH,         0x00, 0xf0, 0x04,
+      emulator::cpu::opcodes::HALT,         0x00, 0x00, 0x00};
+  emulator::byte echo[] = {emulator::cpu::opcodes::GETC_R, 0x01, 0x00, 0x00,
+                           emulator::cpu::opcodes::PUTC_R, 0x00, 0x00, 0x01,
+                           emulator::cpu::opcodes::HALT,   0x00, 0x00, 0x00};
+
+  emulator::queue_console busy_io, echo_io;
+  emulator::cpu busy_cpu, echo_cpu;
+  for (auto* proc : {&busy_cpu, &echo_cpu})
+    proc->metaout = emulator::printer::nullprinter;
+  busy_cpu.attach_console(busy_io);
+  echo_cpu.attach_console(echo_io);
+  busy_cpu.set_memory(busy, sizeof(busy), 0xF000);
+  echo_cpu.set_memory(echo, sizeof(echo), 0xF000);
+
+  emulator::scheduler sched{1};
+  sched.spawn(busy_cpu, 1000);
+  sched.spawn(echo_cpu, 1000);
+  std::thread runner{[&] { sched.run(); }};
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  echo_io.feed("x");
+  sched.wake();
+
+  // the echo guest runs although the busy guest never stops for input
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (echo_io.output().empty() &&
+         std::chrono::steady_clock::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  std::string echoed = echo_io.output();
+  busy_io.feed("q");
+  runner.join();
+
+  REQUIRE(echoed == "x");
+  REQUIRE(echo_cpu.is_halted());
+  REQUIRE(busy_cpu.is_halted());
+}
+
+TEST_CASE("Nodes exchanging messages through shared memory", "[cluster]") {
+  std::string name = "emulator-test-" + std::to_string(getpid());
+  emulator::cluster first{name, 0, 2};
+  emulator::cluster second{name, 1, 2};
+
+  SECTION("guest send and receive") {
+    emulator::byte sender[] = {
+        EXT_INSTR(NODE_ID, 0x01, 0x05, 0x00),
+        emulator::cpu::opcodes::LD_IM_B, 0x00, 0x00, 0x01,
+        emulator::cpu::opcodes::LD_IM_X, 0x00, 0x00, 0x2a,
+        EXT_INSTR(SEND, 0x02, 0x03, 0x00),
+        emulator::cpu::opcodes::HALT,    0x00, 0x00, 0x00};
+    emulator::byte receiver[] = {
+        EXT_INSTR(RECV, 0x01, 0x00, 0x00),
+        emulator::cpu::opcodes::HALT, 0x00, 0x00, 0x00};
+
+    emulator::cpu a, b;
+    emulator::cpu_breaker ba{a}, bb{b};
+    a.attach_cluster(first);
+    b.attach_cluster(second);
+    a.set_memory(sender, sizeof(sender), 0xF000);
+    b.set_memory(receiver, sizeof(receiver), 0xF000);
+    a.run();
+    b.run();
+
+    REQUIRE(ba.a() == 0);
+    REQUIRE(ba.ra() == 2);
+    REQUIRE(bb.a() == 42);
+    REQUIRE(bb.ctrl() & emulator::cpu::ctrl_bits::CTRL_TEST_TRUE);
+  }
+
+  SECTION("messages are recorded and replayed") {
+    emulator::byte sender[] = {
+        emulator::cpu::opcodes::LD_IM_B, 0x00, 0x00, 0x01,
+        emulator::cpu::opcodes::LD_IM_X, 0x00, 0x00, 0x2a,
+        EXT_INSTR(SEND, 0x02, 0x03, 0x00),
+        emulator::cpu::opcodes::HALT,    0x00, 0x00, 0x00};
+    emulator::byte receiver[] = {
+        EXT_INSTR(RECV, 0x01, 0x00, 0x00),
+        EXT_INSTR(RECV, 0x02, 0x00, 0x00),
+        emulator::cpu::opcodes::HALT, 0x00, 0x00, 0x00};
+    std::string const send_log = "test_send_log.bin";
+    std::string const recv_log = "test_recv_log.bin";
+    {
+      auto sends = emulator::input_log::record_to(send_log);
+      auto receives = emulator::input_log::record_to(recv_log);
+      emulator::cpu a, b;
+      a.attach_cluster(first);
+      b.attach_cluster(second);
+      a.attach_input_log(&sends);
+      b.attach_input_log(&receives);
+      a.set_memory(sender, sizeof(sender), 0xF000);
+      b.set_memory(receiver, sizeof(receiver), 0xF000);
+      a.run();
+      b.run();
+    }
+
+    // the replayed sender does not send again, and the replayed receiver
+    // gets the message without a cluster
+    auto sends = emulator::input_log::replay_from(send_log);
+    auto receives = emulator::input_log::replay_from(recv_log);
+    emulator::cpu a, b;
+    emulator::cpu_breaker bb{b};
+    a.attach_cluster(first);
+    a.attach_input_log(&sends);
+    b.attach_input_log(&receives);
+    a.set_memory(sender, sizeof(sender), 0xF000);
+    b.set_memory(receiver, sizeof(receiver), 0xF000);
+    a.run();
+    b.run();
+    REQUIRE(bb.a() == 42);
+    REQUIRE(bb.b() == 0);
+    REQUIRE_FALSE(bb.ctrl() & emulator::cpu::ctrl_bits::CTRL_TEST_TRUE);
+    REQUIRE_FALSE(second.receive(0).has_value());
+    std::remove(send_log.c_str());
+    std::remove(recv_log.c_str());
+  }
+
+  SECTION("re-execution does not send again") {
+    emulator::byte sender[] = {
+        emulator::cpu::opcodes::LD_IM_B, 0x00, 0x00, 0x01,
+        emulator::cpu::opcodes::LD_IM_X, 0x00, 0x00, 0x2a,
+        EXT_INSTR(SEND, 0x02, 0x03, 0x00),
+        emulator::cpu::opcodes::HALT,    0x00, 0x00, 0x00};
+    emulator::cpu a;
+    emulator::cpu_breaker ba{a};
+    emulator::time_machine travel{a, 100};
+    a.attach_time_machine(&travel);
+    a.attach_cluster(first);
+    a.set_memory(sender, sizeof(sender), 0xF000);
+    a.run();
+
+    REQUIRE(travel.step_back());
+    REQUIRE(ba.ctrl() & emulator::cpu::ctrl_bits::CTRL_TEST_TRUE);
+    REQUIRE(second.receive(0) == 42u);
+    REQUIRE_FALSE(second.receive(0).has_value());
+  }
+
+  SECTION("messages left by an earlier run") {
+    std::string stale = name + "-stale";
+    {
+      emulator::cluster earlier{stale, 0, 2};
+      REQUIRE(earlier.send(1, 7));
+    }
+    emulator::cluster sender{stale, 0, 2};
+    {
+      emulator::cluster receiver{stale, 1, 2};
+      REQUIRE_FALSE(receiver.receive(0).has_value());
+      REQUIRE(sender.send(1, 8));
+      REQUIRE(receiver.receive(0) == 8u);
+    }
+    // the receiver removed its ring from the sender when it was destroyed
+    int fd = shm_open(("/" + stale + "-0-1").c_str(), O_RDONLY, 0);
+    REQUIRE(fd < 0);
+    emulator::cluster::unlink(stale, 2);
+  }
+
+  SECTION("full and empty rings") {
+    REQUIRE_FALSE(second.receive(0).has_value());
+    for (emulator::u32 i = 0; i < emulator::cluster::ring_capacity; i++)
+      REQUIRE(first.send(1, i));
+    REQUIRE_FALSE(first.send(1, 0));
+    REQUIRE(second.receive(0) == 0u);
+    REQUIRE(first.send(1, 0));
+  }
+
+  emulator::cluster::unlink(name, 2);
+}